@@ -0,0 +1,92 @@
+#ifndef ASYNC_M02_PRO_H
+#define ASYNC_M02_PRO_H
+
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+
+#include "coroutine.h"
+#include "event_loop.h"
+#include "feed_thread.h"
+#include "m02_pro.h"
+#include "printer_interface.h"
+#include "status.h"
+
+namespace sticker_bot {
+
+/*
+ * The M02 Pro over a non-blocking fd, driven by an EventLoop. Waiting on the
+ * printer suspends the coroutine rather than a thread, so one loop can feed
+ * several printers, and other work on the loop carries on while one prints.
+ *
+ *   Status status = co_await printer->PrintImageAsync(data, width);
+ *
+ * The loop's thread does all the writing, so options.feed's priority and CPU
+ * are left to whoever runs the loop, with SetFeedThread(). Only lock_memory
+ * is used here.
+ */
+class AsyncM02Pro : public PrinterInterface {
+  public:
+    /* loop has to outlive the printer. */
+    static std::expected<std::unique_ptr<AsyncM02Pro>, Status>
+        Create(const std::string &path, EventLoop *loop,
+               const M02ProOptions &options = kDefaultM02ProOptions);
+
+    AsyncM02Pro(int fd, std::string_view path, EventLoop *loop,
+                const M02ProOptions &options) :
+        fd_(fd),
+        path_(path),
+        loop_(loop),
+        options_(options),
+        mu_printer_(loop) {}
+    ~AsyncM02Pro() { close(fd_); }
+
+    /*
+     * data has to stay valid until it's done. Only co_await these from the
+     * loop's thread.
+     */
+    Task<Status> PrintImageAsync(std::span<const uint8_t> data,
+                                 uint16_t width);
+    Task<Status> PrinterStatusAsync();
+
+    /*
+     * For everything else, these run the above on the loop and wait for them.
+     * Not from the loop's thread.
+     */
+    Status PrintImage(std::span<const uint8_t> data, uint16_t width) override
+    {
+        return loop_->Run(PrintImageAsync(data, width)).get();
+    }
+    Status PrinterStatus() override
+    {
+        return loop_->Run(PrinterStatusAsync()).get();
+    }
+    std::string StatsString() override { return jitter_.StatsString(); }
+
+  private:
+    /* Everything up to the printer's reply. */
+    Task<Status> SendImage(std::span<const uint8_t> data, uint16_t bytes_x,
+                           uint16_t bytes_y);
+    Task<Status> SendCmd(std::span<const uint8_t> data);
+    /*
+     * Like M02Pro::ReadData(), 0 for min_to_read returns after the first read
+     * that gets anything.
+     */
+    Task<Status> ReadData(std::span<uint8_t> data, size_t min_to_read);
+
+    int fd_;
+    const std::string path_;
+    EventLoop *loop_;
+    const M02ProOptions options_;
+    /* One command at a time, the replies don't say which they're for. */
+    AsyncMutex mu_printer_;
+    FeedJitter jitter_;
+};
+
+};
+
+#endif
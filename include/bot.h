@@ -1,38 +1,357 @@
 #ifndef BOT_H
 #define BOT_H
 
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <future>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <span>
 #include <string>
 #include <string_view>
 #include <vector>
 
 #include "tgbot/tgbot.h"
 #include "status.h"
+#include "converter_pool.h"
+#include "http_client.h"
 #include "printer_interface.h"
 #include "image_transform.h"
+#include "job_journal.h"
+#include "layout.h"
+#include "print_job.h"
+#include "png_encoder.h"
+#include "print_scheduler.h"
+#include "raster_cache.h"
+#include "text_renderer.h"
+#include "worker_pool.h"
 
 namespace sticker_bot {
 
+enum class PhotoSizePolicy {
+    /* The smallest size that still fills the print width, the default. */
+    kSmallestSufficient,
+    /* The biggest size Telegram has, i.e. the original. */
+    kLargest,
+};
+
+/* How far a job's print quality is cut back to keep up with the queue. */
+enum class QualityLevel : uint8_t {
+    kFull = 0,
+    /* A cheaper resampling filter, and no status poll after each job. */
+    kReduced = 1,
+    /* As well as that, ordered dither instead of error diffusion. */
+    kMinimal = 2,
+};
+
+/*
+ * The load at which jobs drop to a quality level. Reaching either is enough,
+ * and a 0 is never reached.
+ */
+typedef struct QualityThreshold {
+    /* Jobs still queued behind the one starting. */
+    size_t queue_depth;
+    /* What the scheduler projects the last of them will wait. */
+    double wait_s;
+} QualityThreshold;
+
+typedef struct BotOptions {
+    PhotoSizePolicy photo_size_policy;
+    /*
+     * Dots across the paper. A photo size is sufficient if its short side,
+     * which is what ends up across the paper after rotation, is this big.
+     */
+    uint32_t print_width;
+    /*
+     * If set, e.g. "https://example.com:8443", Telegram pushes updates there
+     * instead of the bot long polling for them. TLS has to be terminated in
+     * front of the bot, e.g. by a reverse proxy forwarding to webhook_port.
+     */
+    std::string webhook_url;
+    uint16_t webhook_port;
+    /*
+     * Required with webhook_url. Updates are only accepted on /<secret>, so
+     * nobody who doesn't know it can make the bot print.
+     */
+    std::string webhook_secret;
+    /* Where the Bot API is, e.g. a local fake one for load testing. */
+    std::string api_url;
+    /*
+     * Files downloaded at once. Downloads start when a job is queued, so they
+     * overlap with printing the jobs ahead of it.
+     */
+    uint32_t download_concurrency;
+    /*
+     * The converter worker that runs ImageMagick, from make convert_worker.
+     * If it can't be started, convert is run with popen() instead.
+     */
+    std::string convert_worker_path;
+    /* 0 for one per core. */
+    uint32_t convert_workers;
+    /*
+     * Checked as each job starts, so quality comes back as soon as the queue
+     * has drained below them.
+     */
+    QualityThreshold reduced_quality;
+    QualityThreshold minimal_quality;
+    /* Chats allowed to run admin commands such as /prefetch. */
+    std::vector<int64_t> admin_chat_ids;
+    /* Memory for rendered stickers kept around to print again, 0 for none. */
+    size_t raster_cache_bytes;
+    /*
+     * Most of a chat's queued stickers packed into one print, for chats
+     * printing side by side. Caps how long one print holds the printer.
+     */
+    size_t max_layout_batch;
+    /* Text messages are printed with these, if FreeType is built in. */
+    TextOptions text;
+    /*
+     * Previews whose buttons still work, per bot. Older ones answer that
+     * they've expired.
+     */
+    size_t max_previews;
+    /* Blank borders around stickers and photos aren't printed. */
+    TrimOptions trim;
+} BotOptions;
+
+/* Not constexpr, api_url is too long for std::string to store inline. */
+inline const BotOptions kDefaultBotOptions = {
+    .photo_size_policy = PhotoSizePolicy::kSmallestSufficient,
+    .print_width = 576,
+    .webhook_url = "",
+    .webhook_port = 8443,
+    .webhook_secret = "",
+    .api_url = "https://api.telegram.org",
+    .download_concurrency = 4,
+    .convert_worker_path = "./convert_worker.elf",
+    .convert_workers = 0,
+    .reduced_quality = {.queue_depth = 5, .wait_s = 60},
+    .minimal_quality = {.queue_depth = 15, .wait_s = 180},
+    .admin_chat_ids = {},
+    .raster_cache_bytes = 32 << 20,
+    .max_layout_batch = 6,
+    .text = kDefaultTextOptions,
+    .max_previews = 256,
+    .trim = kDefaultTrimOptions,
+};
+
+/* How long one stage of printing a job has been taking. */
+typedef struct StageTiming {
+    uint64_t count;
+    double total_ms;
+    double max_ms;
+} StageTiming;
+
 class Bot {
   public:
-    /* Token needs to be mutable for the tgbot ctor. */
-    Bot(std::string token, std::unique_ptr<PrinterInterface> printer) :
-        bot_(token),
-        printer_(std::move(printer)) {}
+    /*
+     * Token needs to be mutable for the tgbot ctor. journal may be null, jobs
+     * are then lost on a restart.
+     */
+    Bot(std::string token, std::unique_ptr<PrinterInterface> printer,
+        std::unique_ptr<JobJournal> journal,
+        BotOptions options = kDefaultBotOptions) :
+        options_(options),
+        bot_(token, http_client_, options.api_url),
+        printer_(std::move(printer)),
+        journal_(std::move(journal)),
+        raster_cache_(options.raster_cache_bytes),
+        download_pool_(options.download_concurrency),
+        prefetch_pool_(1),
+        preview_scheduler_(kDefaultSchedulerOptions),
+        scheduler_(kDefaultSchedulerOptions) {}
 
     void InitBot();
+    /*
+     * Reprints anything left in the journal, then handles messages, from the
+     * webhook if one is configured and by long polling otherwise.
+     */
     Status RunBot();
+    /* Queue, download and per-stage stats, as sent for /stats. */
+    std::string StatsString();
 
   private:
-    Status PrintStickers(const std::vector<std::string> &file_paths);
-    void PrintStickersAsync(const std::vector<std::string> &file_paths,
-                            TgBot::Message::Ptr message);
+    typedef std::chrono::steady_clock Clock;
+    typedef std::expected<std::string, Status> DownloadResult;
+    typedef std::expected<Raster, Status> RenderResult;
+
+    /*
+     * A file being downloaded and rendered, shared by every job queued for it
+     * while it's in flight.
+     */
+    typedef struct InFlightFile {
+        /* From RenderKey(). */
+        std::string key;
+        std::shared_future<DownloadResult> download;
+        std::mutex mu;
+        /* Rendered by the first of the jobs to run, the rest print it too. */
+        std::optional<RenderResult> raster;
+    } InFlightFile;
+
+    /* A job waiting to be packed with the rest of its chat's. */
+    typedef struct LayoutJob {
+        PrintJob job;
+        std::shared_ptr<InFlightFile> file;
+    } LayoutJob;
+
+    void RunLongPoll();
+    void RunWebhook();
+    /* Downloads the job's file and writes it to disk. */
+    DownloadResult DownloadJob(const PrintJob &job);
+    /* Decodes the downloaded file and dithers it for the printer. */
+    RenderResult RenderJob(const PrintJob &job, const DownloadResult &file,
+                           QualityLevel quality);
+    /*
+     * Renders the file, or waits for another job sharing it to. A failure is
+     * taken out of the journal.
+     */
+    const RenderResult &RenderInFlight(const PrintJob &job,
+                                       InFlightFile &file,
+                                       QualityLevel quality);
+    /* Prints a raster, which is done with jobs if it got to the printer. */
+    Status PrintRaster(std::span<const uint8_t> raster,
+                       std::span<const PrintJob> jobs);
+    Status PrintJobFile(const PrintJob &job, InFlightFile &file,
+                        QualityLevel quality);
+    /* Packs the batch's stickers side by side and prints them at once. */
+    Status PrintLayout(std::span<const LayoutJob> batch, QualityLevel quality);
+    /* From the scheduler's load, for the job about to run. */
+    QualityLevel PickQualityLevel();
+    /* Runs on the scheduler's thread. */
+    void RunJob(const PrintJob &job, InFlightFile &file);
+    /*
+     * For jobs with more than one column, which are queued as this rather
+     * than RunJob(). Prints up to max_layout_batch of the chat's waiting
+     * jobs, and queues another turn if that leaves some.
+     */
+    void RunLayoutJobs(int64_t chat_id);
+    /*
+     * Adds a job to layout_pending_, queueing a turn if the chat doesn't
+     * have one coming. The pending jobs are capped like the scheduler's.
+     */
+    Status QueueLayoutJob(LayoutJob entry, bool replayed);
+    /*
+     * replayed jobs come from the journal. They were accepted before the
+     * restart, so the per chat cap doesn't turn them away.
+     */
+    void QueueJob(const PrintJob &job, bool replayed = false);
+    /*
+     * Text is printed as a label. It's rendered when its turn comes, and not
+     * journaled, there's nothing to download so it's only lost if the bot
+     * stops before then.
+     */
+    void QueueTextJob(int64_t chat_id, const std::string &text);
+    void RunTextJob(int64_t chat_id, const std::string &text);
+    void QueueJobs(std::vector<PrintJob> jobs);
+    void ReplayJournal();
+    PrintOptions ChatPrintOptions(int64_t chat_id);
+    /* /dither <algorithm> [serpentine] */
+    void HandleDitherCommand(TgBot::Message::Ptr message);
+    /* /layout <columns> */
+    void HandleLayoutCommand(TgBot::Message::Ptr message);
+    /* /preview [on|off] */
+    void HandlePreviewCommand(TgBot::Message::Ptr message);
+    bool PreviewEnabled(int64_t chat_id);
+    /*
+     * /text [on|off]. Off by default, so a bot in a group doesn't print
+     * everything said there.
+     */
+    void HandleTextCommand(TgBot::Message::Ptr message);
+    bool TextEnabled(int64_t chat_id);
+    /*
+     * For chats with previews on, jobs are rendered and sent back as a PNG
+     * with Print and Try another dither buttons instead of being printed.
+     * The raster is cached, so Print goes straight to the printer. Chats get
+     * the same cap and rate limit for previews as for prints.
+     */
+    void QueuePreview(const PrintJob &job);
+    /* Runs on preview_scheduler_'s thread. */
+    void SendPreview(const PrintJob &job);
+    /* The preview buttons. */
+    void HandleCallbackQuery(TgBot::CallbackQuery::Ptr query);
+    /* /prefetch <sticker set name>, admins only. */
+    void HandlePrefetchCommand(TgBot::Message::Ptr message);
+    /*
+     * Downloads and renders every sticker in the set into raster_cache_,
+     * reporting progress to chat_id. Runs on prefetch_pool_.
+     */
+    void PrefetchStickerSet(int64_t chat_id, const std::string &set_name,
+                            PrintOptions options);
+    bool IsAdmin(int64_t chat_id);
+    /*
+     * Identifies what a job prints: file_unique_id (file_id if there isn't
+     * one) and the print options.
+     */
+    static std::string RenderKey(const PrintJob &job);
+    void RecordStage(StageTiming &timing, Clock::time_point start);
+    /* Picks which of the sizes Telegram sends to download, per options_. */
     std::expected<const TgBot::PhotoSize::Ptr, Status> FindBestPhoto(
             std::span<const TgBot::PhotoSize::Ptr> photos);
 
+    const BotOptions options_;
+    BotHttpClient http_client_;
     TgBot::Bot bot_;
     std::unique_ptr<PrinterInterface> printer_;
-    uint64_t file_num_;  // For creating a unique file name.
+    std::unique_ptr<JobJournal> journal_;
+    /* Keyed by RenderKey(), entries go away with the last job holding them. */
+    std::map<std::string, std::weak_ptr<InFlightFile>> in_flight_;
+    std::mutex mu_in_flight_;
+    /*
+     * Jobs with more than one column, per chat, in the order queued. A chat
+     * is in here exactly while it has a RunLayoutJobs() turn queued.
+     */
+    std::map<int64_t, std::deque<LayoutJob>> layout_pending_;
+    std::mutex mu_layout_;
+    /* Null if the workers couldn't be started. */
+    std::unique_ptr<ConverterPool> converter_;
+    /* Null if there's no font or no FreeType, text isn't printed then. */
+    std::unique_ptr<TextRenderer> text_renderer_;
+    uint64_t file_num_ = 0;  // For creating a unique file name.
     std::mutex mu_file_num_;
+    /* Set with /dither, chats not in here use kDefaultPrintOptions. */
+    std::map<int64_t, PrintOptions> chat_options_;
+    /* Set with /preview, also guarded by mu_chat_options_. */
+    std::set<int64_t> preview_chats_;
+    /* Set with /text, also guarded by mu_chat_options_. */
+    std::set<int64_t> text_chats_;
+    std::mutex mu_chat_options_;
+    /*
+     * Jobs with a preview sent, keyed by the id in its buttons. Ids only go
+     * up, so the first is the oldest.
+     */
+    std::map<uint64_t, PrintJob> previews_;
+    uint64_t next_preview_id_ = 0;
+    std::mutex mu_previews_;
+    /* For /stats, to keep an eye on how much each print costs to download. */
+    std::atomic<uint64_t> files_downloaded_ = 0;
+    std::atomic<uint64_t> bytes_downloaded_ = 0;
+    /* Jobs that joined another job's download and render. */
+    std::atomic<uint64_t> jobs_coalesced_ = 0;
+    /* Keyed by RenderKey(), filled by full quality prints and /prefetch. */
+    RasterCache raster_cache_;
+    std::mutex mu_stage_timings_;
+    StageTiming download_timing_ = {};
+    StageTiming decode_timing_ = {};
+    StageTiming dither_timing_ = {};
+    StageTiming print_timing_ = {};
+    StageTiming preview_timing_ = {};
+    /* Only written from the scheduler's thread. */
+    std::atomic<QualityLevel> quality_level_ = QualityLevel::kFull;
+    std::atomic<uint64_t> jobs_reduced_ = 0;
+    std::atomic<uint64_t> jobs_minimal_ = 0;
+    WorkerPool download_pool_;
+    /* One thread, so a prefetch never takes more than a core from printing. */
+    WorkerPool prefetch_pool_;
+    /*
+     * Previews don't wait behind prints, or take more than a core either, and
+     * one chat's previews don't hold up everyone else's.
+     */
+    PrintScheduler preview_scheduler_;
+    /* Last, so it stops running jobs before anything they use goes away. */
+    PrintScheduler scheduler_;
 };
 
 };
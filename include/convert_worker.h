@@ -0,0 +1,33 @@
+#ifndef CONVERT_WORKER_H
+#define CONVERT_WORKER_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sticker_bot {
+
+/*
+ * What the bot and the converter workers (src/worker/convert_worker.cpp) say
+ * to each other over a SOCK_SEQPACKET socket.
+ *
+ * A request is one message holding the path of the file to convert, without
+ * a terminator. The reply is one ConvertReply, and if it succeeded it carries
+ * a memfd (SCM_RIGHTS) that ImageMagick wrote the first frame into as a
+ * binary PPM, size bytes long.
+ */
+
+/* Where the worker finds its end of the socket. */
+constexpr int kConvertWorkerFd = 3;
+constexpr size_t kMaxConvertPathLen = 4096;
+
+typedef struct ConvertReply {
+    /* A StatusCode. */
+    int32_t status;
+    /* convert's exit status if it failed. */
+    int32_t exit_code;
+    uint64_t size;
+} ConvertReply;
+
+};
+
+#endif
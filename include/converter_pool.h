@@ -0,0 +1,108 @@
+#ifndef CONVERTER_POOL_H
+#define CONVERTER_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+/* A converted image, mapped from the worker's memfd. Unmapped when dropped. */
+class SharedImage {
+  public:
+    SharedImage(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+    SharedImage(SharedImage &&other) :
+        data_(other.data_),
+        size_(other.size_)
+    {
+        other.data_ = NULL;
+        other.size_ = 0;
+    }
+    SharedImage(const SharedImage &) = delete;
+    SharedImage &operator=(const SharedImage &) = delete;
+    ~SharedImage();
+
+    std::span<const uint8_t> data() const { return {data_, size_}; }
+
+  private:
+    const uint8_t *data_;
+    size_t size_;
+};
+
+/*
+ * A pool of long-lived convert_worker processes, which run ImageMagick for
+ * the formats that aren't decoded in-process.
+ *
+ * The workers are started once with posix_spawn(), so the bot never forks.
+ * Each one takes a path over a socket and sends back a memfd holding the
+ * converted image, which is mapped here rather than copied or written to
+ * disk. A worker that dies or hangs is replaced on the spot.
+ */
+class ConverterPool {
+  public:
+    /* num_workers of 0 means one per core. */
+    static std::expected<std::unique_ptr<ConverterPool>, Status>
+        Create(const std::string &worker_path, uint32_t num_workers);
+
+    ~ConverterPool();
+
+    /*
+     * Converts the first frame of path to a binary PPM, flattened onto white.
+     * Blocks until a worker is free.
+     */
+    std::expected<SharedImage, Status> Convert(const std::string &path);
+
+    size_t num_workers() { return workers_.size(); }
+    uint64_t restarts() { return restarts_; }
+
+  private:
+    /* A hung convert is killed, with its worker, after this. */
+    static constexpr std::chrono::milliseconds kConvertTimeout{30000};
+    /* How long a worker gets to exit by itself before it's killed. */
+    static constexpr std::chrono::milliseconds kExitGrace{500};
+
+    typedef struct Worker {
+        pid_t pid;
+        /* Our end of the socket, -1 if the worker isn't running. */
+        int fd;
+    } Worker;
+
+    ConverterPool(std::string worker_path, uint32_t num_workers);
+
+    Status Spawn(Worker &worker);
+    /*
+     * Closes the worker's socket and kills its process group, after giving
+     * it kExitGrace to exit if wait_for_exit.
+     */
+    void Stop(Worker &worker, bool wait_for_exit);
+    /* Replaces a worker that has died, hung or said something odd. */
+    void Restart(Worker &worker);
+    std::expected<SharedImage, Status> ConvertWith(Worker &worker,
+                                                   const std::string &path);
+
+    size_t Acquire();
+    void Release(size_t index);
+
+    const std::string worker_path_;
+    std::vector<Worker> workers_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::vector<size_t> idle_;
+
+    std::atomic<uint64_t> restarts_ = 0;
+};
+
+};
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+namespace sticker_bot {
+
+/*
+ * A coroutine returning T, which starts when it's first co_awaited and resumes
+ * whoever awaited it when it's done.
+ *
+ *   Task<Status> Print(...)
+ *   {
+ *       RETURN_IF_ERROR(co_await SendAll(...));
+ *       co_return co_await ReadReply(...);
+ *   }
+ *
+ * Nothing here throws, so an exception escaping one is a bug and terminates.
+ */
+template <typename T>
+class Task {
+  public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct promise_type {
+        std::optional<T> value;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            /* Straight back to the awaiter, without growing the stack. */
+            std::coroutine_handle<> await_suspend(Handle handle) noexcept
+            {
+                std::coroutine_handle<> next = handle.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T result) { value.emplace(std::move(result)); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(Task &&other) : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task &operator=(Task &&other)
+    {
+        if (this != &other) {
+            if (handle_) {
+                handle_.destroy();
+            }
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    T await_resume() { return std::move(*handle_.promise().value); }
+
+  private:
+    explicit Task(Handle handle) : handle_(handle) {}
+
+    Handle handle_;
+};
+
+/*
+ * A coroutine nobody awaits. It runs as soon as it's called and frees itself
+ * when it's done, for starting a Task from plain code.
+ */
+struct DetachedTask {
+    struct promise_type {
+        DetachedTask get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+};
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef DITHER_H
+#define DITHER_H
+
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+/* Values are stored in the job journal, don't renumber them. */
+enum class DitherAlgorithm : uint8_t {
+    kAtkinson = 0,
+    kFloydSteinberg = 1,
+    kJarvisJudiceNinke = 2,
+    kStucki = 3,
+    kBurkes = 4,
+    kSierra = 5,
+    kSierraTwoRow = 6,
+    kSierraLite = 7,
+    /*
+     * No error diffusion, so much cheaper, but coarser. Used when the print
+     * queue is long.
+     */
+    kOrdered = 8,
+    kThreshold = 9,
+};
+
+enum class ScanOrder : uint8_t {
+    /* Every row left to right. */
+    kRaster = 0,
+    /* Alternate rows right to left, which breaks up diagonal artifacts. */
+    kSerpentine = 1,
+};
+
+/*
+ * Dithers a negated grayscale image in place and returns it in the printer's
+ * raster format, 8 dots per byte.
+ */
+std::vector<uint8_t> RasterDither(std::span<uint8_t> gray, uint32_t width,
+                                  DitherAlgorithm algorithm, ScanOrder order);
+
+std::expected<DitherAlgorithm, Status>
+    DitherAlgorithmFromName(std::string_view name);
+std::string_view DitherAlgorithmName(DitherAlgorithm algorithm);
+/* The algorithm after this one in DitherAlgorithmNames(), wrapping around. */
+DitherAlgorithm NextDitherAlgorithm(DitherAlgorithm algorithm);
+/* Every algorithm's name, comma separated, for help messages. */
+std::string DitherAlgorithmNames();
+
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <expected>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "coroutine.h"
+#include "status.h"
+
+namespace sticker_bot {
+
+/*
+ * One thread running coroutines that wait on file descriptors with epoll, so
+ * it can drive several printers at once with no thread blocked per job.
+ *
+ * Coroutines are started with Run() and only ever run on the loop's thread,
+ * so nothing they share needs a lock.
+ */
+class EventLoop {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    static std::expected<std::unique_ptr<EventLoop>, Status> Create();
+
+    EventLoop(int epoll_fd, int wake_fd);
+    /*
+     * Anything still waiting on an fd is resumed with an error first, and
+     * whatever was posted still runs, so every Run() future is resolved.
+     */
+    ~EventLoop();
+
+    /*
+     * Starts task on the loop's thread. Don't wait on the future from that
+     * thread, it would never be done. After the loop has stopped, the future
+     * is an error straight away.
+     */
+    std::future<Status> Run(Task<Status> task);
+    /*
+     * Runs fn on the loop's thread. Fails, and fn never runs, once the loop
+     * has stopped.
+     */
+    Status Post(std::function<void()> fn);
+
+    class FdAwaiter {
+      public:
+        FdAwaiter(EventLoop *loop, int fd, uint32_t events,
+                  Clock::duration timeout) :
+            loop_(loop),
+            fd_(fd),
+            events_(events),
+            deadline_(Clock::now() + timeout),
+            result_(StatusCode::kStatusOk) {}
+
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> handle);
+        Status await_resume() { return result_; }
+
+      private:
+        EventLoop *loop_;
+        int fd_;
+        uint32_t events_;
+        Clock::time_point deadline_;
+        Status result_;
+    };
+
+    /*
+     * co_await until fd has one of the epoll events (EPOLLIN, EPOLLOUT), or
+     * kTimeout if it doesn't in time. From a coroutine on the loop only, and
+     * only one at a time per fd.
+     */
+    FdAwaiter WaitFd(int fd, uint32_t events, Clock::duration timeout)
+    {
+        return FdAwaiter(this, fd, events, timeout);
+    }
+
+  private:
+    static constexpr int kMaxEvents = 16;
+
+    typedef struct Waiter {
+        std::coroutine_handle<> handle;
+        Clock::time_point deadline;
+        Status *result;
+    } Waiter;
+
+    /* Returns false if the coroutine should carry on without waiting. */
+    bool Arm(int fd, uint32_t events, Waiter waiter);
+    void Resume(int fd, Status result);
+    void RunPosted();
+    int NextTimeoutMs();
+    void WorkLoop();
+
+    const int epoll_fd_;
+    /* An eventfd, written to wake the loop up for Post(). */
+    const int wake_fd_;
+
+    std::mutex mu_;
+    std::deque<std::function<void()>> posted_;
+    bool stop_;
+    /* Set once the loop has run its last posted function. */
+    bool closed_;
+
+    /* Only touched on the loop's thread. */
+    std::map<int, Waiter> waiters_;
+    bool stopping_;
+
+    std::thread thread_;
+};
+
+/*
+ * A mutex for coroutines on an EventLoop. Waiting for it suspends the
+ * coroutine instead of blocking the loop.
+ *
+ *   auto guard = co_await mu_.Lock();
+ */
+class AsyncMutex {
+  public:
+    explicit AsyncMutex(EventLoop *loop) : loop_(loop), locked_(false) {}
+
+    class Guard {
+      public:
+        explicit Guard(AsyncMutex *mutex) : mutex_(mutex) {}
+        Guard(Guard &&other) : mutex_(std::exchange(other.mutex_, nullptr)) {}
+        Guard(const Guard &) = delete;
+        ~Guard()
+        {
+            if (mutex_) {
+                mutex_->Unlock();
+            }
+        }
+
+      private:
+        AsyncMutex *mutex_;
+    };
+
+    class LockAwaiter {
+      public:
+        explicit LockAwaiter(AsyncMutex *mutex) : mutex_(mutex) {}
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> handle);
+        Guard await_resume() { return Guard(mutex_); }
+
+      private:
+        AsyncMutex *mutex_;
+    };
+
+    LockAwaiter Lock() { return LockAwaiter(this); }
+
+  private:
+    void Unlock();
+
+    EventLoop *loop_;
+    bool locked_;
+    std::deque<std::coroutine_handle<>> waiters_;
+};
+
+};
+
+#endif
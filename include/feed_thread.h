@@ -0,0 +1,146 @@
+#ifndef FEED_THREAD_H
+#define FEED_THREAD_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <sched.h>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+/*
+ * How the thread writing an image to the printer is scheduled. The printer
+ * prints as the data arrives, so if that thread is preempted, say by the
+ * converters on a busy Pi, the head stops and starts, which bands the print.
+ */
+typedef struct FeedOptions {
+    /*
+     * SCHED_FIFO priority, 1 to 99, while feeding. 0 leaves the thread
+     * SCHED_OTHER. Needs CAP_SYS_NICE or an RLIMIT_RTPRIO, otherwise it's
+     * logged once and the print goes ahead as it would have.
+     */
+    int realtime_priority;
+    /* CPU to keep the thread on while feeding, -1 for any. */
+    int cpu;
+    /*
+     * mlock() the image while it's sent, so the feed never waits on a page
+     * fault. Limited by RLIMIT_MEMLOCK, and likewise logged if that's hit.
+     */
+    bool lock_memory;
+} FeedOptions;
+
+constexpr FeedOptions kDefaultFeedOptions = {
+    .realtime_priority = 0,
+    .cpu = -1,
+    .lock_memory = false,
+};
+
+/*
+ * Applies FeedOptions' priority and CPU to the calling thread for good, e.g.
+ * an EventLoop thread that does nothing but feed printers.
+ */
+Status SetFeedThread(const FeedOptions &options);
+
+/*
+ * Applies FeedOptions to the calling thread, and locks buffer, until it goes
+ * out of scope, then puts things back the way they were.
+ */
+class FeedScope {
+  public:
+    FeedScope(const FeedOptions &options, std::span<const uint8_t> buffer);
+    ~FeedScope();
+
+    FeedScope(const FeedScope &) = delete;
+    FeedScope &operator=(const FeedScope &) = delete;
+
+  private:
+    bool restore_scheduler_;
+    int policy_;
+    sched_param param_;
+    bool restore_affinity_;
+    cpu_set_t cpus_;
+    std::span<const uint8_t> locked_;
+};
+
+typedef struct FeedStats {
+    uint64_t feeds;
+    uint64_t writes;
+    /* Images fed, in KiB per second, from the first write to the last. */
+    double rate_mean_kib_s;
+    double rate_min_kib_s;
+    /*
+     * Time between one write() returning and the next one being made, while
+     * the printer could take more. This is the feed thread not running.
+     */
+    double gap_p50_ms;
+    double gap_p99_ms;
+    double gap_max_ms;
+    /* Gaps long enough that the printer likely ran dry. */
+    uint64_t stalls;
+} FeedStats;
+
+/*
+ * Records the writes of each feed to the printer. Calls for one feed have to
+ * come from one thread at a time, Stats() can be called from any.
+ */
+class FeedJitter {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    /* Gaps over this are counted as stalls. */
+    static constexpr std::chrono::milliseconds kStallGap =
+        std::chrono::milliseconds(20);
+
+    FeedJitter();
+
+    /* Before the first write of an image. */
+    void StartFeed();
+    /*
+     * After each write() that took bytes, with when it was made. Writes
+     * outside a feed, such as status requests, aren't counted.
+     */
+    void Wrote(Clock::time_point start, size_t bytes);
+    /*
+     * After waiting for the printer to take more, so the wait isn't counted
+     * as a gap.
+     */
+    void Waited();
+    /*
+     * After the last write of the image. If it failed partway, the feed rate
+     * isn't counted.
+     */
+    void EndFeed(bool completed);
+
+    FeedStats Stats();
+    /* Stats() as a human readable summary. */
+    std::string StatsString();
+
+  private:
+    /* How many recent gaps the percentiles are taken over. */
+    static constexpr size_t kGapSamples = 4096;
+
+    /* Only touched by the feeding thread. */
+    bool feeding_;
+    Clock::time_point feed_start_;
+    Clock::time_point last_write_end_;
+    size_t feed_bytes_;
+
+    std::mutex mu_;
+    uint64_t feeds_;
+    uint64_t writes_;
+    double rate_total_kib_s_;
+    double rate_min_kib_s_;
+    std::vector<double> recent_gaps_ms_;
+    size_t next_gap_sample_;
+    double gap_max_ms_;
+    uint64_t stalls_;
+};
+
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef HTTP_CLIENT_H
+#define HTTP_CLIENT_H
+
+#include <cstdint>
+
+#include "tgbot/tgbot.h"
+
+#if defined(HAVE_LIBCURL)
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+#endif
+
+namespace sticker_bot {
+
+/* How long getUpdates waits for an update before returning empty. */
+constexpr int32_t kLongPollTimeoutSecs = 10;
+
+#if defined(HAVE_LIBCURL)
+/*
+ * A libcurl client for tgbot-cpp that keeps connections open between
+ * requests, so each getFile and download doesn't pay for DNS, TCP and TLS
+ * again.
+ *
+ * tgbot-cpp's own CurlHttpClient can't do this: it duplicates a handle for
+ * every request, and duplicated handles don't keep connections or shares.
+ * Here finished handles go back to a pool, and every handle is attached to a
+ * share holding the connection pool, DNS cache and TLS sessions.
+ *
+ * A pooled connection can die without a word, e.g. when the Wi-Fi drops, and
+ * TCP takes many minutes to give up on it. So a request that goes quiet for
+ * longer than a long poll does, or a long poll that runs well past its
+ * timeout, fails and its connection is closed, and the next request opens a
+ * fresh one.
+ */
+class KeepAliveHttpClient : public TgBot::HttpClient {
+  public:
+    KeepAliveHttpClient();
+    ~KeepAliveHttpClient();
+
+    std::string makeRequest(const TgBot::Url &url,
+                            const std::vector<TgBot::HttpReqArg> &args)
+        const override;
+
+  private:
+    CURL *TakeHandle() const;
+    void ReturnHandle(CURL *handle) const;
+
+    static void Lock(CURL *handle, curl_lock_data data,
+                     curl_lock_access access, void *userptr);
+    static void Unlock(CURL *handle, curl_lock_data data, void *userptr);
+
+    CURLSH *share_;
+    mutable std::mutex mu_share_[CURL_LOCK_DATA_LAST];
+    mutable std::mutex mu_handles_;
+    mutable std::vector<CURL *> idle_handles_;
+};
+
+typedef KeepAliveHttpClient BotHttpClient;
+#else
+/* Opens a new connection for every request. Build with libcurl to reuse. */
+typedef TgBot::BoostHttpOnlySslClient BotHttpClient;
+#endif
+
+};
+
+#endif
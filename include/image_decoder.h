@@ -0,0 +1,38 @@
+#ifndef IMAGE_DECODER_H
+#define IMAGE_DECODER_H
+
+#include <cstdint>
+#include <expected>
+#include <string>
+#include <vector>
+
+#include "resampler.h"
+#include "status.h"
+
+namespace sticker_bot {
+
+/*
+ * Decodes JPEG, PNG and (if built with libwebp) WebP images in-process,
+ * feeding the resampler directly. Returns the same negated grayscale image,
+ * width dots wide and rotated if needed, as Resampler::Resample().
+ *
+ * JPEGs are decoded at 1/2, 1/4 or 1/8 scale when that is still at least
+ * width dots, and straight to grayscale. Upright images are pushed into the
+ * resampler one scanline at a time, so the full decoded image never exists.
+ * Rotated and interlaced ones are decoded whole first.
+ *
+ * kFast also picks the cheaper resampling filter and JPEG IDCT.
+ *
+ * region is the part of the image, as printed (i.e. rotated), to decode. It's
+ * what's scaled to width dots, so a cropped image is enlarged to fill it.
+ *
+ * Returns kInvalidArgument for formats this doesn't handle.
+ */
+std::expected<std::vector<uint8_t>, Status>
+    DecodeImage(const std::string &path, uint32_t width,
+                ResampleQuality quality = ResampleQuality::kBest,
+                const ImageRegion &region = kWholeImage);
+
+};
+
+#endif
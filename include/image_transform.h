@@ -9,86 +9,41 @@
 #include <span>
 #include <memory>
 
+#include "converter_pool.h"
+#include "dither.h"
+#include "resampler.h"
 #include "status.h"
+#include "trim.h"
 
 namespace sticker_bot {
 
-class RgbImage {
-  public:
-    RgbImage(std::span<uint8_t> img_data, uint32_t width) :
-            data_(reinterpret_cast<Rgb *>(img_data.data())),
-            size_(img_data.size()),
-            width_(width),
-            height_(size_ / sizeof(*data_) / width_) {}
-
-    std::vector<uint8_t> RasterImageDitherFloydSteinberg();
-    std::vector<uint8_t> RasterImageDitherAtkinson();
-
-  private:
-    typedef struct Rgb {
-        uint8_t r;
-        uint8_t g;
-        uint8_t b;
-    } __attribute__((packed)) Rgb;
-
-    static inline uint16_t average_pixel(const Rgb *data)
-    {
-        uint16_t pixel = data->r + data->g + data->b;
-        return pixel / 3;
-    }
-
-    static inline uint8_t round_pixel(int32_t pixel, uint8_t threshold)
-    {
-        return pixel > threshold ? 0xff : 0x00;
-    }
-
-    static inline uint8_t add_and_cap(uint8_t val1, int32_t val2)
-    {
-        constexpr uint8_t kMax = 0xff;
-        constexpr uint8_t kMin = 0x00;
-
-        int32_t val = val1 + val2;
-        if (val > kMax) {
-            val = kMax;
-        } else if (val < kMin) {
-            val = kMin;
-        }
-        return val;
-    }
-
-    static inline void error_propagate(Rgb *rgb, int32_t err,
-                                       int32_t numerator)
-    {
-        rgb->r = add_and_cap(rgb->r, err * numerator / 16);
-        rgb->g = add_and_cap(rgb->g, err * numerator / 16);
-        rgb->b = add_and_cap(rgb->b, err * numerator / 16);
-    }
-
-    static inline void error_propagate_atkinson(Rgb *rgb, int32_t err)
-    {
-        rgb->r = add_and_cap(rgb->r, err * 1 / 8);
-        rgb->g = add_and_cap(rgb->g, err * 1 / 8);
-        rgb->b = add_and_cap(rgb->b, err * 1 / 8);
-    }
-
-    Rgb *data_;
-    size_t size_;
-    uint32_t width_;
-    uint32_t height_;
-};
-
 class ImageTransform {
   public:
+    /* Dots across the paper. */
+    static constexpr uint32_t kPrintWidth = 576;
+
+    /*
+     * converter runs ImageMagick for formats that aren't decoded in-process.
+     * Without one, convert is run with popen(). kFast resamples with a cheaper
+     * filter. width is in dots, a multiple of 8, less than kPrintWidth for
+     * stickers printed side by side. trim drops blank borders, so what's
+     * left is printed across the whole width on less paper.
+     */
     static std::expected<std::unique_ptr<ImageTransform>, Status>
-        ImageFromFile(const std::string &path);
-
-    ImageTransform(std::span<uint8_t> data, uint32_t width) :
-        /* Subtract by 1 since the RGB data passed in ends with a newline. */
-        data_(data.begin(), data.end() - 1),
+        ImageFromFile(const std::string &path,
+                      ConverterPool *converter = nullptr,
+                      ResampleQuality quality = ResampleQuality::kBest,
+                      uint32_t width = kPrintWidth,
+                      const TrimOptions &trim = kDefaultTrimOptions);
+
+    ImageTransform(std::vector<uint8_t> gray, uint32_t width) :
+        data_(std::move(gray)),
         width_(width) {}
 
     std::vector<uint8_t> RasterImageDitherFloydSteinberg();
     std::vector<uint8_t> RasterImageDitherAtkinson();
+    std::vector<uint8_t> RasterImageDither(
+            DitherAlgorithm algorithm, ScanOrder order = ScanOrder::kRaster);
 
     static std::expected<std::unique_ptr<ImageTransform>, Status>
         ImageFromRgbFile(const std::string &path, uint32_t width);
@@ -99,10 +54,30 @@ class ImageTransform {
     static std::expected<std::vector<uint8_t>, Status>
         ReadFile(const std::string &path);
 
-    /* Converts to correct width and grayscale, and rotates if needed. */
-    static std::expected<std::string, Status>
-        ProcessImage(const std::string &path);
+    /*
+     * Decodes the first frame, then resizes to the correct width, converts to
+     * negated grayscale and rotates if needed, all in one resampling pass.
+     */
+    static std::expected<std::vector<uint8_t>, Status>
+        ProcessImage(const std::string &path, uint32_t width,
+                     ConverterPool *converter, ResampleQuality quality,
+                     const TrimOptions &trim);
+    /*
+     * Finds the content in the decoded gray. If it's narrow, an in-process
+     * image is decoded again cropped to it, then the blank rows are dropped.
+     */
+    static void TrimBorders(const std::string &path, uint32_t width,
+                            ResampleQuality quality, const TrimOptions &trim,
+                            bool in_process, std::vector<uint8_t> &gray);
+    static std::expected<std::vector<uint8_t>, Status>
+        DecodeWithImageMagick(const std::string &path, uint32_t width,
+                              ConverterPool *converter,
+                              ResampleQuality quality);
+    /* Runs convert with popen(), and reads back the PPM it wrote. */
+    static std::expected<std::vector<uint8_t>, Status>
+        RunImageMagick(const std::string &path);
 
+    /* Negated grayscale, one byte per dot. */
     std::vector<uint8_t> data_;
     uint32_t width_;
 };
@@ -0,0 +1,96 @@
+#ifndef JOB_JOURNAL_H
+#define JOB_JOURNAL_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "print_job.h"
+#include "status.h"
+
+namespace sticker_bot {
+
+/*
+ * Append-only journal of print jobs, so queued jobs survive a restart.
+ *
+ * Each record is one line, written with a single write() call:
+ *   Q <id> <chat id> <dither> <scan order> <columns> <file id> <checksum>
+ *   D <id> <checksum>
+ * A job is unfinished if it has a Q record but no D record. A torn or
+ * corrupted line fails its checksum and is skipped.
+ *
+ * Writes are not synced one by one. A flusher thread calls fdatasync() at
+ * most once per kSyncInterval for everything written in the meantime, so a
+ * burst of jobs costs one sync instead of one each.
+ */
+class JobJournal {
+  public:
+    /* Opens (or creates) the journal and loads the unfinished jobs. */
+    static std::expected<std::unique_ptr<JobJournal>, Status>
+        Open(const std::string &path);
+
+    JobJournal(int fd, std::string_view path, uint64_t next_id,
+               std::vector<PrintJob> unfinished);
+    ~JobJournal();
+
+    /* Records a queued job and assigns its ID. */
+    Status Append(PrintJob &job);
+    /* Records that a job no longer needs to be printed. */
+    Status MarkDone(uint64_t id);
+    /* Blocks until everything appended so far is on disk. */
+    Status Sync();
+
+    /* Jobs that were queued but not done when the journal was opened. */
+    std::vector<PrintJob> TakeUnfinished() { return std::move(unfinished_); }
+
+    uint64_t records_written()
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        return records_written_;
+    }
+    uint64_t syncs()
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        return syncs_;
+    }
+
+  private:
+    static constexpr std::chrono::milliseconds kSyncInterval{20};
+
+    /* Rewrites the journal with only the unfinished jobs. */
+    static Status Compact(const std::string &path,
+                          const std::vector<PrintJob> &unfinished);
+    static std::string FormatQueued(const PrintJob &job);
+    static std::string FormatDone(uint64_t id);
+
+    Status WriteRecord(const std::string &record);
+    void FlushLoop();
+
+    int fd_;
+    const std::string path_;
+    std::vector<PrintJob> unfinished_;
+
+    std::mutex mu_;
+    std::condition_variable cv_flush_;
+    std::condition_variable cv_synced_;
+    uint64_t next_id_;
+    /* Records are numbered in write order to know what a sync covered. */
+    uint64_t records_written_;
+    uint64_t records_synced_;
+    uint64_t syncs_;
+    bool sync_failed_;
+    bool stop_;
+    std::thread flusher_;
+};
+
+};
+
+#endif
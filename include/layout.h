@@ -0,0 +1,43 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace sticker_bot {
+
+/* Most stickers side by side, any more and they're too small to make out. */
+constexpr uint8_t kMaxColumns = 3;
+/* Blank between stickers across the paper, so they can be cut apart. */
+constexpr uint32_t kColumnGapBytes = 1;
+/* And between shelves, along it. */
+constexpr uint32_t kShelfGapRows = 8;
+
+/*
+ * The width in dots each of columns stickers gets across width_bytes, less
+ * the gaps between them. Always whole bytes, so packing is just copying.
+ */
+uint32_t ColumnWidth(uint32_t width_bytes, uint8_t columns);
+
+/* A dithered image in the printer's raster format, 8 dots per byte. */
+typedef struct LayoutItem {
+    std::span<const uint8_t> raster;
+    uint32_t width_bytes;
+} LayoutItem;
+
+/*
+ * Packs the items into one raster width_bytes across, in shelves: rows of
+ * items side by side, as tall as the tallest item on them.
+ *
+ * First fit decreasing height: the tallest items are placed first, each on
+ * the first shelf with room left, or a new one. Shelves are then never
+ * shorter than what goes on them, and similar heights end up together, so
+ * little paper is left blank. The items' order isn't kept.
+ */
+std::vector<uint8_t> PackShelves(std::span<const LayoutItem> items,
+                                 uint32_t width_bytes);
+
+};
+
+#endif
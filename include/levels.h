@@ -0,0 +1,38 @@
+#ifndef LEVELS_H
+#define LEVELS_H
+
+#include <cstdint>
+#include <span>
+
+namespace sticker_bot {
+
+typedef struct LevelsOptions {
+    /* Fraction of dots allowed to clip at each end of the histogram. */
+    double clip_fraction;
+    /*
+     * Images whose levels span less than this are left alone, stretching them
+     * would mostly amplify noise.
+     */
+    uint8_t min_span;
+    /* Also bend the midtones towards mid gray with a gamma curve. */
+    bool auto_gamma;
+} LevelsOptions;
+
+constexpr LevelsOptions kDefaultLevelsOptions = {
+    .clip_fraction = 0.005,
+    .min_span = 32,
+    .auto_gamma = true,
+};
+
+/*
+ * Stretches the levels of a grayscale image to the full range in place. Works
+ * on the negated image the dither takes just as well as on a normal one.
+ *
+ * This is one pass to build the histogram and one pass to apply a LUT.
+ */
+void AutoLevels(std::span<uint8_t> gray,
+                const LevelsOptions &options = kDefaultLevelsOptions);
+
+};
+
+#endif
@@ -6,29 +6,78 @@
 #include <mutex>
 #include <span>
 #include <thread>
+#include <vector>
 #include <unistd.h>
 
+#include "feed_thread.h"
 #include "printer_interface.h"
 #include "status.h"
 
 namespace sticker_bot {
 
+constexpr uint8_t kMaxPrinterSpeed = 5;
+constexpr uint8_t kMaxPrinterDensity = 15;
+
+typedef struct M02ProOptions {
+    /*
+     * Head speed, 1 to kMaxPrinterSpeed. Slower prints darker, faster gets
+     * more stickers out a minute. 0 leaves whatever the printer is set to.
+     */
+    uint8_t speed;
+    /*
+     * Heat, 1 (lightest) to kMaxPrinterDensity. 0 leaves whatever the printer
+     * is set to.
+     */
+    uint8_t density;
+    /* For the thread that sends the image. */
+    FeedOptions feed;
+} M02ProOptions;
+
+constexpr M02ProOptions kDefaultM02ProOptions = {
+    .speed = 0,
+    .density = 0,
+    .feed = kDefaultFeedOptions,
+};
+
 class M02Pro : public PrinterInterface {
   public:
     static std::expected<std::unique_ptr<M02Pro>, Status>
-       Create(const std::string &path);
+       Create(const std::string &path,
+              const M02ProOptions &options = kDefaultM02ProOptions);
 
-    M02Pro(int fd, std::string_view path) : fd_(fd), path_(path) {}
+    M02Pro(int fd, std::string_view path, const M02ProOptions &options) :
+        fd_(fd),
+        path_(path),
+        options_(options) {}
     ~M02Pro() { close(fd_); }
 
     Status PrintImage(std::span<const uint8_t> data, uint16_t width) override;
     Status PrinterStatus() override;
+    std::string StatsString() override { return jitter_.StatsString(); }
 
-  private:
+    /* The protocol, shared with AsyncM02Pro. */
     static constexpr uint32_t kMaxBufferSize = 0x10000;
     /* Long prints can take awhile. */
     static constexpr uint32_t kReadTimeoutSec = 30;
+    /* Paper fed after each image, so it clears the tear bar. */
+    static constexpr uint8_t kFeedRows = 3;
+
+    static std::vector<uint8_t> InitCmd();
+    static std::vector<uint8_t> LineFeedCmd(uint8_t rows);
+    static std::vector<uint8_t> RasterImageCmd(uint16_t bytes_x,
+                                               uint16_t bytes_y);
+    static std::vector<uint8_t> ReadBatteryCmd();
+    /*
+     * Phomemo's own commands for speed and density, as their app sends them.
+     * Empty if options leaves both alone. They're reset by InitCmd(), so are
+     * sent after it on every print. Out of range values are left alone too,
+     * the printer's behaviour with them is anyone's guess.
+     */
+    static std::vector<uint8_t> SettingsCmd(const M02ProOptions &options);
+    /* Logs what the printer replied to ReadBatteryCmd(). */
+    static void LogStatusReply(std::span<const uint8_t> reply);
 
+  private:
     enum class M02ProPrintRasterImageMode : uint8_t {
         /* The printer FW does 0x00, but 0x30 matches ESC/POS spec. */
         kNormal = 0x30,
@@ -47,7 +96,9 @@ class M02Pro : public PrinterInterface {
 
     int fd_;
     const std::string path_;
+    const M02ProOptions options_;
     std::mutex mu_printer_;
+    FeedJitter jitter_;
 };
 
 };
@@ -0,0 +1,28 @@
+#ifndef PNG_ENCODER_H
+#define PNG_ENCODER_H
+
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <vector>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+/*
+ * Encodes a raster in the printer's format, 8 dots per byte with 1 for black,
+ * as a 1 bit grayscale PNG width_bytes * 8 dots wide, to show what a print
+ * will look like.
+ *
+ * A 1 bit PNG's rows are the raster's rows inverted, so this is one pass to
+ * invert them and add each row's filter byte, then zlib at its fastest level.
+ * No filtering is tried, dithered dots don't predict well, and blank paper
+ * compresses to nothing anyway.
+ */
+std::expected<std::vector<uint8_t>, Status>
+    EncodeRasterPng(std::span<const uint8_t> raster, uint32_t width_bytes);
+
+};
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef PRINT_JOB_H
+#define PRINT_JOB_H
+
+#include <cstdint>
+#include <string>
+
+#include "dither.h"
+
+namespace sticker_bot {
+
+typedef struct PrintOptions {
+    DitherAlgorithm dither;
+    ScanOrder scan;
+    /*
+     * Stickers across the paper. Above 1 each is scaled down to its column,
+     * and the chat's queued jobs are packed side by side into one print.
+     */
+    uint8_t columns;
+} PrintOptions;
+
+constexpr PrintOptions kDefaultPrintOptions = {
+    .dither = DitherAlgorithm::kAtkinson,
+    .scan = ScanOrder::kRaster,
+    .columns = 1,
+};
+
+/* One file to print. Everything needed to redo it after a restart. */
+typedef struct PrintJob {
+    /* Assigned by the journal. */
+    uint64_t id;
+    int64_t chat_id;
+    /* Telegram file ID, the file itself is downloaded when printing. */
+    std::string file_id;
+    /*
+     * The same for every copy of the file, unlike file_id. Jobs for the same
+     * file share one download and render. Not journaled, so empty for jobs
+     * replayed from it.
+     */
+    std::string file_unique_id;
+    PrintOptions options;
+} PrintJob;
+
+};
+
+#endif
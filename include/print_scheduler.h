@@ -0,0 +1,131 @@
+#ifndef PRINT_SCHEDULER_H
+#define PRINT_SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+typedef struct SchedulerOptions {
+    /* Jobs a chat can print back to back before it is rate limited. */
+    double burst;
+    /* Jobs per second a chat earns back. 0 turns rate limiting off. */
+    double rate;
+    /* Jobs a chat can have queued at once, 0 for no limit. */
+    size_t max_queued_per_chat;
+} SchedulerOptions;
+
+constexpr SchedulerOptions kDefaultSchedulerOptions = {
+    .burst = 10,
+    .rate = 0.2,
+    .max_queued_per_chat = 50,
+};
+
+typedef struct SchedulerStats {
+    uint64_t jobs_queued;
+    uint64_t jobs_run;
+    uint64_t jobs_rejected;
+    size_t queue_depth;
+    size_t waiting_chats;
+    /* Time from Enqueue() to the job starting, over the recent jobs. */
+    double wait_mean_ms;
+    double wait_p50_ms;
+    double wait_p95_ms;
+    double wait_max_ms;
+    /* How long a job takes to run, weighted towards the recent ones. */
+    double run_mean_ms;
+    /* How long a job queued now would wait, from the two above. */
+    double projected_wait_ms;
+} SchedulerStats;
+
+/*
+ * Runs print jobs one at a time, fairly between chats.
+ *
+ * Each chat has its own queue, and the queues are served round robin, so one
+ * chat sending 50 stickers only delays everyone else by one job per turn.
+ * Each chat also has a token bucket: once it has used up its burst, its jobs
+ * wait for tokens while other chats' jobs go ahead.
+ */
+class PrintScheduler {
+  public:
+    typedef std::function<void()> Task;
+
+    explicit PrintScheduler(SchedulerOptions options);
+    ~PrintScheduler();
+
+    /*
+     * Fails with kResourceExhausted if the chat has too much queued, unless
+     * ignore_cap, for jobs that were already accepted once.
+     */
+    Status Enqueue(int64_t chat_id, Task task, bool ignore_cap = false);
+    const SchedulerOptions &options() const { return options_; }
+    SchedulerStats Stats();
+    /* Stats() as a human readable summary. */
+    std::string StatsString();
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+    /* How many recent wait times the percentiles are taken over. */
+    static constexpr size_t kWaitSamples = 1024;
+    /* Weight of the newest job in run_mean_ms. */
+    static constexpr double kRunTimeWeight = 0.2;
+
+    typedef struct QueuedTask {
+        Task task;
+        Clock::time_point queued_at;
+    } QueuedTask;
+
+    typedef struct ChatQueue {
+        std::deque<QueuedTask> tasks;
+        double tokens;
+        Clock::time_point last_refill;
+    } ChatQueue;
+
+    void RefillTokens(ChatQueue &chat, Clock::time_point now);
+    /*
+     * Takes the next task from the next chat in round robin order that has a
+     * token. If every waiting chat is rate limited, returns false and sets
+     * wake_at to when the first of them gets a token back.
+     */
+    bool PickTask(Clock::time_point now, QueuedTask &task,
+                  Clock::time_point &wake_at);
+    /* Forgets chats with nothing queued and a full bucket. */
+    void PruneChats(Clock::time_point now);
+    void RecordWait(Clock::duration wait);
+    void RecordRunTime(Clock::duration run_time);
+    void WorkLoop();
+
+    const SchedulerOptions options_;
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::map<int64_t, ChatQueue> chats_;
+    /* Chats with queued jobs, in the order they get their next turn. */
+    std::deque<int64_t> round_robin_;
+    bool stop_;
+
+    uint64_t jobs_queued_;
+    uint64_t jobs_run_;
+    uint64_t jobs_rejected_;
+    size_t queue_depth_;
+    double wait_total_ms_;
+    std::vector<double> recent_waits_ms_;
+    size_t next_wait_sample_;
+    double run_mean_ms_;
+
+    std::thread worker_;
+};
+
+};
+
+#endif
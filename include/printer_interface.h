@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <expected>
 #include <span>
+#include <string>
 
 #include "status.h"
 
@@ -11,9 +12,14 @@ namespace sticker_bot {
 
 class PrinterInterface {
   public:
+    /* Printers are owned through this, so they have to close their fd. */
+    virtual ~PrinterInterface() = default;
+
     virtual Status PrintImage(std::span<const uint8_t> data,
                                uint16_t width) = 0;
     virtual Status PrinterStatus() = 0;
+    /* For /stats, empty if there's nothing to say. */
+    virtual std::string StatsString() { return ""; }
 };
 
 };
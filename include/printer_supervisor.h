@@ -0,0 +1,122 @@
+#ifndef PRINTER_SUPERVISOR_H
+#define PRINTER_SUPERVISOR_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <expected>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+
+#include "printer_interface.h"
+#include "status.h"
+
+namespace sticker_bot {
+
+typedef struct SupervisorOptions {
+    /*
+     * Wait after the first failed connect, doubled on each one after. Opening
+     * an rfcomm device is cheap when nothing answers, so the cap is short,
+     * it's how late a printer that was off for a while gets noticed.
+     */
+    std::chrono::milliseconds min_backoff;
+    std::chrono::milliseconds max_backoff;
+    /*
+     * How often an idle link is checked with PrinterStatus(), so a drop is
+     * noticed before the next job needs the printer.
+     */
+    std::chrono::milliseconds health_check_interval;
+    /*
+     * Tries at a job that fails on a link that then comes back, so a printer
+     * that connects but can't print doesn't hold the queue forever.
+     */
+    uint32_t max_print_attempts;
+    /*
+     * Run with system() before reconnecting after a failed connect, e.g.
+     * "rfcomm bind 0 <MAC>" if the device node went away. Empty for none.
+     */
+    std::string rebind_command;
+} SupervisorOptions;
+
+/* Not constexpr, because of rebind_command. */
+inline const SupervisorOptions kDefaultSupervisorOptions = {
+    .min_backoff = std::chrono::milliseconds(250),
+    .max_backoff = std::chrono::seconds(5),
+    .health_check_interval = std::chrono::seconds(30),
+    .max_print_attempts = 3,
+    .rebind_command = "",
+};
+
+typedef struct SupervisorStats {
+    bool connected;
+    /* Times a working link was lost. */
+    uint64_t disconnects;
+    uint64_t connect_attempts;
+    /* From noticing the link was down to it passing a health check again. */
+    double last_recovery_ms;
+    double max_recovery_ms;
+    /* Prints that waited for the link to come back. */
+    uint64_t prints_held;
+} SupervisorStats;
+
+/*
+ * Keeps a printer connected, for a link like Bluetooth that drops.
+ *
+ * The printer is opened with connect() on a background thread, so the bot can
+ * start without one. When a command fails the link is dropped and reopened
+ * with exponential backoff, and only counts as up again once PrinterStatus()
+ * gets a reply. PrintImage() waits for the link instead of failing, which
+ * holds the print queue until the printer is back, then retries the job.
+ * PrinterStatus() never waits, it's only for the log.
+ */
+class PrinterSupervisor : public PrinterInterface {
+  public:
+    typedef std::function<
+        std::expected<std::unique_ptr<PrinterInterface>, Status>()> Connect;
+
+    PrinterSupervisor(Connect connect,
+                      SupervisorOptions options = kDefaultSupervisorOptions);
+    /* Prints still waiting for the link fail. */
+    ~PrinterSupervisor();
+
+    Status PrintImage(std::span<const uint8_t> data, uint16_t width) override;
+    Status PrinterStatus() override;
+    std::string StatsString() override;
+
+    SupervisorStats Stats();
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    /* Takes the link down if printer is still the one in use. */
+    void LinkFailed(const std::shared_ptr<PrinterInterface> &printer,
+                    const Status &status);
+    /* Opens and health checks the printer, false if either fails. */
+    bool TryConnect();
+    void SuperviseLoop();
+
+    Connect connect_;
+    const SupervisorOptions options_;
+
+    std::mutex mu_;
+    /* Signalled when the link comes up, or is found to be down. */
+    std::condition_variable cv_;
+    /*
+     * Null while the link is down. Shared, so a print can carry on with its
+     * printer while the link is being replaced.
+     */
+    std::shared_ptr<PrinterInterface> printer_;
+    bool stop_;
+    Clock::time_point down_since_;
+    SupervisorStats stats_;
+
+    std::thread supervisor_;
+};
+
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef RASTER_CACHE_H
+#define RASTER_CACHE_H
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sticker_bot {
+
+/* Printer raster data, ready for PrintImage(). Shared, never modified. */
+typedef std::shared_ptr<const std::vector<uint8_t>> Raster;
+
+typedef struct RasterCacheStats {
+    size_t entries;
+    size_t bytes;
+    size_t capacity_bytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+} RasterCacheStats;
+
+/*
+ * Rendered stickers, so printing one again skips the download, decode and
+ * dither. Least recently used rasters are evicted to stay under the capacity.
+ */
+class RasterCache {
+  public:
+    /* A capacity of 0 caches nothing. */
+    explicit RasterCache(size_t capacity_bytes);
+
+    /* Null if it isn't cached. */
+    Raster Get(const std::string &key);
+    /* Unlike Get(), doesn't count as a hit or a miss, or as a use. */
+    bool Contains(const std::string &key);
+    void Put(const std::string &key, Raster raster);
+    RasterCacheStats Stats();
+
+  private:
+    typedef std::list<std::pair<std::string, Raster>> LruList;
+
+    void Evict(size_t needed_bytes);
+
+    const size_t capacity_bytes_;
+
+    std::mutex mu_;
+    /* Most recently used first. */
+    LruList lru_;
+    std::unordered_map<std::string, LruList::iterator> entries_;
+    size_t bytes_;
+    uint64_t hits_;
+    uint64_t misses_;
+    uint64_t evictions_;
+};
+
+};
+
+#endif
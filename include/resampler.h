@@ -0,0 +1,212 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace sticker_bot {
+
+enum class ResampleFilter {
+    kLanczos3,
+    kMitchell,
+    /* Bilinear. Blurrier, but the fewest taps by far. */
+    kTriangle,
+};
+
+enum class ResampleQuality {
+    kBest,
+    /* For when the print queue is long and speed matters more. */
+    kFast,
+};
+
+/* Pixels of an image, e.g. from ImageRegion::Rect(). */
+struct CropRect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+/*
+ * Part of an image as fractions, 0 to 1, of its width and height, so it means
+ * the same whatever size the image is decoded at.
+ */
+struct ImageRegion {
+    double left;
+    double top;
+    double right;
+    double bottom;
+
+    bool IsWhole() const
+    {
+        return left <= 0 && top <= 0 && right >= 1 && bottom >= 1;
+    }
+
+    /* The pixels it covers of a width x height image, never none. */
+    CropRect Rect(uint32_t width, uint32_t height) const
+    {
+        uint32_t x0 = std::min<uint32_t>(std::max(left, 0.0) * width,
+                                         width - 1);
+        uint32_t y0 = std::min<uint32_t>(std::max(top, 0.0) * height,
+                                         height - 1);
+        uint32_t x1 = std::clamp<uint32_t>(std::ceil(std::min(right, 1.0) *
+                                                     width), x0 + 1, width);
+        uint32_t y1 = std::clamp<uint32_t>(std::ceil(std::min(bottom, 1.0) *
+                                                     height), y0 + 1, height);
+        return CropRect{x0, y0, x1 - x0, y1 - y0};
+    }
+};
+
+constexpr ImageRegion kWholeImage = {0, 0, 1, 1};
+
+/*
+ * A read-only view of an 8-bit interleaved image. The steps are in bytes and
+ * can be negative, so the same sampling code can walk a rotated image without
+ * anyone making a rotated copy.
+ */
+struct ImageView {
+    const uint8_t *data;
+    uint32_t width;
+    uint32_t height;
+    /* 1 = gray, 2 = gray + alpha, 3 = RGB, 4 = RGBA. */
+    uint8_t channels;
+    ptrdiff_t x_step;
+    ptrdiff_t y_step;
+
+    static ImageView FromBuffer(const uint8_t *data, uint32_t width,
+                                uint32_t height, uint8_t channels)
+    {
+        return ImageView{data, width, height, channels,
+                         /*x_step=*/channels,
+                         /*y_step=*/static_cast<ptrdiff_t>(width) * channels};
+    }
+
+    /* Rotated 90 degrees clockwise, the same as `convert -rotate 90`. */
+    ImageView Rotated90() const
+    {
+        return ImageView{data + (height - 1) * y_step, height, width,
+                         channels, /*x_step=*/-y_step, /*y_step=*/x_step};
+    }
+
+    /* Just the rect, which is no copy either. */
+    ImageView Cropped(const CropRect &rect) const
+    {
+        return ImageView{pixel(rect.x, rect.y), rect.width, rect.height,
+                         channels, x_step, y_step};
+    }
+
+    const uint8_t *pixel(uint32_t x, uint32_t y) const
+    {
+        return data + y * y_step + x * x_step;
+    }
+};
+
+/*
+ * Separable resampler that outputs what the dither expects: 8-bit grayscale,
+ * negated (0xff is a black dot), flattened onto a white background.
+ *
+ * Source rows are pushed top to bottom. Each row is converted to gray and
+ * filtered horizontally as it arrives, and an output row is produced as soon
+ * as every source row under its vertical filter has been seen, so only a
+ * handful of intermediate rows are ever kept around.
+ */
+class Resampler {
+  public:
+    Resampler(uint32_t src_width, uint32_t src_height, uint32_t dst_width,
+              ResampleFilter filter);
+
+    uint32_t dst_width() const { return dst_width_; }
+    uint32_t dst_height() const { return dst_height_; }
+
+    /* Pushes row y of src. src must have the size given to the ctor. */
+    void PushRow(const ImageView &src, uint32_t y);
+    /* Pushes row y, already converted by GrayRow(). */
+    void PushGrayRow(const uint8_t *gray, uint32_t y);
+    /*
+     * Pushes the next row straight from a decoder, src_width pixels of
+     * channels bytes each.
+     */
+    void PushScanline(const uint8_t *pixels, uint8_t channels);
+    /* Returns the output once every source row has been pushed. */
+    std::vector<uint8_t> TakeOutput() { return std::move(out_); }
+
+    /*
+     * Resamples src to dst_width, keeping the aspect ratio. Rotated views are
+     * read in transposed tiles, so they cost about the same as upright ones.
+     */
+    static std::vector<uint8_t> Resample(const ImageView &src,
+                                         uint32_t dst_width,
+                                         ResampleFilter filter);
+
+    /*
+     * What ImageMagick would use: Mitchell to enlarge, Lanczos to shrink.
+     * kFast always uses the triangle filter.
+     */
+    static ResampleFilter DefaultFilter(
+            uint32_t src_width, uint32_t dst_width,
+            ResampleQuality quality = ResampleQuality::kBest)
+    {
+        if (quality == ResampleQuality::kFast) {
+            return ResampleFilter::kTriangle;
+        }
+        return src_width < dst_width ? ResampleFilter::kMitchell :
+            ResampleFilter::kLanczos3;
+    }
+
+  private:
+    /* Weights are fixed point, summing to 1 << kWeightBits. */
+    static constexpr uint32_t kWeightBits = 14;
+    /*
+     * Rows converted per tile when the view is rotated. Each source pixel
+     * read then pulls in this many neighbouring view rows from the same
+     * cache lines instead of one.
+     */
+    static constexpr uint32_t kTileRows = 32;
+    /* Extra precision kept in the intermediate (horizontally filtered) rows. */
+    static constexpr uint32_t kIntermediateBits = 6;
+
+    /* The source taps contributing to one output pixel. */
+    typedef struct Contribution {
+        uint32_t start;
+        uint32_t count;
+        /* Offset of the first weight in weights. */
+        uint32_t weights;
+    } Contribution;
+
+    typedef struct FilterWeights {
+        std::vector<Contribution> contributions;
+        std::vector<int16_t> weights;
+        uint32_t max_count;
+    } FilterWeights;
+
+    static FilterWeights ComputeWeights(uint32_t src_size, uint32_t dst_size,
+                                        ResampleFilter filter);
+    static void GrayRow(const ImageView &src, uint32_t y, uint8_t *gray);
+    static void GrayTile(const ImageView &src, uint32_t y, uint32_t rows,
+                         uint8_t *gray);
+    void HorizontalPass(const uint8_t *gray, int16_t *row) const;
+    void VerticalPass(uint32_t dst_y);
+
+    uint32_t src_width_;
+    uint32_t src_height_;
+    uint32_t dst_width_;
+    uint32_t dst_height_;
+    FilterWeights horizontal_;
+    FilterWeights vertical_;
+
+    /* Ring of horizontally filtered rows, indexed by source row. */
+    std::vector<int16_t> ring_;
+    uint32_t ring_rows_;
+    uint32_t rows_pushed_;
+    uint32_t next_dst_row_;
+    std::vector<uint8_t> gray_row_;
+    std::vector<int32_t> accumulator_;
+    std::vector<uint8_t> out_;
+};
+
+};
+
+#endif
@@ -1,9 +1,15 @@
 #ifndef STATUS_H
 #define STATUS_H
 
+#include <algorithm>
+#include <concepts>
+#include <cstddef>
 #include <expected>
+#include <memory>
 #include <string_view>
 #include <string>
+#include <type_traits>
+#include <utility>
 
 
 namespace sticker_bot {
@@ -22,35 +28,101 @@ enum class StatusCode {
     kInvalidArgument = 0x02,
     kTimeout = 0x03,
     kNotFoundError = 0x04,
+    kResourceExhausted = 0x05,
 };
 
+/*
+ * A string literal, which lives forever, so a Status can point at it rather
+ * than copy it. consteval, so anything that isn't a compile time constant,
+ * such as a char buffer on the stack, fails to build instead of dangling.
+ */
+class StaticMessage {
+  public:
+    template <size_t N>
+    consteval StaticMessage(const char (&msg)[N]) : msg_(msg, N - 1) {}
+
+    std::string_view view() const { return msg_; }
+
+  private:
+    std::string_view msg_;
+};
+
+/*
+ * A status code and a message. Statuses are made and passed back on every
+ * printer command and image, so the common cases allocate nothing: no message,
+ * or a string literal. A message built at runtime costs one allocation, as
+ * does each prepend_message(), which only happens on errors.
+ */
 class Status {
   public:
-    Status(StatusCode status, std::string_view msg,
-           std::string_view user_friendly_msg) :
+    Status(StatusCode status, StaticMessage msg,
+           StaticMessage user_friendly_msg) :
         status_(status),
-        msg_(msg),
-        user_friendly_msg_(user_friendly_msg) {}
-    Status(StatusCode status, std::string_view msg) :
-        Status(status, msg, /*user_friendly_msg=*/"") {}
-    Status(StatusCode status) :
-        Status(status, /*msg=*/"", /*user_friendly_msg=*/"") {}
-
-    void prepend_message(std::string_view str);
+        msg_(msg.view()),
+        user_friendly_msg_(user_friendly_msg.view()) {}
+    Status(StatusCode status, StaticMessage msg) :
+        status_(status),
+        msg_(msg.view()) {}
+    /* Anything other than a literal, e.g. e.what(), is copied. */
+    template <typename T>
+        requires (!std::is_array_v<std::remove_reference_t<T>> &&
+                  std::convertible_to<T, std::string_view>)
+    Status(StatusCode status, T &&msg) :
+        status_(status)
+    {
+        std::string_view view(msg);
+        owned_msg_ = std::make_shared<char[]>(view.size());
+        std::copy(view.begin(), view.end(), owned_msg_.get());
+        msg_ = std::string_view(owned_msg_.get(), view.size());
+    }
+    Status(StatusCode status) : status_(status) {}
+
+    /* The context goes before the message, most recently added first. */
+    void prepend_message(StaticMessage str);
+    template <typename T>
+        requires (!std::is_array_v<std::remove_reference_t<T>> &&
+                  std::convertible_to<T, std::string_view>)
+    void prepend_message(T &&str)
+    {
+        auto context = std::make_shared<Context>();
+        context->next = std::move(context_);
+        context->owned = std::string_view(str);
+        context->text = context->owned;
+        context_ = std::move(context);
+    }
     // Prints the message with status code stringified.
-    void print_status();
+    void print_status() const;
 
-    bool Ok() { return status_ == StatusCode::kStatusOk; }
-    StatusCode status() { return status_; }
-    std::string user_friendly_message() { return user_friendly_msg_; }
-    std::string message() { return msg_; }
+    bool Ok() const { return status_ == StatusCode::kStatusOk; }
+    StatusCode status() const { return status_; }
+    std::string user_friendly_message() const
+    {
+        return std::string(user_friendly_msg_);
+    }
+    std::string message() const;
 
   private:
-    std::string status_code_stringify(StatusCode status);
+    /*
+     * One prepend_message(). Never changed once made, so copies of a Status
+     * share the chain and each can add to its own front.
+     */
+    typedef struct Context {
+        /* Added before this one. */
+        std::shared_ptr<const Context> next;
+        std::string_view text;
+        /* If it wasn't a literal, text points here. */
+        std::string owned;
+    } Context;
+
+    static std::string_view status_code_stringify(StatusCode status);
 
     StatusCode status_;
-    std::string msg_;
-    std::string user_friendly_msg_;
+    std::string_view msg_;
+    std::string_view user_friendly_msg_;
+    /* msg_ points here if it wasn't a literal. */
+    std::shared_ptr<char[]> owned_msg_;
+    /* Most recently added first. */
+    std::shared_ptr<const Context> context_;
 };
 
 };
@@ -0,0 +1,139 @@
+#ifndef TEXT_RENDERER_H
+#define TEXT_RENDERER_H
+
+#include <cstdint>
+#include <expected>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "status.h"
+
+/* As FreeType declares them, so its headers stay out of here. */
+typedef struct FT_LibraryRec_ *FT_Library;
+typedef struct FT_FaceRec_ *FT_Face;
+
+namespace sticker_bot {
+
+typedef struct TextOptions {
+    /* TrueType or OpenType font for most of the text. */
+    std::string font_path;
+    /*
+     * Tried in order for characters font_path doesn't have, such as emoji.
+     * Color bitmap fonts like Noto Color Emoji are scaled to the text size.
+     * Fonts that aren't installed are skipped.
+     */
+    std::vector<std::string> fallback_font_paths;
+    /* Font size in dots. */
+    uint32_t pixel_size;
+    /* Blank dots at either side of each line. */
+    uint32_t margin;
+    /* Anything past this many lines isn't printed. */
+    uint32_t max_lines;
+} TextOptions;
+
+/* Not constexpr, because of the paths. */
+inline const TextOptions kDefaultTextOptions = {
+    .font_path = "/usr/share/fonts/truetype/dejavu/DejaVuSans.ttf",
+    .fallback_font_paths = {
+        "/usr/share/fonts/truetype/noto/NotoColorEmoji.ttf",
+        "/usr/share/fonts/truetype/ancient-scripts/Symbola_hint.ttf",
+    },
+    .pixel_size = 48,
+    .margin = 8,
+    .max_lines = 20,
+};
+
+/*
+ * Renders text straight into the printer's raster format with FreeType.
+ *
+ * Each glyph is rasterized once, hinted for 1 bit output, into an atlas kept
+ * per font and size. After that a label is word wrapped and copied together
+ * from the atlas, which takes microseconds. Lines are centered.
+ *
+ * There's no shaping, only kerning, so scripts that need it such as Arabic
+ * don't join up, and emoji sequences print as their separate emoji.
+ */
+class TextRenderer {
+  public:
+    static std::expected<std::unique_ptr<TextRenderer>, Status>
+        Create(const TextOptions &options = kDefaultTextOptions);
+
+    TextRenderer(FT_Library library, std::vector<FT_Face> faces,
+                 const TextOptions &options) :
+        library_(library),
+        faces_(std::move(faces)),
+        options_(options) {}
+    ~TextRenderer();
+
+    /*
+     * UTF-8 text, wrapped to width dots, a multiple of 8. 0 for pixel_size
+     * uses the one from the options.
+     */
+    std::expected<std::vector<uint8_t>, Status>
+        Render(std::string_view text, uint32_t width, uint32_t pixel_size = 0);
+
+  private:
+    /* Where a glyph is in its atlas, and how to place it, in dots. */
+    typedef struct Glyph {
+        uint32_t x;
+        uint32_t y;
+        uint32_t width;
+        uint32_t rows;
+        /* From the pen position to the left edge. */
+        int32_t left;
+        /* From the baseline up to the top row. */
+        int32_t top;
+        int32_t advance;
+    } Glyph;
+
+    /*
+     * Coverage, 0 to 255, of every glyph rasterized so far for one font and
+     * size, packed in rows kAtlasWidth across.
+     */
+    typedef struct GlyphAtlas {
+        std::unordered_map<uint32_t, Glyph> glyphs;
+        std::vector<uint8_t> coverage;
+        uint32_t rows;
+        /* Where the next glyph goes. */
+        uint32_t next_x;
+        uint32_t next_y;
+        uint32_t row_height;
+    } GlyphAtlas;
+
+    static constexpr uint32_t kAtlasWidth = 1024;
+    static constexpr uint32_t kMaxPixelSize = 256;
+
+    /* Sets the size on a scalable face, a bitmap one only has its own. */
+    void SetPixelSize(FT_Face face, uint32_t pixel_size);
+    /*
+     * The glyph from the font and size's atlas, rasterized into it the first
+     * time. Stays valid as more are added.
+     */
+    std::expected<const Glyph *, Status> GetGlyph(GlyphAtlas &atlas,
+                                                  FT_Face face,
+                                                  uint32_t glyph_index,
+                                                  uint32_t pixel_size);
+    /* Adds a coverage bitmap to the atlas. */
+    static Glyph AddToAtlas(GlyphAtlas &atlas,
+                            const std::vector<uint8_t> &bitmap,
+                            uint32_t width, uint32_t rows);
+
+    FT_Library library_;
+    /* The main font first, then the fallbacks that could be loaded. */
+    std::vector<FT_Face> faces_;
+    const TextOptions options_;
+    /* FreeType faces aren't thread safe, and neither are the atlases. */
+    std::mutex mu_;
+    /* Keyed by index into faces_ and pixel size. */
+    std::map<std::pair<size_t, uint32_t>, GlyphAtlas> atlases_;
+};
+
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef TRIM_H
+#define TRIM_H
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include "resampler.h"
+
+namespace sticker_bot {
+
+typedef struct TrimOptions {
+    bool enabled;
+    /*
+     * Negated gray levels up to this count as blank: white, and transparent,
+     * which is flattened onto white. Enough to ignore JPEG noise in a white
+     * border.
+     */
+    uint8_t tolerance;
+    /* Blank dots kept around the content on each side. */
+    uint32_t padding;
+    /*
+     * If the content, with padding, is narrower than this fraction of the
+     * width, the image is decoded again cropped to it, so it's printed
+     * across the whole width. Otherwise only the blank rows above and below
+     * it are dropped, which costs nothing.
+     */
+    double redecode_below;
+} TrimOptions;
+
+constexpr TrimOptions kDefaultTrimOptions = {
+    .enabled = true,
+    .tolerance = 16,
+    .padding = 8,
+    .redecode_below = 0.9,
+};
+
+/* Where the content is, right and bottom exclusive. */
+typedef struct ContentBox {
+    uint32_t left;
+    uint32_t top;
+    uint32_t right;
+    uint32_t bottom;
+} ContentBox;
+
+/*
+ * Finds the content in a negated grayscale image width dots across, or
+ * nullopt if it's all blank.
+ *
+ * One pass over the image, 16 dots at a time with NEON or SSE2: each row's
+ * maximum says whether it's blank, and a running maximum per column says
+ * which columns ever aren't.
+ */
+std::optional<ContentBox> FindContent(std::span<const uint8_t> gray,
+                                      uint32_t width, uint8_t tolerance);
+
+/*
+ * The part of a width x height image to decode again so box, with padding,
+ * fills the width, or nullopt if it's already wide enough.
+ */
+std::optional<ImageRegion> TrimRegion(const ContentBox &box, uint32_t width,
+                                      uint32_t height,
+                                      const TrimOptions &options);
+
+/* Drops the rows above and below box, but for padding. */
+void TrimRows(std::vector<uint8_t> &gray, uint32_t width,
+              const ContentBox &box, uint32_t padding);
+
+};
+
+#endif
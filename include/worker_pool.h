@@ -0,0 +1,37 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sticker_bot {
+
+/* Runs tasks first come first served on a fixed number of threads. */
+class WorkerPool {
+  public:
+    typedef std::function<void()> Task;
+
+    explicit WorkerPool(uint32_t num_threads);
+    /* Waits for running tasks, anything still queued is dropped. */
+    ~WorkerPool();
+
+    void Submit(Task task);
+
+  private:
+    void WorkLoop();
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<Task> tasks_;
+    bool stop_;
+    std::vector<std::thread> workers_;
+};
+
+};
+
+#endif
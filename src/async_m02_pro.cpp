@@ -0,0 +1,216 @@
+#include "async_m02_pro.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <span>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+#include "event_loop.h"
+#include "feed_thread.h"
+#include "m02_pro.h"
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+static constexpr std::chrono::seconds kReadTimeout(M02Pro::kReadTimeoutSec);
+/*
+ * Writes only wait while the printer's buffer drains, so this is generous.
+ * It's reported as an error rather than kTimeout, the image never got there.
+ */
+static constexpr std::chrono::seconds kWriteTimeout(M02Pro::kReadTimeoutSec);
+
+std::expected<std::unique_ptr<AsyncM02Pro>, Status>
+    AsyncM02Pro::Create(const std::string &path, EventLoop *loop,
+                        const M02ProOptions &options)
+{
+    int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        return std::unexpected(Status(StatusCode::kInvalidArgument,
+                      "Failed to open M02 Pro file descriptor"));
+    }
+
+    return std::make_unique<AsyncM02Pro>(fd, path, loop, options);
+}
+
+Task<Status> AsyncM02Pro::SendCmd(std::span<const uint8_t> data)
+{
+    size_t total_written = 0;
+    while (total_written < data.size()) {
+        size_t num_to_write = std::min<size_t>(data.size() - total_written,
+                                               M02Pro::kMaxBufferSize);
+        FeedJitter::Clock::time_point start = FeedJitter::Clock::now();
+        ssize_t bytes_written = write(fd_, &data[total_written],
+                                      num_to_write);
+        if (bytes_written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                co_return Status(StatusCode::kInternalError,
+                                 "Failed to send data");
+            }
+
+            Status status = co_await loop_->WaitFd(fd_, EPOLLOUT,
+                                                   kWriteTimeout);
+            if (!status.Ok()) {
+                co_return Status(StatusCode::kInternalError,
+                                 "Printer stopped taking data");
+            }
+            jitter_.Waited();
+            continue;
+        }
+        jitter_.Wrote(start, bytes_written);
+
+        DB_PRINT("%s: wrote %zd bytes\n", __func__, bytes_written);
+        total_written += bytes_written;
+    }
+
+    co_return Status(StatusCode::kStatusOk);
+}
+
+Task<Status> AsyncM02Pro::ReadData(std::span<uint8_t> data,
+                                   size_t min_to_read)
+{
+    size_t total_read = 0;
+
+    do {
+        Status status = co_await loop_->WaitFd(fd_, EPOLLIN, kReadTimeout);
+        if (!status.Ok()) {
+            if (status.status() == StatusCode::kTimeout) {
+                co_return Status(StatusCode::kTimeout, "Timed out on read");
+            }
+            co_return status;
+        }
+
+        ssize_t bytes_read = read(fd_, &data[total_read],
+                                  data.size() - total_read);
+        if (bytes_read < 0) {
+            /*
+             * Woken up with nothing there after all. Wait again, even with
+             * min_to_read 0, or the caller gets a reply that never came.
+             */
+            if (errno == EAGAIN || errno == EINTR) {
+                continue;
+            }
+            co_return Status(StatusCode::kInternalError,
+                             "Failed to read data from printer");
+        }
+        if (bytes_read == 0) {
+            co_return Status(StatusCode::kInternalError,
+                             "Printer disconnected");
+        }
+
+        DB_PRINT("%s: read %zd bytes\n", __func__, bytes_read);
+        DB_PRINT_ARRAY(&data[total_read], bytes_read);
+        total_read += bytes_read;
+    } while (total_read == 0 || total_read < min_to_read);
+
+    co_return Status(StatusCode::kStatusOk);
+}
+
+Task<Status> AsyncM02Pro::SendImage(std::span<const uint8_t> data,
+                                    uint16_t bytes_x, uint16_t bytes_y)
+{
+    /* Named, so they're certainly alive across each co_await. */
+    const std::vector<uint8_t> init_cmd = M02Pro::InitCmd();
+    const std::vector<uint8_t> settings_cmd = M02Pro::SettingsCmd(options_);
+    const std::vector<uint8_t> raster_cmd = M02Pro::RasterImageCmd(bytes_x,
+                                                                   bytes_y);
+    const std::vector<uint8_t> feed_cmd = M02Pro::LineFeedCmd(
+            M02Pro::kFeedRows);
+
+    Status status = co_await SendCmd(init_cmd);
+    if (!status.Ok()) {
+        status.prepend_message("Failed to initialize printer: ");
+        co_return status;
+    }
+    if (!settings_cmd.empty()) {
+        status = co_await SendCmd(settings_cmd);
+        if (!status.Ok()) {
+            status.prepend_message("Failed to set speed and density: ");
+            co_return status;
+        }
+    }
+    status = co_await SendCmd(raster_cmd);
+    if (!status.Ok()) {
+        status.prepend_message("Failed to send raster image header");
+        co_return status;
+    }
+    status = co_await SendCmd(data);
+    if (!status.Ok()) {
+        status.prepend_message("Failed to send raster image");
+        co_return status;
+    }
+    status = co_await SendCmd(feed_cmd);
+    if (!status.Ok()) {
+        status.prepend_message("Failed to send line feed");
+    }
+    co_return status;
+}
+
+Task<Status> AsyncM02Pro::PrintImageAsync(std::span<const uint8_t> data,
+                                          uint16_t width)
+{
+    /* The raster format encodes 8 pixels in 1 byte. */
+    uint16_t bytes_x = width / 8;
+    uint16_t bytes_y = data.size() / bytes_x;
+
+    auto guard = co_await mu_printer_.Lock();
+
+    Status status(StatusCode::kStatusOk);
+    {
+        const FeedOptions lock_only = {
+            .realtime_priority = 0,
+            .cpu = -1,
+            .lock_memory = options_.feed.lock_memory,
+        };
+        FeedScope feed_scope(lock_only, data);
+        jitter_.StartFeed();
+        status = co_await SendImage(data, bytes_x, bytes_y);
+        jitter_.EndFeed(status.Ok());
+    }
+    if (!status.Ok()) {
+        co_return status;
+    }
+
+    /* Read the message the printer says when it finishes printing. */
+    std::vector<uint8_t> buf(256);
+    status = co_await ReadData(buf, 0);
+    DB_PRINT("Print and status read done, Status OK=%d\n", status.Ok());
+    if (status.Ok()) {
+        printf("Printer status: %.2x %.2x\n", buf[0], buf[1]);
+    }
+    co_return status;
+}
+
+Task<Status> AsyncM02Pro::PrinterStatusAsync()
+{
+    const std::vector<uint8_t> read_battery_cmd = M02Pro::ReadBatteryCmd();
+    std::vector<uint8_t> data(8);
+
+    auto guard = co_await mu_printer_.Lock();
+
+    Status status = co_await SendCmd(read_battery_cmd);
+    if (!status.Ok()) {
+        co_return status;
+    }
+    status = co_await ReadData(data, 0);
+    if (!status.Ok()) {
+        co_return status;
+    }
+
+    M02Pro::LogStatusReply(data);
+    co_return Status(StatusCode::kStatusOk);
+}
+
+};
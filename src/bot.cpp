@@ -1,7 +1,13 @@
+#include <algorithm>
+#include <cinttypes>
+#include <future>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
+#include <errno.h>
+#include <sys/resource.h>
 #include <unistd.h>
 
 #include "tgbot/tgbot.h"
@@ -44,47 +50,469 @@ static bool IsFileWebm(const std::string &data)
     return extension == "webm";
 }
 
-Status Bot::PrintStickers(const std::vector<std::string> &file_paths)
+Bot::DownloadResult Bot::DownloadJob(const PrintJob &job)
 {
+    std::string data;
+    try {
+        TgBot::File::Ptr file = bot_.getApi().getFile(job.file_id);
+        data = bot_.getApi().downloadFile(file->filePath);
+    } catch (std::exception &e) {
+        Status status(StatusCode::kNotFoundError, e.what());
+        status.prepend_message("Failed to download file: ");
+        return std::unexpected(status);
+    }
+    files_downloaded_++;
+    bytes_downloaded_ += data.size();
+    printf("Downloaded %zu bytes for job %" PRIu64 "\n", data.size(), job.id);
+
+    /* std::format isn't supported until gcc 13, so do this. */
+    char buf[64];
+    {
+        std::lock_guard<std::mutex> lock(mu_file_num_);
+        snprintf(buf, sizeof(buf), "file-%zu", file_num_);
+        file_num_++;
+    }
+    std::string file_name = buf;
+    if (IsFileWebm(data)) {
+        file_name.append(".webm");
+    }
+
+    Status status = WriteFile(file_name, data);
+    if (!status.Ok()) {
+        return std::unexpected(status);
+    }
+    return file_name;
+}
+
+void Bot::RecordStage(StageTiming &timing, Clock::time_point start)
+{
+    double ms = std::chrono::duration<double, std::milli>(Clock::now() -
+                                                          start).count();
+    std::lock_guard<std::mutex> lock(mu_stage_timings_);
+    timing.count++;
+    timing.total_ms += ms;
+    timing.max_ms = std::max(timing.max_ms, ms);
+}
+
+static const char *QualityLevelName(QualityLevel level)
+{
+    switch (level) {
+    case QualityLevel::kFull:
+        return "full";
+    case QualityLevel::kReduced:
+        return "reduced";
+    case QualityLevel::kMinimal:
+        return "minimal";
+    }
+    return "unknown";
+}
+
+static bool ThresholdReached(const QualityThreshold &threshold,
+                             const SchedulerStats &stats)
+{
+    return (threshold.queue_depth &&
+            stats.queue_depth >= threshold.queue_depth) ||
+        (threshold.wait_s > 0 &&
+         stats.projected_wait_ms >= threshold.wait_s * 1000);
+}
+
+QualityLevel Bot::PickQualityLevel()
+{
+    SchedulerStats stats = scheduler_.Stats();
+    QualityLevel level = QualityLevel::kFull;
+    if (ThresholdReached(options_.minimal_quality, stats)) {
+        level = QualityLevel::kMinimal;
+    } else if (ThresholdReached(options_.reduced_quality, stats)) {
+        level = QualityLevel::kReduced;
+    }
+
+    if (level != quality_level_.exchange(level)) {
+        printf("Print quality now %s, %zu jobs queued, projected wait "
+               "%.0f s\n", QualityLevelName(level), stats.queue_depth,
+               stats.projected_wait_ms / 1000);
+    }
+    if (level == QualityLevel::kReduced) {
+        jobs_reduced_++;
+    } else if (level == QualityLevel::kMinimal) {
+        jobs_minimal_++;
+    }
+    return level;
+}
 
-    for (const auto &file : file_paths) {
-        auto image = ImageTransform::ImageFromFile(file);
-        if (!image.has_value()) {
-            return image.error();
+Bot::RenderResult Bot::RenderJob(const PrintJob &job,
+                                 const DownloadResult &file,
+                                 QualityLevel quality)
+{
+    if (!file.has_value()) {
+        return std::unexpected(file.error());
+    }
+
+    Clock::time_point start = Clock::now();
+    auto image = ImageTransform::ImageFromFile(
+            *file, converter_.get(),
+            quality == QualityLevel::kFull ? ResampleQuality::kBest :
+                ResampleQuality::kFast,
+            ColumnWidth(BYTES_X, job.options.columns), options_.trim);
+    RecordStage(decode_timing_, start);
+    int ret = remove(file->c_str());
+    if (ret) {
+        printf("Couldn't remove file %s, errno %d\n", file->c_str(), ret);
+    }
+    if (!image.has_value()) {
+        return std::unexpected(image.error());
+    }
+    std::unique_ptr<ImageTransform> img = std::move(*image);
+
+    /* The chat's choice still goes in the journal, for a reprint. */
+    DitherAlgorithm dither = job.options.dither;
+    if (quality == QualityLevel::kMinimal) {
+        dither = DitherAlgorithm::kOrdered;
+    }
+    start = Clock::now();
+    std::vector<uint8_t> data = img->RasterImageDither(dither,
+                                                       job.options.scan);
+    RecordStage(dither_timing_, start);
+    return std::make_shared<const std::vector<uint8_t>>(std::move(data));
+}
+
+const Bot::RenderResult &Bot::RenderInFlight(const PrintJob &job,
+                                             InFlightFile &file,
+                                             QualityLevel quality)
+{
+    {
+        std::lock_guard<std::mutex> lock(file.mu);
+        if (file.raster.has_value()) {
+            printf("Job %" PRIu64 " reusing an earlier render\n", job.id);
+        } else {
+            file.raster = RenderJob(job, file.download.get(), quality);
+            /* Degraded renders aren't worth keeping. */
+            if (file.raster->has_value() && quality == QualityLevel::kFull) {
+                raster_cache_.Put(file.key, **file.raster);
+            }
         }
-        std::unique_ptr<ImageTransform> img = std::move(*image);
+    }
+    /* Never written again once it's set. */
+    const RenderResult &raster = *file.raster;
+    if (!raster.has_value() && journal_) {
+        /* Retrying later won't help, so don't keep it in the journal. */
+        journal_->MarkDone(job.id);
+    }
+    return raster;
+}
 
-        std::vector<uint8_t> data = img->RasterImageDitherAtkinson();
-        Status status = printer_->PrintImage(data, BYTES_X * 8);
-        if (!status.Ok()) {
-           return status;
+Status Bot::PrintRaster(std::span<const uint8_t> raster,
+                        std::span<const PrintJob> jobs)
+{
+    Clock::time_point start = Clock::now();
+    Status status = printer_->PrintImage(raster, BYTES_X * 8);
+    RecordStage(print_timing_, start);
+
+    /*
+     * A timeout means the printer didn't say it finished, but it most likely
+     * printed. Anything else means it never got the image, so leave the jobs
+     * in the journal to be printed after a restart.
+     */
+    if (journal_ && (status.Ok() || status.status() == StatusCode::kTimeout)) {
+        for (const PrintJob &job : jobs) {
+            journal_->MarkDone(job.id);
         }
+    }
+    return status;
+}
 
-        int ret = remove(file.c_str());
-        if (ret) {
-            printf("Couldn't remove file %s, errno %d\n", file.c_str(), ret);
+Status Bot::PrintJobFile(const PrintJob &job, InFlightFile &file,
+                         QualityLevel quality)
+{
+    const RenderResult &raster = RenderInFlight(job, file, quality);
+    if (!raster.has_value()) {
+        return raster.error();
+    }
+    return PrintRaster(**raster, std::span(&job, 1));
+}
+
+Status Bot::PrintLayout(std::span<const LayoutJob> batch, QualityLevel quality)
+{
+    std::vector<PrintJob> jobs;
+    std::vector<LayoutItem> items;
+    /* Keeps the rasters alive until they've been packed. */
+    std::vector<Raster> rasters;
+    for (const LayoutJob &entry : batch) {
+        const RenderResult &raster = RenderInFlight(entry.job, *entry.file,
+                                                    quality);
+        if (!raster.has_value()) {
+            raster.error().print_status();
+            bot_.getApi().sendMessage(entry.job.chat_id,
+                                      "I couldn't print the sticker");
+            continue;
         }
+        jobs.push_back(entry.job);
+        rasters.push_back(*raster);
+        items.push_back({
+            .raster = **raster,
+            .width_bytes = ColumnWidth(BYTES_X, entry.job.options.columns) / 8,
+        });
+    }
+    if (items.empty()) {
+        return Status(StatusCode::kStatusOk);
     }
 
-    return Status(StatusCode::kStatusOk);
+    std::vector<uint8_t> raster = PackShelves(items, BYTES_X);
+    size_t rows_alone = 0;
+    for (const LayoutItem &item : items) {
+        rows_alone += item.raster.size() / item.width_bytes;
+    }
+    printf("Packed %zu stickers into %zu rows, %zu one after another\n",
+           items.size(), raster.size() / BYTES_X, rows_alone);
+    return PrintRaster(raster, jobs);
 }
 
-void Bot::PrintStickersAsync(const std::vector<std::string> &file_paths,
-                             TgBot::Message::Ptr message)
+void Bot::RunJob(const PrintJob &job, InFlightFile &file)
 {
-    Status status = PrintStickers(file_paths);
+    QualityLevel quality = PickQualityLevel();
+    Status status = PrintJobFile(job, file, quality);
 
-    if (!status.Ok() && status.status() != StatusCode::kTimeout) {
-        std::string user_message;
+    if (!status.Ok()) {
+        status.print_status();
+        if (status.status() != StatusCode::kTimeout) {
+            bot_.getApi().sendMessage(job.chat_id,
+                                      "I couldn't print the sticker");
+        }
+    }
+    /* Only for the log, so it's the first thing to go when busy. */
+    if (quality == QualityLevel::kFull) {
+        printer_->PrinterStatus();
+    }
+}
 
-        if (file_paths.size() > 1) {
-            user_message = "I couldn't print the stickers";
+void Bot::RunLayoutJobs(int64_t chat_id)
+{
+    std::vector<LayoutJob> batch;
+    {
+        std::lock_guard<std::mutex> lock(mu_layout_);
+        auto it = layout_pending_.find(chat_id);
+        if (it == layout_pending_.end()) {
+            return;
+        }
+        std::deque<LayoutJob> &pending = it->second;
+        while (!pending.empty() && batch.size() < options_.max_layout_batch) {
+            batch.push_back(std::move(pending.front()));
+            pending.pop_front();
+        }
+        if (pending.empty()) {
+            layout_pending_.erase(it);
         } else {
-            user_message = "I couldn't print the sticker";
+            /* The rest were accepted already, they get the next turn. */
+            Status status = scheduler_.Enqueue(chat_id, [this, chat_id]() {
+                RunLayoutJobs(chat_id);
+            }, /*ignore_cap=*/true);
+            if (!status.Ok()) {
+                status.print_status();
+            }
         }
-        bot_.getApi().sendMessage(message->chat->id, user_message);
     }
-    printer_->PrinterStatus();
+
+    QualityLevel quality = PickQualityLevel();
+    Status status = PrintLayout(batch, quality);
+    if (!status.Ok()) {
+        status.print_status();
+        if (status.status() != StatusCode::kTimeout) {
+            bot_.getApi().sendMessage(chat_id, "I couldn't print the stickers");
+        }
+    }
+    if (quality == QualityLevel::kFull) {
+        printer_->PrinterStatus();
+    }
+}
+
+Status Bot::QueueLayoutJob(LayoutJob entry, bool replayed)
+{
+    int64_t chat_id = entry.job.chat_id;
+
+    /*
+     * Locked until the job is in there, so a turn already queued can't run
+     * first and find nothing.
+     */
+    std::lock_guard<std::mutex> lock(mu_layout_);
+    std::deque<LayoutJob> &pending = layout_pending_[chat_id];
+    size_t max_queued = scheduler_.options().max_queued_per_chat;
+    if (!replayed && max_queued && pending.size() >= max_queued) {
+        return Status(StatusCode::kResourceExhausted,
+                      "Too many jobs queued for chat");
+    }
+
+    /* One turn per batch, not per job, so each print costs one token. */
+    if (pending.empty()) {
+        Status status = scheduler_.Enqueue(chat_id, [this, chat_id]() {
+            RunLayoutJobs(chat_id);
+        }, /*ignore_cap=*/replayed);
+        if (!status.Ok()) {
+            layout_pending_.erase(chat_id);
+            return status;
+        }
+    }
+    pending.push_back(std::move(entry));
+    return Status(StatusCode::kStatusOk);
+}
+
+std::string Bot::RenderKey(const PrintJob &job)
+{
+    char options[16];
+    snprintf(options, sizeof(options), " %u %u %u",
+             static_cast<uint32_t>(job.options.dither),
+             static_cast<uint32_t>(job.options.scan),
+             static_cast<uint32_t>(job.options.columns));
+    return (job.file_unique_id.empty() ? job.file_id : job.file_unique_id) +
+        options;
+}
+
+void Bot::QueueJob(const PrintJob &job, bool replayed)
+{
+    std::string key = RenderKey(job);
+
+    /*
+     * Held until the job is queued, so a duplicate arriving at the same time
+     * can't miss the entry or find one that's never downloaded.
+     */
+    std::lock_guard<std::mutex> lock(mu_in_flight_);
+    std::erase_if(in_flight_, [](const auto &entry) {
+        return entry.second.expired();
+    });
+
+    std::shared_ptr<InFlightFile> file = in_flight_[key].lock();
+    std::shared_ptr<std::promise<DownloadResult>> download;
+    Raster cached;
+    if (file) {
+        DB_PRINT("Job %" PRIu64 " joining one in flight\n", job.id);
+    } else if ((cached = raster_cache_.Get(key)) != nullptr) {
+        /* Nothing to download or render, it's ready to print. */
+        file = std::make_shared<InFlightFile>();
+        file->key = key;
+        file->raster = cached;
+    } else {
+        file = std::make_shared<InFlightFile>();
+        file->key = key;
+        download = std::make_shared<std::promise<DownloadResult>>();
+        file->download = download->get_future().share();
+    }
+
+    /* Jobs printed side by side wait in layout_pending_ for their batch. */
+    Status status(StatusCode::kStatusOk);
+    if (job.options.columns > 1) {
+        status = QueueLayoutJob({.job = job, .file = file}, replayed);
+    } else {
+        status = scheduler_.Enqueue(job.chat_id, [this, job, file]() {
+            RunJob(job, *file);
+        }, /*ignore_cap=*/replayed);
+    }
+    if (status.Ok()) {
+        in_flight_[key] = file;
+        if (!download) {
+            if (!cached) {
+                jobs_coalesced_++;
+            }
+            return;
+        }
+        /* The job waits for this if it gets to the front first. */
+        download_pool_.Submit([this, job, download]() {
+            Clock::time_point start = Clock::now();
+            download->set_value(DownloadJob(job));
+            RecordStage(download_timing_, start);
+        });
+        return;
+    }
+
+    status.print_status();
+    if (replayed) {
+        /* Left in the journal, to try again on the next start. */
+        return;
+    }
+    if (journal_) {
+        journal_->MarkDone(job.id);
+    }
+    if (status.status() == StatusCode::kResourceExhausted) {
+        bot_.getApi().sendMessage(job.chat_id,
+                                  "You have too many stickers waiting to "
+                                  "print, try again in a bit");
+    }
+}
+
+void Bot::RunTextJob(int64_t chat_id, const std::string &text)
+{
+    Clock::time_point start = Clock::now();
+    auto raster = text_renderer_->Render(text, BYTES_X * 8);
+    if (!raster.has_value()) {
+        /* Such as only spaces, there's nothing to tell them. */
+        raster.error().print_status();
+        return;
+    }
+    printf("Rendered %zu bytes of text in %.0f us\n", text.size(),
+           std::chrono::duration<double, std::micro>(Clock::now() - start)
+               .count());
+
+    Status status = PrintRaster(*raster, {});
+    if (!status.Ok()) {
+        status.print_status();
+        if (status.status() != StatusCode::kTimeout) {
+            bot_.getApi().sendMessage(chat_id, "I couldn't print that");
+        }
+    }
+}
+
+void Bot::QueueTextJob(int64_t chat_id, const std::string &text)
+{
+    Status status = scheduler_.Enqueue(chat_id, [this, chat_id, text]() {
+        RunTextJob(chat_id, text);
+    });
+    if (status.Ok()) {
+        return;
+    }
+
+    status.print_status();
+    if (status.status() == StatusCode::kResourceExhausted) {
+        bot_.getApi().sendMessage(chat_id,
+                                  "You have too many stickers waiting to "
+                                  "print, try again in a bit");
+    }
+}
+
+void Bot::QueueJobs(std::vector<PrintJob> jobs)
+{
+    for (auto &job : jobs) {
+        if (journal_) {
+            Status status = journal_->Append(job);
+            if (!status.Ok()) {
+                /* Still print it, it just won't survive a restart. */
+                status.print_status();
+            }
+        }
+        QueueJob(job);
+    }
+}
+
+void Bot::ReplayJournal()
+{
+    if (!journal_) {
+        return;
+    }
+
+    std::vector<PrintJob> unfinished = journal_->TakeUnfinished();
+    if (unfinished.empty()) {
+        return;
+    }
+    printf("Reprinting %zu jobs from the journal\n", unfinished.size());
+
+    /*
+     * They're already in the journal, so just queue them in their old order,
+     * however many the chat has.
+     */
+    for (const auto &job : unfinished) {
+        QueueJob(job, /*replayed=*/true);
+    }
+}
+
+static uint64_t PhotoArea(const TgBot::PhotoSize::Ptr &photo)
+{
+    return static_cast<uint64_t>(photo->width) * photo->height;
 }
 
 std::expected<const TgBot::PhotoSize::Ptr, Status> Bot::FindBestPhoto(
@@ -92,6 +520,7 @@ std::expected<const TgBot::PhotoSize::Ptr, Status> Bot::FindBestPhoto(
 {
     ssize_t best_size = 0;
     size_t best_photo_index = 0;
+    size_t largest_photo_index = 0;
 
     if (photos.size() == 0) {
         return std::unexpected(Status(StatusCode::kInvalidArgument,
@@ -106,24 +535,513 @@ std::expected<const TgBot::PhotoSize::Ptr, Status> Bot::FindBestPhoto(
     for (size_t i = 0; i < photos.size(); i++) {
         if (photos[i]->fileSize > best_size) {
             best_size = photos[i]->fileSize;
-            best_photo_index = i;
+            largest_photo_index = i;
+        }
+    }
+    best_photo_index = largest_photo_index;
+
+    /*
+     * Images are rotated so their long side runs along the paper, so the short
+     * side is what has to cover the print width. Anything bigger than that is
+     * just more to download and decode, only to be thrown away by the
+     * resampler. If no size is big enough, the largest is the best we can do.
+     */
+    if (options_.photo_size_policy == PhotoSizePolicy::kSmallestSufficient) {
+        bool found = false;
+        for (size_t i = 0; i < photos.size(); i++) {
+            uint32_t short_side = std::min(photos[i]->width,
+                                           photos[i]->height);
+            if (short_side < options_.print_width) {
+                continue;
+            }
+            if (!found || PhotoArea(photos[i]) <
+                    PhotoArea(photos[best_photo_index])) {
+                best_photo_index = i;
+                found = true;
+            }
         }
     }
 
-    return photos[best_photo_index];
+    const TgBot::PhotoSize::Ptr &best = photos[best_photo_index];
+    const TgBot::PhotoSize::Ptr &largest = photos[largest_photo_index];
+    printf("Picked %dx%d photo (%lld bytes), largest is %dx%d (%lld bytes)\n",
+           best->width, best->height,
+           static_cast<long long>(best->fileSize), largest->width,
+           largest->height, static_cast<long long>(largest->fileSize));
+    return best;
+}
+
+PrintOptions Bot::ChatPrintOptions(int64_t chat_id)
+{
+    std::lock_guard<std::mutex> lock(mu_chat_options_);
+    auto it = chat_options_.find(chat_id);
+    return it == chat_options_.end() ? kDefaultPrintOptions : it->second;
+}
+
+void Bot::HandleDitherCommand(TgBot::Message::Ptr message)
+{
+    std::vector<std::string> args = StringTools::split(message->text, ' ');
+    if (args.size() < 2) {
+        PrintOptions options = ChatPrintOptions(message->chat->id);
+        std::string user_message = "Printing with ";
+        user_message += DitherAlgorithmName(options.dither);
+        if (options.scan == ScanOrder::kSerpentine) {
+            user_message += " (serpentine)";
+        }
+        user_message += ".\nUsage: /dither <algorithm> [serpentine]\n"
+            "Algorithms: " + DitherAlgorithmNames();
+        bot_.getApi().sendMessage(message->chat->id, user_message);
+        return;
+    }
+
+    auto algorithm = DitherAlgorithmFromName(args[1]);
+    if (!algorithm.has_value()) {
+        bot_.getApi().sendMessage(message->chat->id,
+                                  "I don't know that one, try one of: " +
+                                  DitherAlgorithmNames());
+        return;
+    }
+
+    PrintOptions options = ChatPrintOptions(message->chat->id);
+    options.dither = *algorithm;
+    options.scan = ScanOrder::kRaster;
+    if (args.size() >= 3 && args[2] == "serpentine") {
+        options.scan = ScanOrder::kSerpentine;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu_chat_options_);
+        chat_options_[message->chat->id] = options;
+    }
+    bot_.getApi().sendMessage(message->chat->id,
+                              "Got it, printing with " + args[1]);
+}
+
+void Bot::HandleLayoutCommand(TgBot::Message::Ptr message)
+{
+    std::vector<std::string> args = StringTools::split(message->text, ' ');
+    PrintOptions options = ChatPrintOptions(message->chat->id);
+    uint32_t columns = args.size() >= 2 ?
+        strtoul(args[1].c_str(), NULL, 10) : 0;
+    if (columns < 1 || columns > kMaxColumns) {
+        bot_.getApi().sendMessage(message->chat->id,
+                                  "Printing " +
+                                  std::to_string(options.columns) +
+                                  " across.\nUsage: /layout <1 to " +
+                                  std::to_string(kMaxColumns) +
+                                  ">, stickers side by side");
+        return;
+    }
+
+    options.columns = columns;
+    {
+        std::lock_guard<std::mutex> lock(mu_chat_options_);
+        chat_options_[message->chat->id] = options;
+    }
+    bot_.getApi().sendMessage(message->chat->id,
+                              "Got it, printing " + args[1] + " across");
+}
+
+bool Bot::PreviewEnabled(int64_t chat_id)
+{
+    std::lock_guard<std::mutex> lock(mu_chat_options_);
+    return preview_chats_.contains(chat_id);
+}
+
+void Bot::HandlePreviewCommand(TgBot::Message::Ptr message)
+{
+    std::vector<std::string> args = StringTools::split(message->text, ' ');
+    int64_t chat_id = message->chat->id;
+    if (args.size() < 2 || (args[1] != "on" && args[1] != "off")) {
+        bot_.getApi().sendMessage(chat_id,
+                                  std::string("Previews are ") +
+                                  (PreviewEnabled(chat_id) ? "on" : "off") +
+                                  ".\nUsage: /preview <on|off>, see each "
+                                  "sticker before it prints");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu_chat_options_);
+        if (args[1] == "on") {
+            preview_chats_.insert(chat_id);
+        } else {
+            preview_chats_.erase(chat_id);
+        }
+    }
+    bot_.getApi().sendMessage(chat_id, "Got it, previews " + args[1]);
+}
+
+bool Bot::TextEnabled(int64_t chat_id)
+{
+    std::lock_guard<std::mutex> lock(mu_chat_options_);
+    return text_chats_.contains(chat_id);
+}
+
+void Bot::HandleTextCommand(TgBot::Message::Ptr message)
+{
+    std::vector<std::string> args = StringTools::split(message->text, ' ');
+    int64_t chat_id = message->chat->id;
+    if (!text_renderer_) {
+        bot_.getApi().sendMessage(chat_id, "I can't print text, sorry");
+        return;
+    }
+    if (args.size() < 2 || (args[1] != "on" && args[1] != "off")) {
+        bot_.getApi().sendMessage(chat_id,
+                                  std::string("Printing text is ") +
+                                  (TextEnabled(chat_id) ? "on" : "off") +
+                                  ".\nUsage: /text <on|off>, print this "
+                                  "chat's messages as labels");
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mu_chat_options_);
+        if (args[1] == "on") {
+            text_chats_.insert(chat_id);
+        } else {
+            text_chats_.erase(chat_id);
+        }
+    }
+    bot_.getApi().sendMessage(chat_id, "Got it, printing text " + args[1]);
+}
+
+void Bot::QueuePreview(const PrintJob &job)
+{
+    Status status = preview_scheduler_.Enqueue(job.chat_id, [this, job]() {
+        SendPreview(job);
+    });
+    if (status.Ok()) {
+        return;
+    }
+
+    status.print_status();
+    if (status.status() == StatusCode::kResourceExhausted) {
+        bot_.getApi().sendMessage(job.chat_id,
+                                  "You have too many previews waiting, try "
+                                  "again in a bit");
+    }
+}
+
+void Bot::SendPreview(const PrintJob &job)
+{
+    std::string key = RenderKey(job);
+    Raster raster = raster_cache_.Get(key);
+    if (!raster) {
+        RenderResult rendered = RenderJob(job, DownloadJob(job),
+                                          QualityLevel::kFull);
+        if (!rendered.has_value()) {
+            rendered.error().print_status();
+            bot_.getApi().sendMessage(job.chat_id,
+                                      "I couldn't preview the sticker");
+            return;
+        }
+        raster = *rendered;
+        /* So Print doesn't download or render it again. */
+        raster_cache_.Put(key, raster);
+    }
+
+    Clock::time_point start = Clock::now();
+    auto png = EncodeRasterPng(*raster,
+                               ColumnWidth(BYTES_X, job.options.columns) / 8);
+    RecordStage(preview_timing_, start);
+    if (!png.has_value()) {
+        png.error().print_status();
+        return;
+    }
+    printf("Encoded a %zu byte preview in %.1f ms\n", png->size(),
+           std::chrono::duration<double, std::milli>(Clock::now() - start)
+               .count());
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(mu_previews_);
+        id = next_preview_id_++;
+        previews_[id] = job;
+        while (previews_.size() > options_.max_previews) {
+            previews_.erase(previews_.begin());
+        }
+    }
+
+    auto photo = std::make_shared<TgBot::InputFile>();
+    photo->data.assign(png->begin(), png->end());
+    photo->mimeType = "image/png";
+    photo->fileName = "preview.png";
+
+    auto print = std::make_shared<TgBot::InlineKeyboardButton>();
+    print->text = "Print";
+    print->callbackData = "print " + std::to_string(id);
+    auto dither = std::make_shared<TgBot::InlineKeyboardButton>();
+    dither->text = "Try another dither";
+    dither->callbackData = "dither " + std::to_string(id);
+    auto keyboard = std::make_shared<TgBot::InlineKeyboardMarkup>();
+    keyboard->inlineKeyboard.push_back({print, dither});
+
+    try {
+        bot_.getApi().sendPhoto(job.chat_id, photo,
+                                std::string(DitherAlgorithmName(
+                                        job.options.dither)),
+                                0, keyboard);
+    } catch (std::exception &e) {
+        /* Such as a sticker too long for Telegram to take as a photo. */
+        printf("Sending preview failed: %s\n", e.what());
+        bot_.getApi().sendMessage(job.chat_id,
+                                  "I couldn't send the preview, send "
+                                  "/preview off to print without one");
+    }
+}
+
+void Bot::HandleCallbackQuery(TgBot::CallbackQuery::Ptr query)
+{
+    std::vector<std::string> args = StringTools::split(query->data, ' ');
+    if (args.size() != 2) {
+        bot_.getApi().answerCallbackQuery(query->id);
+        return;
+    }
+    uint64_t id = strtoull(args[1].c_str(), NULL, 10);
+
+    std::optional<PrintJob> job;
+    {
+        std::lock_guard<std::mutex> lock(mu_previews_);
+        auto it = previews_.find(id);
+        if (it != previews_.end()) {
+            job = it->second;
+            /* Once, so a double tap doesn't print it twice. */
+            if (args[0] == "print") {
+                previews_.erase(it);
+            }
+        }
+    }
+    if (!job) {
+        bot_.getApi().answerCallbackQuery(query->id,
+                                          "That preview has expired");
+        return;
+    }
+
+    if (args[0] == "print") {
+        bot_.getApi().answerCallbackQuery(query->id, "Printing");
+        QueueJobs({*job});
+    } else if (args[0] == "dither") {
+        job->options.dither = NextDitherAlgorithm(job->options.dither);
+        bot_.getApi().answerCallbackQuery(
+                query->id,
+                "Trying " + std::string(DitherAlgorithmName(
+                        job->options.dither)));
+        QueuePreview(*job);
+    } else {
+        bot_.getApi().answerCallbackQuery(query->id);
+    }
+}
+
+bool Bot::IsAdmin(int64_t chat_id)
+{
+    return std::find(options_.admin_chat_ids.begin(),
+                     options_.admin_chat_ids.end(),
+                     chat_id) != options_.admin_chat_ids.end();
+}
+
+void Bot::HandlePrefetchCommand(TgBot::Message::Ptr message)
+{
+    if (!IsAdmin(message->chat->id)) {
+        bot_.getApi().sendMessage(message->chat->id,
+                                  "Only admins can do that");
+        return;
+    }
+
+    std::vector<std::string> args = StringTools::split(message->text, ' ');
+    if (args.size() < 2) {
+        bot_.getApi().sendMessage(message->chat->id,
+                                  "Usage: /prefetch <sticker set name>");
+        return;
+    }
+
+    /* Rendered with the chat's options, so they're what it prints with. */
+    int64_t chat_id = message->chat->id;
+    std::string set_name = args[1];
+    PrintOptions options = ChatPrintOptions(chat_id);
+    prefetch_pool_.Submit([this, chat_id, set_name, options]() {
+        PrefetchStickerSet(chat_id, set_name, options);
+    });
+    bot_.getApi().sendMessage(chat_id, "Prefetching " + set_name);
+}
+
+void Bot::PrefetchStickerSet(int64_t chat_id, const std::string &set_name,
+                             PrintOptions options)
+{
+    /* Every 20 stickers, so a 120 sticker set is a handful of messages. */
+    static constexpr size_t kProgressInterval = 20;
+    /* Only this thread, print jobs keep their CPU. */
+    static constexpr int kPrefetchNice = 19;
+
+    if (setpriority(PRIO_PROCESS, gettid(), kPrefetchNice)) {
+        printf("Couldn't lower prefetch priority, errno %d\n", errno);
+    }
+
+    TgBot::StickerSet::Ptr set;
+    try {
+        set = bot_.getApi().getStickerSet(set_name);
+    } catch (std::exception &e) {
+        printf("getStickerSet %s failed: %s\n", set_name.c_str(), e.what());
+        bot_.getApi().sendMessage(chat_id, "I couldn't find that sticker set");
+        return;
+    }
+
+    size_t num_stickers = set->stickers.size();
+    size_t rendered = 0;
+    size_t already_cached = 0;
+    size_t skipped = 0;
+    size_t failed = 0;
+    for (size_t i = 0; i < num_stickers; i++) {
+        const TgBot::Sticker::Ptr &sticker = set->stickers[i];
+        PrintJob job = {
+            .id = 0,
+            .chat_id = chat_id,
+            .file_id = sticker->fileId,
+            .file_unique_id = sticker->fileUniqueId,
+            .options = options,
+        };
+        std::string key = RenderKey(job);
+
+        if (sticker->isAnimated) {
+            /* Lottie, which nothing here can decode. */
+            skipped++;
+        } else if (raster_cache_.Contains(key)) {
+            already_cached++;
+        } else {
+            RenderResult raster = RenderJob(job, DownloadJob(job),
+                                            QualityLevel::kFull);
+            if (raster.has_value()) {
+                raster_cache_.Put(key, *raster);
+                rendered++;
+            } else {
+                raster.error().print_status();
+                failed++;
+            }
+        }
+
+        if ((i + 1) % kProgressInterval != 0 && i + 1 != num_stickers) {
+            continue;
+        }
+        RasterCacheStats cache = raster_cache_.Stats();
+        char buf[256];
+        snprintf(buf, sizeof(buf),
+                 "%s: %zu/%zu done, %zu rendered, %zu already cached, "
+                 "%zu skipped, %zu failed\n"
+                 "Cache: %zu stickers, %zu KiB of %zu KiB",
+                 set_name.c_str(), i + 1, num_stickers, rendered,
+                 already_cached, skipped, failed, cache.entries,
+                 cache.bytes / 1024, cache.capacity_bytes / 1024);
+        printf("%s\n", buf);
+        bot_.getApi().sendMessage(chat_id, buf);
+    }
+
+    if (num_stickers == 0) {
+        bot_.getApi().sendMessage(chat_id, set_name + " has no stickers");
+    }
+}
+
+static std::string StageString(const char *name, const StageTiming &timing)
+{
+    char buf[96];
+    snprintf(buf, sizeof(buf), "\n%s: mean %.0f ms, max %.0f ms", name,
+             timing.count ? timing.total_ms / timing.count : 0,
+             timing.max_ms);
+    return buf;
+}
+
+std::string Bot::StatsString()
+{
+    uint64_t files = files_downloaded_;
+    uint64_t bytes = bytes_downloaded_;
+    char buf[160];
+    snprintf(buf, sizeof(buf), "\nDownloaded %" PRIu64 " files, %" PRIu64
+             " KiB (%" PRIu64 " KiB each), %" PRIu64 " jobs reused a render",
+             files, bytes / 1024, files ? bytes / files / 1024 : 0,
+             jobs_coalesced_.load());
+
+    std::string stats = scheduler_.StatsString() + buf;
+    snprintf(buf, sizeof(buf), "\nQuality: %s, %" PRIu64 " jobs reduced, %"
+             PRIu64 " minimal", QualityLevelName(quality_level_),
+             jobs_reduced_.load(), jobs_minimal_.load());
+    stats += buf;
+    RasterCacheStats cache = raster_cache_.Stats();
+    snprintf(buf, sizeof(buf), "\nCache: %zu stickers, %zu KiB of %zu KiB, %"
+             PRIu64 " hits, %" PRIu64 " misses", cache.entries,
+             cache.bytes / 1024, cache.capacity_bytes / 1024, cache.hits,
+             cache.misses);
+    stats += buf;
+    SchedulerStats previews = preview_scheduler_.Stats();
+    snprintf(buf, sizeof(buf), "\nPreviews: %zu queued, %" PRIu64 " made, %"
+             PRIu64 " turned away", previews.queue_depth, previews.jobs_run,
+             previews.jobs_rejected);
+    stats += buf;
+    std::lock_guard<std::mutex> lock(mu_stage_timings_);
+    stats += StageString("Download", download_timing_);
+    stats += StageString("Decode", decode_timing_);
+    stats += StageString("Dither", dither_timing_);
+    stats += StageString("Print", print_timing_);
+    stats += StageString("Preview", preview_timing_);
+    std::string printer = printer_->StatsString();
+    if (!printer.empty()) {
+        stats += "\n" + printer;
+    }
+    return stats;
 }
 
 void Bot::InitBot()
 {
+    auto converter = ConverterPool::Create(options_.convert_worker_path,
+                                           options_.convert_workers);
+    if (converter.has_value()) {
+        converter_ = std::move(*converter);
+        printf("Started %zu converter workers\n", converter_->num_workers());
+    } else {
+        converter.error().print_status();
+        printf("Running ImageMagick with popen() instead\n");
+    }
+
+    auto text_renderer = TextRenderer::Create(options_.text);
+    if (text_renderer.has_value()) {
+        text_renderer_ = std::move(*text_renderer);
+    } else {
+        text_renderer.error().print_status();
+        printf("Text messages won't be printed\n");
+    }
+
     bot_.getEvents().onAnyMessage([this](TgBot::Message::Ptr message) {
         printf("Got message %s\n", message->text.c_str());
         if (StringTools::startsWith(message->text, "/start")) {
             return;
         }
+        if (StringTools::startsWith(message->text, "/dither")) {
+            HandleDitherCommand(message);
+            return;
+        }
+        if (StringTools::startsWith(message->text, "/layout")) {
+            HandleLayoutCommand(message);
+            return;
+        }
+        if (StringTools::startsWith(message->text, "/preview")) {
+            HandlePreviewCommand(message);
+            return;
+        }
+        if (StringTools::startsWith(message->text, "/text")) {
+            HandleTextCommand(message);
+            return;
+        }
+        if (StringTools::startsWith(message->text, "/prefetch")) {
+            HandlePrefetchCommand(message);
+            return;
+        }
+        if (StringTools::startsWith(message->text, "/stats")) {
+            bot_.getApi().sendMessage(message->chat->id, StatsString());
+            return;
+        }
 
-        std::vector<std::string> files;
-        /* The path to the file we write to disk. */
-        std::vector<std::string> file_paths;
+        /*
+         * The files to print as {file_id, file_unique_id}, downloaded once
+         * the job runs.
+         */
+        std::vector<std::pair<std::string, std::string>> files;
 
         /*
          * Handle photos.
@@ -137,74 +1055,103 @@ void Bot::InitBot()
             if (!photo) {
                 photo.error().print_status();
             } else {
-                TgBot::File::Ptr file =
-                    bot_.getApi().getFile(photo.value()->fileId);
-                files.push_back(bot_.getApi().downloadFile(file->filePath));
+                files.emplace_back(photo.value()->fileId,
+                                   photo.value()->fileUniqueId);
             }
         }
 
         /* Handle messages with files. */
         if (message->document) {
-            TgBot::File::Ptr file =
-                bot_.getApi().getFile(message->document->fileId);
-            files.push_back(bot_.getApi().downloadFile(file->filePath));
+            files.emplace_back(message->document->fileId,
+                               message->document->fileUniqueId);
         }
 
         /* Handle stickers. */
         if (message->sticker) {
-            TgBot::File::Ptr file =
-                bot_.getApi().getFile(message->sticker->fileId);
-            files.push_back(bot_.getApi().downloadFile(file->filePath));
+            files.emplace_back(message->sticker->fileId,
+                               message->sticker->fileUniqueId);
         }
 
         if (files.empty()) {
+            /*
+             * Only in chats that asked for it. Commands that weren't handled
+             * above aren't printed. Text is queued like a sticker, so the
+             * same cap and rate limit apply.
+             */
+            if (text_renderer_ && !message->text.empty() &&
+                    !StringTools::startsWith(message->text, "/") &&
+                    TextEnabled(message->chat->id)) {
+                QueueTextJob(message->chat->id, message->text);
+            }
             return;
         }
 
-        DB_PRINT("Downloaded %zu files\n", files.size());
-        for (size_t i = 0; i < files.size(); i++) {
-            /* std::format isn't supported until gcc 13, so do this. */
-            char buf[64];
-            {
-                std::lock_guard<std::mutex> lock(mu_file_num_);
-                snprintf(buf, sizeof(buf), "file-%zu", file_num_);
-                file_num_++;
-            }
-            std::string file_name = buf;
-            if (IsFileWebm(files[i])) {
-                file_name.append(".webm");
+        PrintOptions options = ChatPrintOptions(message->chat->id);
+        std::vector<PrintJob> jobs;
+        for (const auto &[file_id, file_unique_id] : files) {
+            jobs.push_back(PrintJob{
+                .id = 0,
+                .chat_id = message->chat->id,
+                .file_id = file_id,
+                .file_unique_id = file_unique_id,
+                .options = options,
+            });
+        }
+        if (PreviewEnabled(message->chat->id)) {
+            for (const PrintJob &job : jobs) {
+                QueuePreview(job);
             }
+            return;
+        }
+        DB_PRINT("Queueing %zu jobs\n", jobs.size());
+        QueueJobs(std::move(jobs));
+    });
+    bot_.getEvents().onCallbackQuery([this](TgBot::CallbackQuery::Ptr query) {
+        HandleCallbackQuery(query);
+    });
+}
 
-            file_paths.push_back(file_name);
+void Bot::RunLongPoll()
+{
+    /* Telegram refuses getUpdates while a webhook is set. */
+    bot_.getApi().deleteWebhook();
 
-            Status status = WriteFile(file_name, files[i]);
-            if (!status.Ok()) {
-                std::string user_message = files.size() > 1 ?
-                    "I couldn't save the images to print them!" :
-                    "I couldn't save the image to print it!";
-                bot_.getApi().sendMessage(message->chat->id, user_message);
-                return;
-            }
-        }
+    TgBot::TgLongPoll longPoll(bot_, /*limit=*/100, kLongPollTimeoutSecs);
+    while (true) {
+        printf("Long poll started\n");
+        longPoll.start();
+    }
+}
 
+/*
+ * Each update is handled as soon as Telegram pushes it, rather than when the
+ * next poll comes back.
+ */
+void Bot::RunWebhook()
+{
+    std::string path = "/" + options_.webhook_secret;
+    bot_.getApi().setWebhook(options_.webhook_url + path);
 
-        /*
-         * Make the printing async, because the next message won't be processed
-         * until this function returns.
-         */
-        std::thread t(&Bot::PrintStickersAsync, this, file_paths, message);
-        t.detach();
-    });
+    TgBot::TgWebhookTcpServer server(options_.webhook_port, path,
+                                     bot_.getEventHandler());
+    printf("Webhook server started on port %u\n", options_.webhook_port);
+    server.start();
 }
 
 Status Bot::RunBot()
 {
+    if (!options_.webhook_url.empty() && options_.webhook_secret.empty()) {
+        return Status(StatusCode::kInvalidArgument,
+                      "A webhook needs a secret");
+    }
+
     try {
         printf("Bot username: %s\n", bot_.getApi().getMe()->username.c_str());
-        TgBot::TgLongPoll longPoll(bot_);
-        while (true) {
-            printf("Long poll started\n");
-            longPoll.start();
+        ReplayJournal();
+        if (options_.webhook_url.empty()) {
+            RunLongPoll();
+        } else {
+            RunWebhook();
         }
     } catch (TgBot::TgException& e) {
         return Status(StatusCode::kInternalError, e.what());
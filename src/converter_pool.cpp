@@ -0,0 +1,272 @@
+#include "converter_pool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "convert_worker.h"
+#include "status.h"
+#include "utils.h"
+
+extern char **environ;
+
+namespace sticker_bot {
+
+SharedImage::~SharedImage()
+{
+    if (data_ != NULL) {
+        munmap(const_cast<uint8_t *>(data_), size_);
+    }
+}
+
+ConverterPool::ConverterPool(std::string worker_path, uint32_t num_workers) :
+        worker_path_(std::move(worker_path)),
+        workers_(num_workers, Worker{.pid = -1, .fd = -1})
+{
+    for (size_t i = 0; i < workers_.size(); i++) {
+        idle_.push_back(i);
+    }
+}
+
+std::expected<std::unique_ptr<ConverterPool>, Status>
+    ConverterPool::Create(const std::string &worker_path, uint32_t num_workers)
+{
+    if (num_workers == 0) {
+        num_workers = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    std::unique_ptr<ConverterPool> pool(new ConverterPool(worker_path,
+                                                          num_workers));
+    for (auto &worker : pool->workers_) {
+        Status status = pool->Spawn(worker);
+        if (!status.Ok()) {
+            return std::unexpected(status);
+        }
+    }
+    return pool;
+}
+
+ConverterPool::~ConverterPool()
+{
+    for (auto &worker : workers_) {
+        Stop(worker, /*wait_for_exit=*/true);
+    }
+}
+
+Status ConverterPool::Spawn(Worker &worker)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+        return Status(StatusCode::kInternalError,
+                      "Failed to create converter socket");
+    }
+
+    /*
+     * dup2() clears close-on-exec, so only the worker's end makes it across.
+     * sv[1] is never already kConvertWorkerFd, since sv[0] got a lower fd.
+     */
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], kConvertWorkerFd);
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 34)
+    /* Plenty of the bot's fds (the printer, sockets) aren't close-on-exec. */
+    posix_spawn_file_actions_addclosefrom_np(&actions, kConvertWorkerFd + 1);
+#endif
+
+    /*
+     * Its own process group, which the converts it starts are in too, so
+     * killing the group takes a hung convert down with it.
+     */
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    const char *argv[] = {worker_path_.c_str(), NULL};
+    pid_t pid;
+    int ret = posix_spawn(&pid, worker_path_.c_str(), &actions, &attr,
+                          const_cast<char **>(argv), environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+    if (ret) {
+        close(sv[0]);
+        Status status(StatusCode::kInternalError, strerror(ret));
+        status.prepend_message("Failed to start " + worker_path_ + ": ");
+        return status;
+    }
+
+    DB_PRINT("Started converter worker %d\n", pid);
+    worker.pid = pid;
+    worker.fd = sv[0];
+    return Status(StatusCode::kStatusOk);
+}
+
+void ConverterPool::Stop(Worker &worker, bool wait_for_exit)
+{
+    if (worker.fd >= 0) {
+        /* A healthy worker exits when it sees the socket close. */
+        close(worker.fd);
+        worker.fd = -1;
+    }
+    if (worker.pid <= 0) {
+        return;
+    }
+
+    if (wait_for_exit) {
+        auto deadline = std::chrono::steady_clock::now() + kExitGrace;
+        while (std::chrono::steady_clock::now() < deadline) {
+            if (waitpid(worker.pid, NULL, WNOHANG) == worker.pid) {
+                worker.pid = -1;
+                return;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+
+    /* The whole group, so any convert it started goes too. */
+    kill(-worker.pid, SIGKILL);
+    waitpid(worker.pid, NULL, 0);
+    worker.pid = -1;
+}
+
+void ConverterPool::Restart(Worker &worker)
+{
+    /* It's hung or misbehaving, there's no point waiting for it. */
+    Stop(worker, /*wait_for_exit=*/false);
+    restarts_++;
+
+    Status status = Spawn(worker);
+    if (!status.Ok()) {
+        /* It's tried again the next time this worker is picked. */
+        status.print_status();
+    }
+}
+
+size_t ConverterPool::Acquire()
+{
+    std::unique_lock<std::mutex> lock(mu_);
+    cv_.wait(lock, [&]() { return !idle_.empty(); });
+    size_t index = idle_.back();
+    idle_.pop_back();
+    return index;
+}
+
+void ConverterPool::Release(size_t index)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        idle_.push_back(index);
+    }
+    cv_.notify_one();
+}
+
+std::expected<SharedImage, Status> ConverterPool::Convert(
+        const std::string &path)
+{
+    if (path.empty() || path.size() > kMaxConvertPathLen) {
+        return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                      "Bad path to convert"));
+    }
+
+    size_t index = Acquire();
+    auto image = ConvertWith(workers_[index], path);
+    Release(index);
+    return image;
+}
+
+std::expected<SharedImage, Status> ConverterPool::ConvertWith(
+        Worker &worker, const std::string &path)
+{
+    if (worker.fd < 0) {
+        Status status = Spawn(worker);
+        if (!status.Ok()) {
+            return std::unexpected(status);
+        }
+    }
+
+    if (send(worker.fd, path.data(), path.size(), MSG_NOSIGNAL) < 0) {
+        Restart(worker);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Converter worker went away"));
+    }
+
+    struct pollfd pfd = {.fd = worker.fd, .events = POLLIN, .revents = 0};
+    int ret;
+    do {
+        ret = poll(&pfd, 1, kConvertTimeout.count());
+    } while (ret < 0 && errno == EINTR);
+    if (ret == 0) {
+        Restart(worker);
+        return std::unexpected(Status(StatusCode::kTimeout,
+                                      "Converting the image timed out"));
+    }
+
+    ConvertReply reply;
+    struct iovec iov = {.iov_base = &reply, .iov_len = sizeof(reply)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    ssize_t len = recvmsg(worker.fd, &msg, MSG_CMSG_CLOEXEC);
+    int fd = -1;
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (len > 0 && cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+        memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    }
+    if (len != sizeof(reply)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        /* 0 means it died, probably while convert was running. */
+        Restart(worker);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Converter worker crashed"));
+    }
+
+    if (reply.status != static_cast<int32_t>(StatusCode::kStatusOk) ||
+            fd < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        char buf[64];
+        snprintf(buf, sizeof(buf), "convert failed, exit status %d",
+                 reply.exit_code);
+        /* Copied, it's not a literal. */
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      std::string_view(buf)));
+    }
+
+    void *data = mmap(NULL, reply.size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to map the converted image"));
+    }
+    return SharedImage(static_cast<const uint8_t *>(data), reply.size);
+}
+
+};
@@ -0,0 +1,379 @@
+#include "dither.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+/* One neighbour the error is pushed to, relative to the current dot. */
+typedef struct DiffusionTap {
+    int8_t dx;
+    uint8_t dy;
+    uint8_t weight;
+} DiffusionTap;
+
+template <size_t kNumTaps>
+struct DiffusionKernel {
+    std::array<DiffusionTap, kNumTaps> taps;
+    int32_t divisor;
+
+    constexpr int32_t max_dx() const
+    {
+        int32_t max_dx = 0;
+        for (const auto &tap : taps) {
+            max_dx = std::max<int32_t>(max_dx, tap.dx < 0 ? -tap.dx : tap.dx);
+        }
+        return max_dx;
+    }
+
+    constexpr uint32_t max_dy() const
+    {
+        uint32_t max_dy = 0;
+        for (const auto &tap : taps) {
+            max_dy = std::max<uint32_t>(max_dy, tap.dy);
+        }
+        return max_dy;
+    }
+};
+
+/*
+ * The kernels, as {dx, dy, weight} taps and the divisor. Error only ever goes
+ * to dots that haven't been scanned yet.
+ */
+
+/*
+ * ... cur 1/8 1/8
+ * 1/8 1/8 1/8 ...
+ * ... 1/8 ... ...
+ * Only 3/4 of the error is pushed on, which keeps highlights clean.
+ */
+static constexpr DiffusionKernel<6> kAtkinsonKernel = {{{
+    {1, 0, 1}, {2, 0, 1},
+    {-1, 1, 1}, {0, 1, 1}, {1, 1, 1},
+    {0, 2, 1},
+}}, 8};
+
+/*
+ * .... curr 7/16
+ * 3/16 5/16 1/16
+ */
+static constexpr DiffusionKernel<4> kFloydSteinbergKernel = {{{
+    {1, 0, 7},
+    {-1, 1, 3}, {0, 1, 5}, {1, 1, 1},
+}}, 16};
+
+static constexpr DiffusionKernel<12> kJarvisJudiceNinkeKernel = {{{
+    {1, 0, 7}, {2, 0, 5},
+    {-2, 1, 3}, {-1, 1, 5}, {0, 1, 7}, {1, 1, 5}, {2, 1, 3},
+    {-2, 2, 1}, {-1, 2, 3}, {0, 2, 5}, {1, 2, 3}, {2, 2, 1},
+}}, 48};
+
+static constexpr DiffusionKernel<12> kStuckiKernel = {{{
+    {1, 0, 8}, {2, 0, 4},
+    {-2, 1, 2}, {-1, 1, 4}, {0, 1, 8}, {1, 1, 4}, {2, 1, 2},
+    {-2, 2, 1}, {-1, 2, 2}, {0, 2, 4}, {1, 2, 2}, {2, 2, 1},
+}}, 42};
+
+static constexpr DiffusionKernel<7> kBurkesKernel = {{{
+    {1, 0, 8}, {2, 0, 4},
+    {-2, 1, 2}, {-1, 1, 4}, {0, 1, 8}, {1, 1, 4}, {2, 1, 2},
+}}, 32};
+
+static constexpr DiffusionKernel<10> kSierraKernel = {{{
+    {1, 0, 5}, {2, 0, 3},
+    {-2, 1, 2}, {-1, 1, 4}, {0, 1, 5}, {1, 1, 4}, {2, 1, 2},
+    {-1, 2, 2}, {0, 2, 3}, {1, 2, 2},
+}}, 32};
+
+static constexpr DiffusionKernel<7> kSierraTwoRowKernel = {{{
+    {1, 0, 4}, {2, 0, 3},
+    {-2, 1, 1}, {-1, 1, 2}, {0, 1, 3}, {1, 1, 2}, {2, 1, 1},
+}}, 16};
+
+static constexpr DiffusionKernel<3> kSierraLiteKernel = {{{
+    {1, 0, 2},
+    {-1, 1, 1}, {0, 1, 1},
+}}, 4};
+
+static inline uint8_t add_and_cap(uint8_t val1, int32_t val2)
+{
+    constexpr int32_t kMax = 0xff;
+    constexpr int32_t kMin = 0x00;
+
+    return std::clamp(val1 + val2, kMin, kMax);
+}
+
+/*
+ * Pushes the error of the dot at x to one tap. Everything about the tap is a
+ * compile time constant, so for the power of two divisors this is a multiply
+ * by a small constant and a shift, and the range checks only exist in the
+ * edge versions.
+ */
+template <const auto &kKernel, int32_t kDir, bool kChecked, size_t kTap>
+static inline void PropagateTap(uint8_t *row, uint32_t x, uint32_t width,
+                                uint32_t rows_below, int32_t err)
+{
+    constexpr DiffusionTap kT = kKernel.taps[kTap];
+    constexpr int32_t kDx = kT.dx * kDir;
+
+    if constexpr (kChecked) {
+        int64_t nx = static_cast<int64_t>(x) + kDx;
+        if (kT.dy > rows_below || nx < 0 || nx >= width) {
+            return;
+        }
+    }
+
+    uint8_t *p = &row[static_cast<size_t>(kT.dy) * width + x + kDx];
+    *p = add_and_cap(*p, err * kT.weight / kKernel.divisor);
+}
+
+template <const auto &kKernel, int32_t kDir, bool kChecked, size_t... kTaps>
+static inline void DiffusePixel(uint8_t *row, uint32_t x, uint32_t width,
+                                uint32_t rows_below,
+                                std::index_sequence<kTaps...>)
+{
+    constexpr uint8_t kThreshold = 0x80;
+
+    int32_t old_pixel = row[x];
+    uint8_t new_pixel = old_pixel > kThreshold ? 0xff : 0x00;
+    int32_t err = old_pixel - new_pixel;
+    /* The row is done with this dot, so keep the result there for packing. */
+    row[x] = new_pixel;
+
+    /* Flat black or white areas, which is most of a sticker. */
+    if (err == 0) {
+        return;
+    }
+    (PropagateTap<kKernel, kDir, kChecked, kTaps>(row, x, width, rows_below,
+                                                  err), ...);
+}
+
+template <const auto &kKernel, int32_t kDir>
+static void DiffuseRow(uint8_t *row, uint32_t width, uint32_t rows_below)
+{
+    constexpr auto kTaps = std::make_index_sequence<kKernel.taps.size()>{};
+    constexpr uint32_t kEdge = kKernel.max_dx();
+
+    /* The last rows have error taps hanging off the bottom of the image. */
+    if (rows_below < kKernel.max_dy() || width <= 2 * kEdge) {
+        for (uint32_t i = 0; i < width; i++) {
+            uint32_t x = kDir > 0 ? i : width - 1 - i;
+            DiffusePixel<kKernel, kDir, true>(row, x, width, rows_below,
+                                              kTaps);
+        }
+        return;
+    }
+
+    uint32_t i = 0;
+    for (; i < kEdge; i++) {
+        uint32_t x = kDir > 0 ? i : width - 1 - i;
+        DiffusePixel<kKernel, kDir, true>(row, x, width, rows_below, kTaps);
+    }
+    for (; i < width - kEdge; i++) {
+        uint32_t x = kDir > 0 ? i : width - 1 - i;
+        DiffusePixel<kKernel, kDir, false>(row, x, width, rows_below, kTaps);
+    }
+    for (; i < width; i++) {
+        uint32_t x = kDir > 0 ? i : width - 1 - i;
+        DiffusePixel<kKernel, kDir, true>(row, x, width, rows_below, kTaps);
+    }
+}
+
+/*
+ * Packs a dithered row, 8 dots per byte. Note that if the color is 0, that
+ * means it's a black dot, which means that we would set the bit in the
+ * raster data. However, we previously inverted the image, so a value of 0xff
+ * means we set the bit in the raster data.
+ */
+static void PackRow(const uint8_t *row, uint32_t width, uint8_t *raster)
+{
+    for (uint32_t x = 0; x + 8 <= width; x += 8) {
+        uint8_t byte = 0;
+        for (uint32_t bit = 0; bit < 8; bit++) {
+            byte |= (row[x + bit] & 0x80) >> bit;
+        }
+
+        /*
+         * If an 8-bit bitmap happens to be a newline character, the printer
+         * FW will do a newline rather than print out each pixel in the
+         * bitmap.
+         * To work around this HIGH QUALITY firmware, convert the bitmap
+         * from 0b00001010 to 0b00010100, since it's close enough to what we
+         * wanted.
+         */
+        if (byte == 0x0a) {
+            byte = 0x14;
+        }
+        raster[x / 8] = byte;
+    }
+}
+
+template <const auto &kKernel, ScanOrder kOrder>
+static std::vector<uint8_t> ErrorDiffuse(std::span<uint8_t> gray,
+                                         uint32_t width)
+{
+    const uint32_t height = gray.size() / width;
+    /* Each byte in the raster is 8 pixels (dots). */
+    std::vector<uint8_t> raster(static_cast<size_t>(width) * height / 8, 0);
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = &gray[static_cast<size_t>(y) * width];
+        uint32_t rows_below = height - 1 - y;
+
+        if (kOrder == ScanOrder::kSerpentine && (y & 1)) {
+            DiffuseRow<kKernel, -1>(row, width, rows_below);
+        } else {
+            DiffuseRow<kKernel, 1>(row, width, rows_below);
+        }
+        PackRow(row, width, &raster[static_cast<size_t>(y) * width / 8]);
+    }
+
+    return raster;
+}
+
+/* Bayer's 8x8 matrix. Each value is scaled up to a threshold in 0..255. */
+static constexpr uint8_t kBayer8x8[8][8] = {
+    { 0, 32,  8, 40,  2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44,  4, 36, 14, 46,  6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    { 3, 35, 11, 43,  1, 33,  9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47,  7, 39, 13, 45,  5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+/*
+ * Compares each dot against a threshold that only depends on its position,
+ * a tile of the Bayer matrix when kOrdered, and 0x80 everywhere otherwise.
+ * Nothing carries between dots, so the scan order doesn't matter and the
+ * compiler is free to vectorize the row.
+ */
+template <bool kOrdered>
+static std::vector<uint8_t> ThresholdDither(std::span<uint8_t> gray,
+                                            uint32_t width)
+{
+    const uint32_t height = gray.size() / width;
+    std::vector<uint8_t> raster(static_cast<size_t>(width) * height / 8, 0);
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = &gray[static_cast<size_t>(y) * width];
+        uint8_t thresholds[8];
+        for (uint32_t i = 0; i < 8; i++) {
+            thresholds[i] = kOrdered ? kBayer8x8[y & 7][i] * 4 + 2 : 0x80;
+        }
+
+        for (uint32_t x = 0; x < width; x++) {
+            row[x] = row[x] > thresholds[x & 7] ? 0xff : 0x00;
+        }
+        PackRow(row, width, &raster[static_cast<size_t>(y) * width / 8]);
+    }
+
+    return raster;
+}
+
+typedef std::vector<uint8_t> (*DitherFn)(std::span<uint8_t> gray,
+                                         uint32_t width);
+
+typedef struct DitherEntry {
+    DitherAlgorithm algorithm;
+    std::string_view name;
+    DitherFn raster;
+    DitherFn serpentine;
+} DitherEntry;
+
+#define DITHER_ENTRY(algorithm, name, kernel)                        \
+    {algorithm, name, &ErrorDiffuse<kernel, ScanOrder::kRaster>,     \
+     &ErrorDiffuse<kernel, ScanOrder::kSerpentine>}
+
+/* Adding an algorithm is a kernel above plus a line here. */
+static constexpr DitherEntry kDitherTable[] = {
+    DITHER_ENTRY(DitherAlgorithm::kAtkinson, "atkinson", kAtkinsonKernel),
+    DITHER_ENTRY(DitherAlgorithm::kFloydSteinberg, "floyd-steinberg",
+                 kFloydSteinbergKernel),
+    DITHER_ENTRY(DitherAlgorithm::kJarvisJudiceNinke, "jarvis",
+                 kJarvisJudiceNinkeKernel),
+    DITHER_ENTRY(DitherAlgorithm::kStucki, "stucki", kStuckiKernel),
+    DITHER_ENTRY(DitherAlgorithm::kBurkes, "burkes", kBurkesKernel),
+    DITHER_ENTRY(DitherAlgorithm::kSierra, "sierra", kSierraKernel),
+    DITHER_ENTRY(DitherAlgorithm::kSierraTwoRow, "sierra-2",
+                 kSierraTwoRowKernel),
+    DITHER_ENTRY(DitherAlgorithm::kSierraLite, "sierra-lite",
+                 kSierraLiteKernel),
+    {DitherAlgorithm::kOrdered, "ordered", &ThresholdDither<true>,
+     &ThresholdDither<true>},
+    {DitherAlgorithm::kThreshold, "threshold", &ThresholdDither<false>,
+     &ThresholdDither<false>},
+};
+
+#undef DITHER_ENTRY
+
+static const DitherEntry &FindEntry(DitherAlgorithm algorithm)
+{
+    for (const auto &entry : kDitherTable) {
+        if (entry.algorithm == algorithm) {
+            return entry;
+        }
+    }
+    /* Unknown values (e.g. from an old journal) fall back to the default. */
+    return kDitherTable[0];
+}
+
+std::vector<uint8_t> RasterDither(std::span<uint8_t> gray, uint32_t width,
+                                  DitherAlgorithm algorithm, ScanOrder order)
+{
+    const DitherEntry &entry = FindEntry(algorithm);
+
+    if (order == ScanOrder::kSerpentine) {
+        return entry.serpentine(gray, width);
+    }
+    return entry.raster(gray, width);
+}
+
+std::expected<DitherAlgorithm, Status>
+    DitherAlgorithmFromName(std::string_view name)
+{
+    for (const auto &entry : kDitherTable) {
+        if (entry.name == name) {
+            return entry.algorithm;
+        }
+    }
+    return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                  "Unknown dither algorithm"));
+}
+
+std::string_view DitherAlgorithmName(DitherAlgorithm algorithm)
+{
+    return FindEntry(algorithm).name;
+}
+
+DitherAlgorithm NextDitherAlgorithm(DitherAlgorithm algorithm)
+{
+    const DitherEntry *entry = &FindEntry(algorithm);
+    size_t next = (entry - kDitherTable + 1) % ARRAY_SIZE(kDitherTable);
+    return kDitherTable[next].algorithm;
+}
+
+std::string DitherAlgorithmNames()
+{
+    std::string names;
+    for (size_t i = 0; i < ARRAY_SIZE(kDitherTable); i++) {
+        if (i) {
+            names += ", ";
+        }
+        names += kDitherTable[i].name;
+    }
+    return names;
+}
+
+};
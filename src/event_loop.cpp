@@ -0,0 +1,290 @@
+#include "event_loop.h"
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "coroutine.h"
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+std::expected<std::unique_ptr<EventLoop>, Status> EventLoop::Create()
+{
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to create epoll instance"));
+    }
+
+    int wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (wake_fd < 0) {
+        close(epoll_fd);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to create eventfd"));
+    }
+
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = wake_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event)) {
+        close(wake_fd);
+        close(epoll_fd);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to watch eventfd"));
+    }
+
+    return std::make_unique<EventLoop>(epoll_fd, wake_fd);
+}
+
+EventLoop::EventLoop(int epoll_fd, int wake_fd) :
+        epoll_fd_(epoll_fd),
+        wake_fd_(wake_fd),
+        stop_(false),
+        closed_(false),
+        stopping_(false)
+{
+    thread_ = std::thread(&EventLoop::WorkLoop, this);
+}
+
+EventLoop::~EventLoop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0) {
+        printf("Failed to wake event loop, errno %d\n", errno);
+    }
+    thread_.join();
+
+    close(wake_fd_);
+    close(epoll_fd_);
+}
+
+Status EventLoop::Post(std::function<void()> fn)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (closed_) {
+            return Status(StatusCode::kInternalError, "Event loop stopped");
+        }
+        posted_.push_back(std::move(fn));
+    }
+    uint64_t one = 1;
+    if (write(wake_fd_, &one, sizeof(one)) < 0) {
+        printf("Failed to wake event loop, errno %d\n", errno);
+    }
+    return Status(StatusCode::kStatusOk);
+}
+
+static DetachedTask Drive(Task<Status> task,
+                          std::shared_ptr<std::promise<Status>> promise)
+{
+    promise->set_value(co_await task);
+}
+
+std::future<Status> EventLoop::Run(Task<Status> task)
+{
+    auto promise = std::make_shared<std::promise<Status>>();
+    std::future<Status> result = promise->get_future();
+
+    /* std::function has to be copyable, which Task isn't. */
+    auto shared_task = std::make_shared<Task<Status>>(std::move(task));
+    Status status = Post([shared_task, promise]() {
+        Drive(std::move(*shared_task), promise);
+    });
+    if (!status.Ok()) {
+        promise->set_value(status);
+    }
+    return result;
+}
+
+bool EventLoop::FdAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    return loop_->Arm(fd_, events_, Waiter{handle, deadline_, &result_});
+}
+
+bool EventLoop::Arm(int fd, uint32_t events, Waiter waiter)
+{
+    if (stopping_) {
+        *waiter.result = Status(StatusCode::kInternalError,
+                                "Event loop stopped");
+        return false;
+    }
+    if (waiters_.contains(fd)) {
+        *waiter.result = Status(StatusCode::kInternalError,
+                                "Already waiting on fd");
+        return false;
+    }
+
+    struct epoll_event event = {};
+    event.events = events | EPOLLONESHOT;
+    event.data.fd = fd;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event)) {
+        /* Regular files can't be polled, but they're always ready. */
+        if (errno == EPERM) {
+            return false;
+        }
+        *waiter.result = Status(StatusCode::kInternalError,
+                                "Failed to watch fd");
+        return false;
+    }
+
+    waiters_[fd] = waiter;
+    return true;
+}
+
+void EventLoop::Resume(int fd, Status result)
+{
+    auto it = waiters_.find(fd);
+    if (it == waiters_.end()) {
+        return;
+    }
+    Waiter waiter = it->second;
+    waiters_.erase(it);
+
+    epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, NULL);
+    *waiter.result = result;
+    waiter.handle.resume();
+}
+
+void EventLoop::RunPosted()
+{
+    std::deque<std::function<void()>> posted;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        posted.swap(posted_);
+    }
+    for (auto &fn : posted) {
+        fn();
+    }
+}
+
+int EventLoop::NextTimeoutMs()
+{
+    if (waiters_.empty()) {
+        return -1;
+    }
+
+    Clock::time_point deadline = Clock::time_point::max();
+    for (const auto &[fd, waiter] : waiters_) {
+        deadline = std::min(deadline, waiter.deadline);
+    }
+    auto ms = std::chrono::ceil<std::chrono::milliseconds>(deadline -
+                                                           Clock::now());
+    return std::max<int64_t>(ms.count(), 0);
+}
+
+void EventLoop::WorkLoop()
+{
+    struct epoll_event events[kMaxEvents];
+
+    while (true) {
+        RunPosted();
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (stop_) {
+                break;
+            }
+        }
+
+        int num_events = epoll_wait(epoll_fd_, events, kMaxEvents,
+                                    NextTimeoutMs());
+        if (num_events < 0 && errno != EINTR) {
+            printf("epoll_wait failed, errno %d\n", errno);
+        }
+
+        for (int i = 0; i < num_events; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd_) {
+                uint64_t count;
+                if (read(wake_fd_, &count, sizeof(count)) < 0) {
+                    DB_PRINT("eventfd read failed, errno %d\n", errno);
+                }
+                continue;
+            }
+            /* Errors and hangups too, the read or write will report them. */
+            Resume(fd, Status(StatusCode::kStatusOk));
+        }
+
+        Clock::time_point now = Clock::now();
+        std::vector<int> expired;
+        for (const auto &[fd, waiter] : waiters_) {
+            if (waiter.deadline <= now) {
+                expired.push_back(fd);
+            }
+        }
+        for (int fd : expired) {
+            Resume(fd, Status(StatusCode::kTimeout, "Timed out waiting on fd"));
+        }
+    }
+
+    /*
+     * Let whatever is still waiting fail and finish. Finishing can post more,
+     * such as handing an AsyncMutex on, so keep going until nothing's left.
+     * From here on any wait fails straight away, so this ends.
+     */
+    stopping_ = true;
+    while (true) {
+        while (!waiters_.empty()) {
+            Resume(waiters_.begin()->first,
+                   Status(StatusCode::kInternalError, "Event loop stopped"));
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (posted_.empty()) {
+                closed_ = true;
+                break;
+            }
+        }
+        RunPosted();
+    }
+}
+
+bool AsyncMutex::LockAwaiter::await_ready()
+{
+    if (mutex_->locked_) {
+        return false;
+    }
+    mutex_->locked_ = true;
+    return true;
+}
+
+void AsyncMutex::LockAwaiter::await_suspend(std::coroutine_handle<> handle)
+{
+    mutex_->waiters_.push_back(handle);
+}
+
+void AsyncMutex::Unlock()
+{
+    if (waiters_.empty()) {
+        locked_ = false;
+        return;
+    }
+
+    /*
+     * Still locked, it's handed straight to the next waiter. That runs from
+     * the loop rather than inside this coroutine's Unlock().
+     */
+    std::coroutine_handle<> next = waiters_.front();
+    waiters_.pop_front();
+    /* Can't fail, the loop runs everything posted before it closes. */
+    loop_->Post([next]() { next.resume(); });
+}
+
+};
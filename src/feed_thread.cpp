@@ -0,0 +1,241 @@
+#include "feed_thread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <vector>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+static Status SetPriority(int priority)
+{
+    sched_param param = {};
+    param.sched_priority = priority;
+    int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (ret != 0) {
+        return Status(StatusCode::kInternalError,
+                      std::string("Failed to make the feed thread SCHED_FIFO: ")
+                      + strerror(ret));
+    }
+    return Status(StatusCode::kStatusOk);
+}
+
+static Status SetCpu(int cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret != 0) {
+        return Status(StatusCode::kInternalError,
+                      std::string("Failed to pin the feed thread: ") +
+                      strerror(ret));
+    }
+    return Status(StatusCode::kStatusOk);
+}
+
+/* Each print would fail the same way, once is enough. */
+static void LogOnce(std::atomic<bool> &logged, const Status &status)
+{
+    if (!logged.exchange(true)) {
+        status.print_status();
+    }
+}
+
+Status SetFeedThread(const FeedOptions &options)
+{
+    if (options.realtime_priority > 0) {
+        RETURN_IF_ERROR(SetPriority(options.realtime_priority));
+    }
+    if (options.cpu >= 0) {
+        RETURN_IF_ERROR(SetCpu(options.cpu));
+    }
+    return Status(StatusCode::kStatusOk);
+}
+
+FeedScope::FeedScope(const FeedOptions &options,
+                     std::span<const uint8_t> buffer) :
+        restore_scheduler_(false),
+        restore_affinity_(false)
+{
+    static std::atomic<bool> priority_logged(false);
+    static std::atomic<bool> cpu_logged(false);
+    static std::atomic<bool> lock_logged(false);
+
+    if (options.realtime_priority > 0 &&
+            pthread_getschedparam(pthread_self(), &policy_, &param_) == 0) {
+        Status status = SetPriority(options.realtime_priority);
+        restore_scheduler_ = status.Ok();
+        if (!status.Ok()) {
+            LogOnce(priority_logged, status);
+        }
+    }
+    if (options.cpu >= 0 && pthread_getaffinity_np(pthread_self(),
+                                                   sizeof(cpus_),
+                                                   &cpus_) == 0) {
+        Status status = SetCpu(options.cpu);
+        restore_affinity_ = status.Ok();
+        if (!status.Ok()) {
+            LogOnce(cpu_logged, status);
+        }
+    }
+    if (options.lock_memory && !buffer.empty()) {
+        if (mlock(buffer.data(), buffer.size()) == 0) {
+            locked_ = buffer;
+        } else {
+            LogOnce(lock_logged,
+                    Status(StatusCode::kInternalError,
+                           std::string("Failed to lock the image: ") +
+                           strerror(errno)));
+        }
+    }
+}
+
+FeedScope::~FeedScope()
+{
+    if (!locked_.empty()) {
+        munlock(locked_.data(), locked_.size());
+    }
+    if (restore_affinity_) {
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus_), &cpus_);
+    }
+    if (restore_scheduler_) {
+        pthread_setschedparam(pthread_self(), policy_, &param_);
+    }
+}
+
+FeedJitter::FeedJitter() :
+        feeding_(false),
+        feed_bytes_(0),
+        feeds_(0),
+        writes_(0),
+        rate_total_kib_s_(0),
+        rate_min_kib_s_(0),
+        next_gap_sample_(0),
+        gap_max_ms_(0),
+        stalls_(0)
+{
+    recent_gaps_ms_.reserve(kGapSamples);
+}
+
+void FeedJitter::StartFeed()
+{
+    feeding_ = true;
+    feed_start_ = Clock::now();
+    last_write_end_ = Clock::time_point();
+    feed_bytes_ = 0;
+}
+
+void FeedJitter::Wrote(Clock::time_point start, size_t bytes)
+{
+    if (!feeding_) {
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    Clock::time_point last_write_end = last_write_end_;
+    last_write_end_ = now;
+    feed_bytes_ += bytes;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    writes_++;
+    if (last_write_end == Clock::time_point()) {
+        return;
+    }
+
+    double gap_ms = std::chrono::duration<double, std::milli>(
+            start - last_write_end).count();
+    if (recent_gaps_ms_.size() < kGapSamples) {
+        recent_gaps_ms_.push_back(gap_ms);
+    } else {
+        recent_gaps_ms_[next_gap_sample_] = gap_ms;
+    }
+    next_gap_sample_ = (next_gap_sample_ + 1) % kGapSamples;
+    gap_max_ms_ = std::max(gap_max_ms_, gap_ms);
+    if (start - last_write_end > kStallGap) {
+        stalls_++;
+    }
+}
+
+void FeedJitter::Waited()
+{
+    if (feeding_ && last_write_end_ != Clock::time_point()) {
+        last_write_end_ = Clock::now();
+    }
+}
+
+void FeedJitter::EndFeed(bool completed)
+{
+    if (!feeding_) {
+        return;
+    }
+    feeding_ = false;
+    if (!completed) {
+        return;
+    }
+    double seconds = std::chrono::duration<double>(
+            Clock::now() - feed_start_).count();
+    if (feed_bytes_ == 0 || seconds <= 0) {
+        return;
+    }
+    double rate_kib_s = feed_bytes_ / 1024.0 / seconds;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    if (feeds_ == 0 || rate_kib_s < rate_min_kib_s_) {
+        rate_min_kib_s_ = rate_kib_s;
+    }
+    feeds_++;
+    rate_total_kib_s_ += rate_kib_s;
+}
+
+FeedStats FeedJitter::Stats()
+{
+    FeedStats stats = {};
+
+    std::lock_guard<std::mutex> lock(mu_);
+    stats.feeds = feeds_;
+    stats.writes = writes_;
+    stats.rate_mean_kib_s = feeds_ ? rate_total_kib_s_ / feeds_ : 0;
+    stats.rate_min_kib_s = rate_min_kib_s_;
+    stats.gap_max_ms = gap_max_ms_;
+    stats.stalls = stalls_;
+    if (recent_gaps_ms_.empty()) {
+        return stats;
+    }
+
+    std::vector<double> gaps = recent_gaps_ms_;
+    std::sort(gaps.begin(), gaps.end());
+    stats.gap_p50_ms = gaps[gaps.size() / 2];
+    stats.gap_p99_ms = gaps[gaps.size() * 99 / 100];
+    return stats;
+}
+
+std::string FeedJitter::StatsString()
+{
+    FeedStats stats = Stats();
+
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "Feed: %" PRIu64 " images in %" PRIu64 " writes, mean %.1f "
+             "KiB/s, min %.1f KiB/s\n"
+             "Feed gaps: p50 %.2f ms, p99 %.2f ms, max %.1f ms, %" PRIu64
+             " stalls",
+             stats.feeds, stats.writes, stats.rate_mean_kib_s,
+             stats.rate_min_kib_s, stats.gap_p50_ms, stats.gap_p99_ms,
+             stats.gap_max_ms, stats.stalls);
+    return buf;
+}
+
+};
@@ -0,0 +1,172 @@
+#if defined(HAVE_LIBCURL)
+#include "http_client.h"
+
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <curl/curl.h>
+
+#include "tgbot/tgbot.h"
+
+namespace sticker_bot {
+
+/* Connections each handle keeps, there's only ever one or two hosts. */
+static constexpr long kMaxConnections = 4;
+static constexpr long kConnectTimeoutSecs = 10;
+/*
+ * A long poll is silent until there's an update, so silence is only a dead
+ * connection once it's gone on past the poll's timeout.
+ */
+static constexpr long kLowSpeedBytesPerSec = 1;
+static constexpr long kLowSpeedSecs = kLongPollTimeoutSecs + 10;
+/*
+ * Only for getUpdates, which should be back soon after the poll's timeout.
+ * Downloads and uploads can take as long as they like while they're moving.
+ */
+static constexpr long kLongPollRequestSecs = kLongPollTimeoutSecs + 20;
+
+static size_t AppendToString(char *data, size_t size, size_t nmemb,
+                             void *userptr)
+{
+    static_cast<std::string *>(userptr)->append(data, size * nmemb);
+    return size * nmemb;
+}
+
+KeepAliveHttpClient::KeepAliveHttpClient()
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+
+    share_ = curl_share_init();
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &KeepAliveHttpClient::Lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC,
+                      &KeepAliveHttpClient::Unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+KeepAliveHttpClient::~KeepAliveHttpClient()
+{
+    for (CURL *handle : idle_handles_) {
+        curl_easy_cleanup(handle);
+    }
+    curl_share_cleanup(share_);
+}
+
+CURL *KeepAliveHttpClient::TakeHandle() const
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_handles_);
+        if (!idle_handles_.empty()) {
+            CURL *handle = idle_handles_.back();
+            idle_handles_.pop_back();
+            /* Connections and caches survive a reset, options don't. */
+            curl_easy_reset(handle);
+            return handle;
+        }
+    }
+    return curl_easy_init();
+}
+
+void KeepAliveHttpClient::ReturnHandle(CURL *handle) const
+{
+    std::lock_guard<std::mutex> lock(mu_handles_);
+    idle_handles_.push_back(handle);
+}
+
+std::string KeepAliveHttpClient::makeRequest(
+        const TgBot::Url &url, const std::vector<TgBot::HttpReqArg> &args)
+        const
+{
+    CURL *handle = TakeHandle();
+    if (handle == NULL) {
+        throw std::runtime_error("curl error: failed to create a handle");
+    }
+
+    std::string full_url = url.protocol + "://" + url.host + url.path;
+    if (!url.query.empty()) {
+        full_url += "?" + url.query;
+    }
+    std::string response;
+    curl_easy_setopt(handle, CURLOPT_URL, full_url.c_str());
+    curl_easy_setopt(handle, CURLOPT_SHARE, share_);
+    curl_easy_setopt(handle, CURLOPT_MAXCONNECTS, kMaxConnections);
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, kConnectTimeoutSecs);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, kLowSpeedBytesPerSec);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, kLowSpeedSecs);
+    if (url.path.ends_with("/getUpdates")) {
+        curl_easy_setopt(handle, CURLOPT_TIMEOUT, kLongPollRequestSecs);
+    }
+    curl_easy_setopt(handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+    /* Falls back to HTTP/1.1 if the server doesn't do HTTP/2. */
+    curl_easy_setopt(handle, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, &AppendToString);
+    curl_easy_setopt(handle, CURLOPT_WRITEDATA, &response);
+
+    /* Same encoding as tgbot-cpp: multipart with files, form otherwise. */
+    curl_mime *mime = NULL;
+    std::string form;
+    bool has_file = false;
+    for (const auto &arg : args) {
+        has_file |= arg.isFile;
+    }
+    if (has_file) {
+        mime = curl_mime_init(handle);
+        for (const auto &arg : args) {
+            curl_mimepart *part = curl_mime_addpart(mime);
+            curl_mime_name(part, arg.name.c_str());
+            curl_mime_data(part, arg.value.data(), arg.value.size());
+            if (arg.isFile) {
+                curl_mime_filename(part, arg.fileName.c_str());
+                curl_mime_type(part, arg.mimeType.c_str());
+            }
+        }
+        curl_easy_setopt(handle, CURLOPT_MIMEPOST, mime);
+    } else if (!args.empty()) {
+        for (const auto &arg : args) {
+            char *value = curl_easy_escape(handle, arg.value.data(),
+                                           arg.value.size());
+            if (!form.empty()) {
+                form += "&";
+            }
+            form += arg.name + "=" + value;
+            curl_free(value);
+        }
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDS, form.c_str());
+        curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, form.size());
+    }
+
+    CURLcode res = curl_easy_perform(handle);
+    curl_mime_free(mime);
+    /* Don't keep a pointer to the soon to be gone body around. */
+    curl_easy_setopt(handle, CURLOPT_POSTFIELDS, NULL);
+    ReturnHandle(handle);
+
+    if (res != CURLE_OK) {
+        throw std::runtime_error(std::string("curl error: ") +
+                                 curl_easy_strerror(res));
+    }
+    return response;
+}
+
+void KeepAliveHttpClient::Lock(CURL *handle, curl_lock_data data,
+                               curl_lock_access access, void *userptr)
+{
+    (void)handle;
+    (void)access;
+    static_cast<KeepAliveHttpClient *>(userptr)->mu_share_[data].lock();
+}
+
+void KeepAliveHttpClient::Unlock(CURL *handle, curl_lock_data data,
+                                 void *userptr)
+{
+    (void)handle;
+    static_cast<KeepAliveHttpClient *>(userptr)->mu_share_[data].unlock();
+}
+
+};
+#endif
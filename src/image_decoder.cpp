@@ -0,0 +1,383 @@
+#include "image_decoder.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <expected>
+#include <optional>
+#include <string>
+#include <vector>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <png.h>
+#if defined(HAVE_LIBWEBP)
+#include <webp/decode.h>
+#endif
+
+#include "resampler.h"
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+enum class ImageFormat {
+    kUnknown,
+    kJpeg,
+    kPng,
+    kWebp,
+};
+
+static ImageFormat DetectFormat(FILE *f)
+{
+    static constexpr uint8_t kJpegMagic[] = {0xff, 0xd8, 0xff};
+    static constexpr uint8_t kPngMagic[] = {0x89, 'P', 'N', 'G'};
+    uint8_t header[12];
+
+    size_t num_read = fread(header, 1, sizeof(header), f);
+    rewind(f);
+    if (num_read < sizeof(header)) {
+        return ImageFormat::kUnknown;
+    }
+
+    if (!memcmp(header, kJpegMagic, sizeof(kJpegMagic))) {
+        return ImageFormat::kJpeg;
+    }
+    if (!memcmp(header, kPngMagic, sizeof(kPngMagic))) {
+        return ImageFormat::kPng;
+    }
+    if (!memcmp(header, "RIFF", 4) && !memcmp(&header[8], "WEBP", 4)) {
+        return ImageFormat::kWebp;
+    }
+    return ImageFormat::kUnknown;
+}
+
+/*
+ * If it's larger in the X direction, it gets rotated so we can print at a
+ * higher resolution.
+ */
+static bool ShouldRotate(uint32_t width, uint32_t height)
+{
+    return width > height;
+}
+
+/* Row y of a whole scanline, if it's in crop. */
+static void PushCropped(Resampler &resampler, const uint8_t *pixels,
+                        uint8_t channels, uint32_t y, const CropRect &crop)
+{
+    if (y >= crop.y && y - crop.y < crop.height) {
+        resampler.PushScanline(pixels + static_cast<size_t>(crop.x) * channels,
+                               channels);
+    }
+}
+
+static std::expected<std::vector<uint8_t>, Status> Unsupported()
+{
+    return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                  "Image format not decoded in-process"));
+}
+
+typedef struct JpegErrorManager {
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+} JpegErrorManager;
+
+static void JpegErrorExit(j_common_ptr cinfo)
+{
+    JpegErrorManager *err = reinterpret_cast<JpegErrorManager *>(cinfo->err);
+    (*cinfo->err->output_message)(cinfo);
+    longjmp(err->jump, 1);
+}
+
+/*
+ * The largest DCT scaling (1/2, 1/4 or 1/8) that still leaves at least
+ * min_size pixels, so the resampler always shrinks.
+ */
+static uint32_t JpegScaleDenom(uint32_t size, uint32_t min_size)
+{
+    uint32_t denom = 1;
+    while (denom < 8 && (size + denom * 2 - 1) / (denom * 2) >= min_size) {
+        denom *= 2;
+    }
+    return denom;
+}
+
+/*
+ * libjpeg reports errors by longjmp()ing out, so every C++ object here is
+ * created before the setjmp() and nothing with a destructor is skipped.
+ */
+static std::expected<std::vector<uint8_t>, Status>
+    DecodeJpeg(FILE *f, uint32_t width, ResampleQuality quality,
+               const ImageRegion &region)
+{
+    struct jpeg_decompress_struct cinfo;
+    JpegErrorManager err;
+    std::optional<Resampler> resampler;
+    std::vector<uint8_t> pixels;
+    std::vector<uint8_t> out;
+
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = JpegErrorExit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to decode JPEG"));
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, f);
+    jpeg_read_header(&cinfo, TRUE);
+
+    /* libjpeg can't turn CMYK into gray, leave those to ImageMagick. */
+    if (cinfo.jpeg_color_space == JCS_CMYK ||
+            cinfo.jpeg_color_space == JCS_YCCK) {
+        jpeg_destroy_decompress(&cinfo);
+        return Unsupported();
+    }
+
+    /* For YCbCr this just takes Y, skipping the color conversion. */
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    if (quality == ResampleQuality::kFast) {
+        cinfo.dct_method = JDCT_IFAST;
+    }
+    bool rotate = ShouldRotate(cinfo.image_width, cinfo.image_height);
+    /* Only the region has to stay at least width dots across. */
+    CropRect full_crop = rotate ?
+        region.Rect(cinfo.image_height, cinfo.image_width) :
+        region.Rect(cinfo.image_width, cinfo.image_height);
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = JpegScaleDenom(full_crop.width, width);
+    jpeg_start_decompress(&cinfo);
+
+    const uint32_t w = cinfo.output_width;
+    const uint32_t h = cinfo.output_height;
+    DB_PRINT("Decoding %ux%u JPEG at 1/%u scale: %ux%u\n", cinfo.image_width,
+             cinfo.image_height, cinfo.scale_denom, w, h);
+
+    if (!rotate) {
+        /* Rows outside the region are still decoded, libjpeg needs them. */
+        CropRect crop = region.Rect(w, h);
+        resampler.emplace(crop.width, crop.height, width,
+                          Resampler::DefaultFilter(crop.width, width, quality));
+        pixels.resize(w);
+        while (cinfo.output_scanline < h) {
+            uint32_t y = cinfo.output_scanline;
+            JSAMPROW row = pixels.data();
+            jpeg_read_scanlines(&cinfo, &row, 1);
+            PushCropped(*resampler, pixels.data(), /*channels=*/1, y, crop);
+        }
+        out = resampler->TakeOutput();
+    } else {
+        pixels.resize(static_cast<size_t>(w) * h);
+        while (cinfo.output_scanline < h) {
+            JSAMPROW row = &pixels[static_cast<size_t>(cinfo.output_scanline) *
+                                   w];
+            jpeg_read_scanlines(&cinfo, &row, 1);
+        }
+        ImageView view = ImageView::FromBuffer(pixels.data(), w, h,
+                                               /*channels=*/1).Rotated90();
+        view = view.Cropped(region.Rect(view.width, view.height));
+        ResampleFilter filter = Resampler::DefaultFilter(view.width, width,
+                                                         quality);
+        out = Resampler::Resample(view, width, filter);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return out;
+}
+
+/* Same longjmp() rules as DecodeJpeg(). */
+static std::expected<std::vector<uint8_t>, Status>
+    DecodePng(FILE *f, uint32_t width, ResampleQuality quality,
+              const ImageRegion &region)
+{
+    std::optional<Resampler> resampler;
+    std::vector<uint8_t> pixels;
+    std::vector<png_bytep> rows;
+    std::vector<uint8_t> out;
+
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL,
+                                             NULL, NULL);
+    if (png == NULL) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to create PNG decoder"));
+    }
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        png_destroy_read_struct(&png, NULL, NULL);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to create PNG decoder"));
+    }
+
+    if (setjmp(png_jmpbuf(png))) {
+        png_destroy_read_struct(&png, &info, NULL);
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to decode PNG"));
+    }
+
+    png_init_io(png, f);
+    png_read_info(png, info);
+
+    /* Everything becomes 8-bit gray, gray + alpha, RGB or RGBA. */
+    png_set_expand(png);
+    png_set_strip_16(png);
+    int passes = png_set_interlace_handling(png);
+    png_read_update_info(png, info);
+
+    const uint32_t w = png_get_image_width(png, info);
+    const uint32_t h = png_get_image_height(png, info);
+    const uint8_t channels = png_get_channels(png, info);
+    const size_t row_bytes = png_get_rowbytes(png, info);
+
+    if (!ShouldRotate(w, h) && passes == 1) {
+        CropRect crop = region.Rect(w, h);
+        resampler.emplace(crop.width, crop.height, width,
+                          Resampler::DefaultFilter(crop.width, width, quality));
+        pixels.resize(row_bytes);
+        for (uint32_t y = 0; y < h; y++) {
+            png_read_row(png, pixels.data(), NULL);
+            PushCropped(*resampler, pixels.data(), channels, y, crop);
+        }
+        out = resampler->TakeOutput();
+    } else {
+        /* Interlaced rows aren't final until the last pass. */
+        pixels.resize(row_bytes * h);
+        rows.resize(h);
+        for (uint32_t y = 0; y < h; y++) {
+            rows[y] = &pixels[row_bytes * y];
+        }
+        png_read_image(png, rows.data());
+
+        ImageView view = ImageView::FromBuffer(pixels.data(), w, h, channels);
+        if (ShouldRotate(w, h)) {
+            view = view.Rotated90();
+        }
+        view = view.Cropped(region.Rect(view.width, view.height));
+        ResampleFilter filter = Resampler::DefaultFilter(view.width, width,
+                                                         quality);
+        out = Resampler::Resample(view, width, filter);
+    }
+
+    png_read_end(png, NULL);
+    png_destroy_read_struct(&png, &info, NULL);
+    return out;
+}
+
+#if defined(HAVE_LIBWEBP)
+static std::expected<std::vector<uint8_t>, Status>
+    DecodeWebp(FILE *f, uint32_t width, ResampleQuality quality,
+               const ImageRegion &region)
+{
+    /* Feed the decoder this much at a time, and resample what it finished. */
+    static constexpr size_t kChunkSize = 0x4000;
+
+    std::vector<uint8_t> data;
+    uint8_t buf[4096];
+    size_t num_read;
+    while ((num_read = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + num_read);
+    }
+
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(data.data(), data.size(), &features) !=
+            VP8_STATUS_OK || features.has_animation) {
+        return Unsupported();
+    }
+    const uint32_t w = features.width;
+    const uint32_t h = features.height;
+
+    if (ShouldRotate(w, h)) {
+        int decoded_width;
+        int decoded_height;
+        uint8_t *rgba = WebPDecodeRGBA(data.data(), data.size(),
+                                       &decoded_width, &decoded_height);
+        if (rgba == NULL) {
+            return std::unexpected(Status(StatusCode::kInternalError,
+                                          "Failed to decode WebP"));
+        }
+        ImageView view = ImageView::FromBuffer(rgba, w, h,
+                                               /*channels=*/4).Rotated90();
+        view = view.Cropped(region.Rect(view.width, view.height));
+        std::vector<uint8_t> out = Resampler::Resample(view, width,
+                Resampler::DefaultFilter(view.width, width, quality));
+        WebPFree(rgba);
+        return out;
+    }
+
+    /*
+     * The incremental decoder hands back rows as soon as they're done, so
+     * they go through the resampler while they're still in cache.
+     */
+    WebPIDecoder *idec = WebPINewRGB(MODE_RGBA, NULL, 0, 0);
+    if (idec == NULL) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to create WebP decoder"));
+    }
+
+    CropRect crop = region.Rect(w, h);
+    Resampler resampler(crop.width, crop.height, width,
+                        Resampler::DefaultFilter(crop.width, width, quality));
+    int rows_done = 0;
+    for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+        VP8StatusCode status = WebPIAppend(idec, &data[offset],
+                std::min(kChunkSize, data.size() - offset));
+        if (status != VP8_STATUS_OK && status != VP8_STATUS_SUSPENDED) {
+            WebPIDelete(idec);
+            return std::unexpected(Status(StatusCode::kInternalError,
+                                          "Failed to decode WebP"));
+        }
+
+        int last_y;
+        int stride;
+        const uint8_t *rgba = WebPIDecGetRGB(idec, &last_y, NULL, NULL,
+                                             &stride);
+        for (; rgba != NULL && rows_done < last_y; rows_done++) {
+            PushCropped(resampler,
+                        &rgba[static_cast<size_t>(rows_done) * stride],
+                        /*channels=*/4, rows_done, crop);
+        }
+    }
+    WebPIDelete(idec);
+
+    if (static_cast<uint32_t>(rows_done) != h) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "WebP image is truncated"));
+    }
+    return resampler.TakeOutput();
+}
+#endif
+
+std::expected<std::vector<uint8_t>, Status>
+    DecodeImage(const std::string &path, uint32_t width,
+                ResampleQuality quality, const ImageRegion &region)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f == NULL) {
+        return std::unexpected(Status(StatusCode::kNotFoundError,
+                                      "Failed to open file"));
+    }
+
+    std::expected<std::vector<uint8_t>, Status> out = Unsupported();
+    switch (DetectFormat(f)) {
+    case ImageFormat::kJpeg:
+        out = DecodeJpeg(f, width, quality, region);
+        break;
+    case ImageFormat::kPng:
+        out = DecodePng(f, width, quality, region);
+        break;
+#if defined(HAVE_LIBWEBP)
+    case ImageFormat::kWebp:
+        out = DecodeWebp(f, width, quality, region);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    fclose(f);
+    return out;
+}
+
+};
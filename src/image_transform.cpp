@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
@@ -14,24 +15,19 @@
 #include <string_view>
 #include <span>
 #include <memory>
-#include <sstream>
+#include <optional>
 
+#include "converter_pool.h"
+#include "dither.h"
+#include "image_decoder.h"
+#include "levels.h"
+#include "resampler.h"
 #include "status.h"
+#include "trim.h"
+#include "utils.h"
 
 namespace sticker_bot {
 
-static std::vector<std::string> SplitString(const std::string &str, char delim)
-{
-    std::stringstream ss(str);
-    std::string tmp;
-    std::vector<std::string> strings;
-
-    while (getline(ss, tmp, delim)) {
-        strings.push_back(tmp);
-    }
-    return strings;
-}
-
 static std::expected<std::string, Status> Execute(const std::string &cmd)
 {
     std::string result;
@@ -51,74 +47,199 @@ static std::expected<std::string, Status> Execute(const std::string &cmd)
     return result;
 }
 
-std::expected<std::string, Status>
-    ImageTransform::ProcessImage(const std::string &path)
+/*
+ * Parses a binary PPM (P6) header and returns a view of the pixel data that
+ * follows it.
+ */
+static std::expected<ImageView, Status> ParsePpm(std::span<const uint8_t> data)
 {
-    const std::string kIdentifyCmd = "identify";
-    const std::string kConvertCmd = "convert";
-    const std::string kOutputImageName = "image.rgb";
-    /* TODO: Normalize? */
-    const std::string kConvertArgs =
-        "-background white -flatten -resize 576x "
-        "-colorspace gray -negate " + kOutputImageName;
-    const std::string kRotateArgs = "-rotate 90";
-    static constexpr uint8_t kDimensionsOffset = 2;
+    static constexpr uint32_t kMaxVal = 255;
+    size_t pos = 0;
+
+    auto next_token = [&]() -> std::string {
+        std::string token;
+        while (pos < data.size()) {
+            if (data[pos] == '#') {
+                while (pos < data.size() && data[pos] != '\n') {
+                    pos++;
+                }
+            } else if (isspace(data[pos])) {
+                if (!token.empty()) {
+                    break;
+                }
+            } else {
+                token.push_back(data[pos]);
+            }
+            pos++;
+        }
+        return token;
+    };
 
-    /* Get info on the image. */
-    std::string cmd = kIdentifyCmd + " " + path;
-    auto output = Execute(cmd);
-    if (!output.has_value()) {
-        return std::unexpected(output.error());
+    if (next_token() != "P6") {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                "Decoded image is not a binary PPM"));
     }
+    uint32_t width = strtoul(next_token().c_str(), NULL, 10);
+    uint32_t height = strtoul(next_token().c_str(), NULL, 10);
+    uint32_t max_val = strtoul(next_token().c_str(), NULL, 10);
+    /* Exactly one whitespace character separates the header and the data. */
+    pos++;
 
-    /* Grab the dimensions */
-    std::vector<std::string> strings = SplitString(*output, ' ');
-    if (strings.size() <= kDimensionsOffset) {
+    if (width == 0 || height == 0 || max_val != kMaxVal) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                "Failed to parse decoded image header"));
+    }
+    if (pos > data.size() ||
+            data.size() - pos < static_cast<size_t>(width) * height * 3) {
         return std::unexpected(Status(StatusCode::kInternalError,
-                "Image information output does not contain dimensions"));
+                "Decoded image is truncated"));
     }
-    std::string dimension = strings[kDimensionsOffset];
 
+    return ImageView::FromBuffer(&data[pos], width, height, /*channels=*/3);
+}
+
+std::expected<std::vector<uint8_t>, Status>
+    ImageTransform::ProcessImage(const std::string &path, uint32_t width,
+                                 ConverterPool *converter,
+                                 ResampleQuality quality,
+                                 const TrimOptions &trim)
+{
     /*
-     * The format is ${X_PIXELS}x${Y_PIXELS} potentilly with '+...' appended
-     * to the end. STOI will stop at the non-int character.
+     * JPEG, PNG and WebP are decoded in-process straight into the resampler.
+     * Everything else (webm, gif, ...) goes through ImageMagick.
      */
-    std::vector<std::string> dimensions = SplitString(dimension, 'x');
-    if (dimensions.size() < 2) {
-        return std::unexpected(Status(StatusCode::kInternalError,
-                "Failed to correctly parse dimensions"));
+    auto gray = DecodeImage(path, width, quality);
+    bool in_process = gray.has_value();
+    if (!gray.has_value()) {
+        if (gray.error().status() != StatusCode::kInvalidArgument) {
+            gray.error().print_status();
+        }
+        gray = DecodeWithImageMagick(path, width, converter, quality);
+        if (!gray.has_value()) {
+            return std::unexpected(gray.error());
+        }
+    }
+
+    if (trim.enabled) {
+        TrimBorders(path, width, quality, trim, in_process, *gray);
     }
-    uint32_t x_pixels = std::stoi(dimensions[0]);
-    uint32_t y_pixels = std::stoi(dimensions[1]);
+
+    /* Washed out photos print as grey mush on the thermal head otherwise. */
+    AutoLevels(*gray);
+    return gray;
+}
+
+void ImageTransform::TrimBorders(const std::string &path, uint32_t width,
+                                 ResampleQuality quality,
+                                 const TrimOptions &trim, bool in_process,
+                                 std::vector<uint8_t> &gray)
+{
+    auto box = FindContent(gray, width, trim.tolerance);
+    if (!box.has_value()) {
+        /* Blank, there's nothing to keep. */
+        return;
+    }
+    uint32_t height = gray.size() / width;
 
     /*
-     * If it's larger in the X direction, rotate it so we can print at a higher
-     * resolution.
+     * Decoding in-process again costs about what the first decode did.
+     * Another ImageMagick run costs far more, so those only lose their blank
+     * rows.
      */
-    if (x_pixels > y_pixels) {
-        cmd = kConvertCmd + " " + path + " " + kRotateArgs + " " + path;
-        output = Execute(cmd);
-        if (!output.has_value()) {
-            return std::unexpected(output.error());
+    auto region = TrimRegion(*box, width, height, trim);
+    if (in_process && region.has_value()) {
+        auto cropped = DecodeImage(path, width, quality, *region);
+        auto cropped_box = cropped.has_value() ?
+            FindContent(*cropped, width, trim.tolerance) : std::nullopt;
+        if (cropped_box.has_value()) {
+            DB_PRINT("Content is %u-%u of %u dots across\n", box->left,
+                     box->right, width);
+            gray = std::move(*cropped);
+            box = cropped_box;
+        } else if (!cropped.has_value()) {
+            cropped.error().print_status();
         }
     }
 
-    /* Append [0] to the path so we only convert the first frame of the image */
-    std::string path_first_frame = path;
-    path_first_frame.append("[0]");
+    DB_PRINT("Trimmed to rows %u-%u of %zu\n", box->top, box->bottom,
+             gray.size() / width);
+    TrimRows(gray, width, *box, trim.padding);
+}
+
+std::expected<std::vector<uint8_t>, Status>
+    ImageTransform::DecodeWithImageMagick(const std::string &path,
+                                          uint32_t width,
+                                          ConverterPool *converter,
+                                          ResampleQuality quality)
+{
+    std::vector<uint8_t> data;
+    std::optional<SharedImage> shared;
+    std::span<const uint8_t> ppm;
+
+    if (converter != nullptr) {
+        /* Mapped straight from the worker, nothing is copied. */
+        auto converted = converter->Convert(path);
+        if (!converted.has_value()) {
+            return std::unexpected(converted.error());
+        }
+        shared.emplace(std::move(*converted));
+        ppm = shared->data();
+    } else {
+        auto read = RunImageMagick(path);
+        if (!read.has_value()) {
+            return std::unexpected(read.error());
+        }
+        data = std::move(*read);
+        ppm = data;
+    }
+
+    auto image = ParsePpm(ppm);
+    if (!image.has_value()) {
+        return std::unexpected(image.error());
+    }
+    ImageView view = *image;
 
     /*
-     * Finally, convert the image to grayscale and RGB format.
+     * If it's larger in the X direction, rotate it so we can print at a higher
+     * resolution. The rotation is just a different walk over the pixels.
      * TODO: This unconditionally resizes, should we do this instead of padding
      * with space?
      */
-    cmd = kConvertCmd + " " + path_first_frame + " " + kConvertArgs;
-    output = Execute(cmd);
+    if (view.width > view.height) {
+        view = view.Rotated90();
+    }
+
+    return Resampler::Resample(view, width,
+                               Resampler::DefaultFilter(view.width, width,
+                                                        quality));
+}
+
+std::expected<std::vector<uint8_t>, Status>
+    ImageTransform::RunImageMagick(const std::string &path)
+{
+    const std::string kConvertCmd = "convert";
+    const std::string kOutputImageName = path + ".ppm";
+    /*
+     * Only decode here. Resizing, grayscale, negating and rotating are done
+     * by the resampler.
+     */
+    const std::string kConvertArgs =
+        "-background white -flatten -depth 8 ppm:" + kOutputImageName;
+
+    /* Append [0] to the path so we only convert the first frame of the image */
+    std::string path_first_frame = path;
+    path_first_frame.append("[0]");
+
+    std::string cmd = kConvertCmd + " " + path_first_frame + " " +
+        kConvertArgs;
+    auto output = Execute(cmd);
     if (!output.has_value()) {
         return std::unexpected(output.error());
     }
 
-    return kOutputImageName;
+    auto data = ReadFile(kOutputImageName);
+    remove(kOutputImageName.c_str());
+    return data;
 }
 
 std::expected<std::vector<uint8_t>, Status>
@@ -155,14 +276,20 @@ std::expected<std::vector<uint8_t>, Status>
 
 std::vector<uint8_t> ImageTransform::RasterImageDitherFloydSteinberg()
 {
-    RgbImage img(data_, width_);
-    return img.RasterImageDitherFloydSteinberg();
+    return RasterDither(data_, width_, DitherAlgorithm::kFloydSteinberg,
+                        ScanOrder::kRaster);
 }
 
 std::vector<uint8_t> ImageTransform::RasterImageDitherAtkinson()
 {
-    RgbImage img(data_, width_);
-    return img.RasterImageDitherAtkinson();
+    return RasterDither(data_, width_, DitherAlgorithm::kAtkinson,
+                        ScanOrder::kRaster);
+}
+
+std::vector<uint8_t> ImageTransform::RasterImageDither(
+        DitherAlgorithm algorithm, ScanOrder order)
+{
+    return RasterDither(data_, width_, algorithm, order);
 }
 
 /*
@@ -178,176 +305,33 @@ std::expected<std::unique_ptr<ImageTransform>, Status>
         return std::unexpected(data.error());
     }
 
-    return std::make_unique<ImageTransform>(*data, width);
+    /*
+     * The dither works on one gray byte per dot. Any trailing partial pixel
+     * (such as a newline) is dropped.
+     */
+    size_t num_pixels = data->size() / 3;
+    std::vector<uint8_t> gray(num_pixels);
+    for (size_t i = 0; i < num_pixels; i++) {
+        const uint8_t *rgb = &(*data)[i * 3];
+        gray[i] = (rgb[0] + rgb[1] + rgb[2]) / 3;
+    }
+
+    return std::make_unique<ImageTransform>(std::move(gray), width);
 }
 
 std::expected<std::unique_ptr<ImageTransform>, Status>
-    ImageTransform::ImageFromFile(const std::string &path)
+    ImageTransform::ImageFromFile(const std::string &path,
+                                  ConverterPool *converter,
+                                  ResampleQuality quality,
+                                  uint32_t width,
+                                  const TrimOptions &trim)
 {
-    static constexpr uint16_t kImageWidth = 576;
-
-    auto transformed_img_path = ProcessImage(path);
-    if (!transformed_img_path.has_value()) {
-        return std::unexpected(transformed_img_path.error());
-    }
-
-    auto data = ReadFile(*transformed_img_path);
+    auto data = ProcessImage(path, width, converter, quality, trim);
     if (!data.has_value()) {
         return std::unexpected(data.error());
     }
 
-    return std::make_unique<ImageTransform>(*data, kImageWidth);
-}
-
-std::vector<uint8_t> RgbImage::RasterImageDitherAtkinson()
-{
-    const uint8_t threshold = 0x80;
-    /* Each byte in the raster is 8 pixels (dots). */
-    std::vector<uint8_t> print_img(width_ * height_ / 8, 0);
-
-    size_t print_img_offset = 0;
-    uint8_t print_img_byte_shift = 7;
-    for (size_t i = 0; i < width_ * height_; i++) {
-        uint32_t curr_y = i / width_;
-        uint32_t curr_x = i % width_;
-
-        int32_t old_pixel = average_pixel(&data_[i]);
-        uint8_t new_pixel = round_pixel(old_pixel, threshold);
-        int32_t err = old_pixel - new_pixel;
-
-        /*
-         * Write out the pixel. Note that if the color is 0, that means it's a
-         * black pixel, which means that we would set the bit in the raster
-         * data. However, we previously inverted the image, so a pixel value of
-         * 0xff means we set the bit in the raster data.
-         */
-        if (new_pixel == 0xff) {
-            print_img[print_img_offset] |= (1 << print_img_byte_shift);
-        }
-        if (print_img_byte_shift == 0) {
-            /*
-             * If an 8-bit bitmap happens to be a newline character, the printer
-             * FW will do a newline rather than print out each pixel in the
-             * bitmap.
-             * To work around this HIGH QUALITY firmware, convert the bitmap
-             * from 0b00001010 to 0b00010100, since it's close enough to what we
-             * wanted.
-             */
-            if (print_img[print_img_offset] == 0x0a) {
-                print_img[print_img_offset] = 0x14;
-            }
-            print_img_byte_shift = 7;
-            print_img_offset++;
-        } else {
-            print_img_byte_shift--;
-        }
-
-        /*
-         * Dither using the Atkinson algorithm.
-         * Error propagation is done as follows
-         * ... ... ... ...
-         * ... cur 1/8 1/8
-         * 1/8 1/8 1/8 ...
-         * ... 1/8 ... ...
-         */
-        /* R */
-        if (curr_x < width_) {
-            error_propagate_atkinson(&data_[i + 1], err);
-        }
-        /* 2R */
-        if (curr_x < width_ - 1) {
-            error_propagate_atkinson(&data_[i + 2], err);
-        }
-        /* DL */
-        if (curr_y < height_ && curr_x != 0) {
-            error_propagate_atkinson(&data_[i + width_ - 1], err);
-        }
-        /* D */
-        if (curr_y < height_) {
-            error_propagate_atkinson(&data_[i + width_], err);
-        }
-        /* DR */
-        if (curr_y < height_ && curr_x < width_) {
-            error_propagate_atkinson(&data_[i + width_ + 1], err);
-        }
-        /* 2D */
-        if (curr_y < height_ - 1) {
-            error_propagate_atkinson(&data_[i + (width_ * 2)], err);
-        }
-    }
-
-    return print_img;
-}
-
-std::vector<uint8_t> RgbImage::RasterImageDitherFloydSteinberg()
-{
-    const uint8_t threshold = 0x80;
-    /* Each byte in the raster is 8 pixels (dots). */
-    std::vector<uint8_t> print_img(width_ * height_ / 8);
-
-    size_t print_img_offset = 0;
-    uint8_t print_img_byte_shift = 7;
-    for (size_t i = 0; i < width_ * height_; i++) {
-        uint32_t curr_y = i / height_;
-        uint32_t curr_x = i % width_;
-
-        int32_t old_pixel = average_pixel(&data_[i]);
-        uint8_t new_pixel = round_pixel(old_pixel, threshold);
-        int32_t err = old_pixel - new_pixel;
-
-        /*
-         * Write out the pixel. Note that if the color is 0, that means it's a
-         * black pixel, which means that we would set the bit in the raster
-         * data. However, we previously inverted the image, so a pixel value of
-         * 0xff means we set the bit in the raster data.
-         */
-        if (new_pixel == 0xff) {
-            print_img[print_img_offset] |= (1 << print_img_byte_shift);
-        }
-        if (print_img_byte_shift == 0) {
-            /*
-             * If an 8-bit bitmap happens to be a newline character, the printer
-             * FW will do a newline rather than print out each pixel in the
-             * bitmap.
-             * To work around this HIGH QUALITY firmware, convert the bitmap
-             * from 0b00001010 to 0b00010100, since it's close enough to what we
-             * wanted.
-             */
-            if (print_img[print_img_offset] == 0x0a) {
-                print_img[print_img_offset] = 0x14;
-            }
-            print_img_byte_shift = 7;
-            print_img_offset++;
-        } else {
-            print_img_byte_shift--;
-        }
-
-        /*
-         * Dither using the Floyd Steinberg algorithm.
-         * Error propagation is done as follows
-         * .... .... ....
-         * .... curr 7/16
-         * 3/16 5/16 1/16
-         */
-        /* R */
-        if (curr_x < width_) {
-            error_propagate(&data_[i + 1], err, 7);
-        }
-        /* DL */
-        if (curr_y < height_ && curr_x != 0) {
-            error_propagate(&data_[i + width_ - 1], err, 3);
-        }
-        /* D */
-        if (curr_y < height_) {
-            error_propagate(&data_[i + width_], err, 5);
-        }
-        /* DR */
-        if (curr_y < height_ && curr_x < width_) {
-            error_propagate(&data_[i + width_ + 1], err, 1);
-        }
-    }
-
-    return print_img;
+    return std::make_unique<ImageTransform>(std::move(*data), width);
 }
 
 };
@@ -0,0 +1,316 @@
+#include "job_journal.h"
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "print_job.h"
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+/* FNV-1a, plenty to catch a torn write. */
+static uint32_t Checksum(std::string_view data)
+{
+    uint32_t hash = 2166136261u;
+    for (char c : data) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static std::string WithChecksum(const std::string &record)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), " %08x\n", Checksum(record));
+    return record + buf;
+}
+
+static std::vector<std::string> SplitWords(std::string_view line)
+{
+    std::vector<std::string> words;
+    size_t pos = 0;
+    while (pos < line.size()) {
+        size_t end = line.find(' ', pos);
+        if (end == std::string_view::npos) {
+            end = line.size();
+        }
+        if (end > pos) {
+            words.emplace_back(line.substr(pos, end - pos));
+        }
+        pos = end + 1;
+    }
+    return words;
+}
+
+std::string JobJournal::FormatQueued(const PrintJob &job)
+{
+    char buf[64];
+    snprintf(buf, sizeof(buf), "Q %" PRIu64 " %" PRId64 " %u %u %u ", job.id,
+             job.chat_id, static_cast<uint32_t>(job.options.dither),
+             static_cast<uint32_t>(job.options.scan),
+             static_cast<uint32_t>(job.options.columns));
+    return WithChecksum(buf + job.file_id);
+}
+
+std::string JobJournal::FormatDone(uint64_t id)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "D %" PRIu64, id);
+    return WithChecksum(buf);
+}
+
+Status JobJournal::Compact(const std::string &path,
+                           const std::vector<PrintJob> &unfinished)
+{
+    const std::string tmp_path = path + ".tmp";
+
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+        return Status(StatusCode::kInternalError,
+                      "Failed to create compacted journal");
+    }
+
+    std::string contents;
+    for (const auto &job : unfinished) {
+        contents += FormatQueued(job);
+    }
+
+    size_t total_written = 0;
+    while (total_written < contents.size()) {
+        ssize_t num_written = write(fd, &contents[total_written],
+                                    contents.size() - total_written);
+        if (num_written < 0) {
+            close(fd);
+            return Status(StatusCode::kInternalError,
+                          "Failed to write compacted journal");
+        }
+        total_written += num_written;
+    }
+
+    if (fsync(fd)) {
+        close(fd);
+        return Status(StatusCode::kInternalError,
+                      "Failed to sync compacted journal");
+    }
+    close(fd);
+
+    if (rename(tmp_path.c_str(), path.c_str())) {
+        return Status(StatusCode::kInternalError,
+                      "Failed to replace journal");
+    }
+
+    /* Make the rename itself durable. */
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : path.substr(0, slash);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return Status(StatusCode::kStatusOk);
+}
+
+std::expected<std::unique_ptr<JobJournal>, Status>
+    JobJournal::Open(const std::string &path)
+{
+    std::string contents;
+    FILE *f = fopen(path.c_str(), "r");
+    if (f != NULL) {
+        char buf[4096];
+        size_t num_read;
+        while ((num_read = fread(buf, 1, sizeof(buf), f)) > 0) {
+            contents.append(buf, num_read);
+        }
+        fclose(f);
+    }
+
+    /* Ordered by ID, which is also the order they were queued in. */
+    std::map<uint64_t, PrintJob> queued;
+    uint64_t next_id = 0;
+    size_t skipped = 0;
+    size_t pos = 0;
+    while (pos < contents.size()) {
+        size_t end = contents.find('\n', pos);
+        if (end == std::string::npos) {
+            /* The last write never finished. */
+            skipped++;
+            break;
+        }
+        std::string_view line(&contents[pos], end - pos);
+        pos = end + 1;
+
+        size_t checksum_pos = line.rfind(' ');
+        if (checksum_pos == std::string_view::npos ||
+                strtoul(std::string(line.substr(checksum_pos + 1)).c_str(),
+                        NULL, 16) != Checksum(line.substr(0, checksum_pos))) {
+            skipped++;
+            continue;
+        }
+
+        std::vector<std::string> words =
+            SplitWords(line.substr(0, checksum_pos));
+        if (words.size() == 7 && words[0] == "Q") {
+            PrintJob job;
+            job.id = strtoull(words[1].c_str(), NULL, 10);
+            job.chat_id = strtoll(words[2].c_str(), NULL, 10);
+            job.options = kDefaultPrintOptions;
+            job.options.dither = static_cast<DitherAlgorithm>(
+                    strtoul(words[3].c_str(), NULL, 10));
+            job.options.scan = static_cast<ScanOrder>(
+                    strtoul(words[4].c_str(), NULL, 10));
+            job.options.columns = strtoul(words[5].c_str(), NULL, 10);
+            job.file_id = words[6];
+            next_id = std::max(next_id, job.id + 1);
+            queued[job.id] = job;
+        } else if (words.size() == 2 && words[0] == "D") {
+            queued.erase(strtoull(words[1].c_str(), NULL, 10));
+        } else {
+            skipped++;
+        }
+    }
+
+    if (skipped) {
+        printf("Skipped %zu bad journal records\n", skipped);
+    }
+
+    std::vector<PrintJob> unfinished;
+    for (auto &[id, job] : queued) {
+        unfinished.push_back(std::move(job));
+    }
+
+    Status status = Compact(path, unfinished);
+    if (!status.Ok()) {
+        return std::unexpected(status);
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC,
+                  0644);
+    if (fd < 0) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to open journal"));
+    }
+
+    DB_PRINT("Opened journal %s, %zu unfinished jobs\n", path.c_str(),
+             unfinished.size());
+    return std::make_unique<JobJournal>(fd, path, next_id,
+                                        std::move(unfinished));
+}
+
+JobJournal::JobJournal(int fd, std::string_view path, uint64_t next_id,
+                       std::vector<PrintJob> unfinished) :
+        fd_(fd),
+        path_(path),
+        unfinished_(std::move(unfinished)),
+        next_id_(next_id),
+        records_written_(0),
+        records_synced_(0),
+        syncs_(0),
+        sync_failed_(false),
+        stop_(false)
+{
+    flusher_ = std::thread(&JobJournal::FlushLoop, this);
+}
+
+JobJournal::~JobJournal()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_flush_.notify_one();
+    flusher_.join();
+    close(fd_);
+}
+
+/* Must be called with mu_ held, so records hit the file in number order. */
+Status JobJournal::WriteRecord(const std::string &record)
+{
+    /* O_APPEND and a single write keep each record in one piece. */
+    ssize_t num_written = write(fd_, record.data(), record.size());
+    if (num_written != static_cast<ssize_t>(record.size())) {
+        return Status(StatusCode::kInternalError,
+                      "Failed to write journal record");
+    }
+
+    records_written_++;
+    cv_flush_.notify_one();
+    return Status(StatusCode::kStatusOk);
+}
+
+Status JobJournal::Append(PrintJob &job)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    job.id = next_id_++;
+    return WriteRecord(FormatQueued(job));
+}
+
+Status JobJournal::MarkDone(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return WriteRecord(FormatDone(id));
+}
+
+Status JobJournal::Sync()
+{
+    std::unique_lock<std::mutex> lock(mu_);
+    uint64_t target = records_written_;
+    cv_flush_.notify_one();
+    cv_synced_.wait(lock, [&]() { return records_synced_ >= target; });
+
+    if (sync_failed_) {
+        return Status(StatusCode::kInternalError, "Failed to sync journal");
+    }
+    return Status(StatusCode::kStatusOk);
+}
+
+void JobJournal::FlushLoop()
+{
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+        cv_flush_.wait(lock, [&]() {
+            return stop_ || records_synced_ < records_written_;
+        });
+        if (records_synced_ == records_written_) {
+            /* Stopping, and nothing left to sync. */
+            break;
+        }
+
+        /* Give the rest of a burst a chance to land in the same sync. */
+        if (!stop_) {
+            cv_flush_.wait_for(lock, kSyncInterval, [&]() { return stop_; });
+        }
+
+        uint64_t target = records_written_;
+        lock.unlock();
+        int ret = fdatasync(fd_);
+        lock.lock();
+
+        syncs_++;
+        if (ret) {
+            printf("Failed to sync journal, errno %d\n", errno);
+            sync_failed_ = true;
+        }
+        records_synced_ = target;
+        cv_synced_.notify_all();
+    }
+}
+
+};
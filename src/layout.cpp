@@ -0,0 +1,87 @@
+#include "layout.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <vector>
+
+namespace sticker_bot {
+
+uint32_t ColumnWidth(uint32_t width_bytes, uint8_t columns)
+{
+    if (columns <= 1) {
+        return width_bytes * 8;
+    }
+    return (width_bytes - (columns - 1) * kColumnGapBytes) / columns * 8;
+}
+
+static uint32_t ItemRows(const LayoutItem &item)
+{
+    return item.width_bytes ? item.raster.size() / item.width_bytes : 0;
+}
+
+std::vector<uint8_t> PackShelves(std::span<const LayoutItem> items,
+                                 uint32_t width_bytes)
+{
+    typedef struct Shelf {
+        uint32_t y;
+        /* Where the next item on it goes. */
+        uint32_t x_bytes;
+    } Shelf;
+    typedef struct Placement {
+        const LayoutItem *item;
+        uint32_t y;
+        uint32_t x_bytes;
+    } Placement;
+
+    std::vector<size_t> order(items.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&items](size_t a, size_t b) {
+        return ItemRows(items[a]) > ItemRows(items[b]);
+    });
+
+    /* Everything is placed first, so the raster's size is known. */
+    std::vector<Shelf> shelves;
+    std::vector<Placement> placements;
+    uint32_t total_rows = 0;
+    for (size_t i : order) {
+        const LayoutItem &item = items[i];
+        uint32_t width = std::min(item.width_bytes, width_bytes);
+        if (ItemRows(item) == 0) {
+            continue;
+        }
+
+        auto shelf = std::find_if(shelves.begin(), shelves.end(),
+                                  [width, width_bytes](const Shelf &shelf) {
+                                      return shelf.x_bytes + width <=
+                                          width_bytes;
+                                  });
+        if (shelf == shelves.end()) {
+            if (!shelves.empty()) {
+                total_rows += kShelfGapRows;
+            }
+            shelves.push_back({.y = total_rows, .x_bytes = 0});
+            total_rows += ItemRows(item);
+            shelf = shelves.end() - 1;
+        }
+        placements.push_back({.item = &item, .y = shelf->y,
+                              .x_bytes = shelf->x_bytes});
+        shelf->x_bytes += width + kColumnGapBytes;
+    }
+
+    std::vector<uint8_t> raster(static_cast<size_t>(total_rows) * width_bytes);
+    for (const Placement &placement : placements) {
+        const LayoutItem &item = *placement.item;
+        uint32_t width = std::min(item.width_bytes, width_bytes);
+        for (uint32_t row = 0; row < ItemRows(item); row++) {
+            std::copy_n(&item.raster[static_cast<size_t>(row) *
+                                     item.width_bytes], width,
+                        &raster[static_cast<size_t>(placement.y + row) *
+                                width_bytes + placement.x_bytes]);
+        }
+    }
+    return raster;
+}
+
+};
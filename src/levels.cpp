@@ -0,0 +1,152 @@
+#include "levels.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <span>
+
+namespace sticker_bot {
+
+/* Keep the automatic gamma gentle, it only nudges the midtones. */
+static constexpr double kMinGamma = 0.67;
+static constexpr double kMaxGamma = 1.5;
+
+static std::array<uint32_t, 256> Histogram(std::span<const uint8_t> gray)
+{
+    /*
+     * Count into four histograms, so runs of the same level (which is most of
+     * a sticker) don't serialize on incrementing a single counter.
+     */
+    uint32_t sub[4][256] = {};
+    const uint8_t *p = gray.data();
+    const size_t n = gray.size();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        sub[0][p[i]]++;
+        sub[1][p[i + 1]]++;
+        sub[2][p[i + 2]]++;
+        sub[3][p[i + 3]]++;
+    }
+    for (; i < n; i++) {
+        sub[0][p[i]]++;
+    }
+
+    std::array<uint32_t, 256> hist;
+    for (size_t v = 0; v < hist.size(); v++) {
+        hist[v] = sub[0][v] + sub[1][v] + sub[2][v] + sub[3][v];
+    }
+    return hist;
+}
+
+/* A plain linear stretch, in fixed blocks so it vectorizes. */
+static void ApplyLinear(std::span<uint8_t> gray, uint8_t lo, uint8_t hi)
+{
+    constexpr uint32_t kLanes = 16;
+    constexpr uint32_t kShift = 16;
+    constexpr int32_t kMax = 0xff;
+    const int32_t scale = (kMax << kShift) / (hi - lo);
+    const int32_t offset = lo;
+
+    uint8_t *__restrict p = gray.data();
+    const size_t n = gray.size();
+    const size_t vector_n = n - n % kLanes;
+
+    auto stretch = [=](uint8_t v) -> uint8_t {
+        int32_t out = ((v - offset) * scale + (1 << (kShift - 1))) >> kShift;
+        return std::clamp(out, 0, kMax);
+    };
+
+    size_t i = 0;
+    for (; i < vector_n; i += kLanes) {
+        for (uint32_t j = 0; j < kLanes; j++) {
+            p[i + j] = stretch(p[i + j]);
+        }
+    }
+    for (; i < n; i++) {
+        p[i] = stretch(p[i]);
+    }
+}
+
+static void ApplyLut(std::span<uint8_t> gray,
+                     const std::array<uint8_t, 256> &lut)
+{
+    uint8_t *p = gray.data();
+    const size_t n = gray.size();
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        p[i] = lut[p[i]];
+        p[i + 1] = lut[p[i + 1]];
+        p[i + 2] = lut[p[i + 2]];
+        p[i + 3] = lut[p[i + 3]];
+    }
+    for (; i < n; i++) {
+        p[i] = lut[p[i]];
+    }
+}
+
+void AutoLevels(std::span<uint8_t> gray, const LevelsOptions &options)
+{
+    if (gray.empty()) {
+        return;
+    }
+
+    std::array<uint32_t, 256> hist = Histogram(gray);
+
+    /* Find the levels with clip_fraction of the dots below/above them. */
+    const uint64_t clip = gray.size() * options.clip_fraction;
+    uint32_t lo = 0;
+    uint64_t count = hist[0];
+    while (lo < 255 && count <= clip) {
+        lo++;
+        count += hist[lo];
+    }
+    uint32_t hi = 255;
+    count = hist[255];
+    while (hi > 0 && count <= clip) {
+        hi--;
+        count += hist[hi];
+    }
+
+    if (hi <= lo || hi - lo < options.min_span) {
+        return;
+    }
+
+    /*
+     * Pick a gamma that moves the mean of the midtones to mid gray. The clipped
+     * ends are left out, otherwise a sticker's background decides the curve.
+     */
+    double gamma = 1.0;
+    if (options.auto_gamma) {
+        double sum = 0.0;
+        uint64_t midtones = 0;
+        for (uint32_t v = lo + 1; v < hi; v++) {
+            sum += static_cast<double>(v - lo) / (hi - lo) * hist[v];
+            midtones += hist[v];
+        }
+        if (midtones > 0) {
+            double mean = sum / midtones;
+            gamma = std::clamp(log(0.5) / log(mean), kMinGamma, kMaxGamma);
+        }
+    }
+
+    if (lo == 0 && hi == 255 && gamma == 1.0) {
+        return;
+    }
+    if (gamma == 1.0) {
+        ApplyLinear(gray, lo, hi);
+        return;
+    }
+
+    std::array<uint8_t, 256> lut;
+    for (uint32_t v = 0; v < lut.size(); v++) {
+        double t = std::clamp(static_cast<double>(static_cast<int32_t>(v) -
+                              static_cast<int32_t>(lo)) / (hi - lo), 0.0, 1.0);
+        lut[v] = lround(pow(t, gamma) * 255.0);
+    }
+    ApplyLut(gray, lut);
+}
+
+};
@@ -1,5 +1,6 @@
 #include "m02_pro.h"
 
+#include <chrono>
 #include <cstdint>
 #include <expected>
 #include <mutex>
@@ -13,6 +14,7 @@
 #include <fcntl.h>
 #include <cstring>
 
+#include "feed_thread.h"
 #include "status.h"
 #include "utils.h"
 
@@ -27,9 +29,18 @@ Status M02Pro::PrintImage(std::span<const uint8_t> data, uint16_t width)
     uint16_t bytes_x = width / 8;
 
     std::lock_guard<std::mutex> lock(mu_printer_);
-    RETURN_IF_ERROR(PrintRasterImage(data, bytes_x, data.size() / bytes_x));
-
-    RETURN_IF_ERROR(SendLineFeed(3));
+    {
+        /* Only while sending, the printer's reply can take its time. */
+        FeedScope feed_scope(options_.feed, data);
+        jitter_.StartFeed();
+        Status status = PrintRasterImage(data, bytes_x,
+                                         data.size() / bytes_x);
+        if (status.Ok()) {
+            status = SendLineFeed(kFeedRows);
+        }
+        jitter_.EndFeed(status.Ok());
+        RETURN_IF_ERROR(status);
+    }
 
     /* Read the message the printer says when it finishes printing. */
     std::vector<uint8_t> buf(256);
@@ -45,28 +56,72 @@ Status M02Pro::PrintImage(std::span<const uint8_t> data, uint16_t width)
 
 Status M02Pro::PrinterStatus()
 {
-    const std::vector<uint8_t> kReadBattery = {0x1f, 0x11, 0x08};
-    constexpr uint8_t kBatteryStatus = 0x04;
     std::vector<uint8_t> data(8);
 
     std::lock_guard<std::mutex> lock(mu_printer_);
-    RETURN_IF_ERROR(SendCmd(kReadBattery));
+    RETURN_IF_ERROR(SendCmd(ReadBatteryCmd()));
     RETURN_IF_ERROR(ReadData(data, 0));
 
+    LogStatusReply(data);
+    return Status(StatusCode::kStatusOk);
+}
+
+std::vector<uint8_t> M02Pro::InitCmd()
+{
+    return {0x1b, 0x40};
+}
+
+std::vector<uint8_t> M02Pro::LineFeedCmd(uint8_t rows)
+{
+    return {0x1b, 0x64, rows};
+}
+
+std::vector<uint8_t> M02Pro::RasterImageCmd(uint16_t bytes_x, uint16_t bytes_y)
+{
+    /* For simplicity, just always do normal mode. */
+    return {0x1d, 0x76, 0x30,
+            static_cast<uint8_t>(M02ProPrintRasterImageMode::kNormal),
+            static_cast<uint8_t>(htole16(bytes_x) & 0xff),
+            static_cast<uint8_t>(htole16(bytes_x) >> 8),
+            static_cast<uint8_t>(htole16(bytes_y) & 0xff),
+            static_cast<uint8_t>(htole16(bytes_y) >> 8)};
+}
+
+std::vector<uint8_t> M02Pro::ReadBatteryCmd()
+{
+    return {0x1f, 0x11, 0x08};
+}
+
+std::vector<uint8_t> M02Pro::SettingsCmd(const M02ProOptions &options)
+{
+    std::vector<uint8_t> cmd;
+    if (options.speed != 0 && options.speed <= kMaxPrinterSpeed) {
+        cmd.insert(cmd.end(), {0x1b, 0x4e, 0x0d, options.speed});
+    }
+    if (options.density != 0 && options.density <= kMaxPrinterDensity) {
+        cmd.insert(cmd.end(), {0x1b, 0x4e, 0x04, options.density});
+    }
+    return cmd;
+}
+
+void M02Pro::LogStatusReply(std::span<const uint8_t> reply)
+{
+    constexpr uint8_t kBatteryStatus = 0x04;
+
     /*
      * TODO: Understand more statuses and determine if they're bad, especially
      * the "out of paper" status.
      */
-    if (data[0] == kBatteryStatus) {
-        printf("Battery life is %d%%\n", data[1]);
+    if (reply[0] == kBatteryStatus) {
+        printf("Battery life is %d%%\n", reply[1]);
     } else {
-        printf("Unknown status %.2x %.2x\n", data[0], data[1]);
+        printf("Unknown status %.2x %.2x\n", reply[0], reply[1]);
     }
-    return Status(StatusCode::kStatusOk);
 }
 
 std::expected<std::unique_ptr<M02Pro>, Status>
-        M02Pro::Create(const std::string &path)
+        M02Pro::Create(const std::string &path,
+                       const M02ProOptions &options)
 {
     int fd = open(path.c_str(), O_RDWR);
     if (fd < 0) {
@@ -74,7 +129,7 @@ std::expected<std::unique_ptr<M02Pro>, Status>
                       "Failed to open M02 Pro file descriptor"));
     }
 
-    return std::move(std::make_unique<M02Pro>(fd, path));
+    return std::move(std::make_unique<M02Pro>(fd, path, options));
 }
 
 Status M02Pro::SendCmd(std::span<const uint8_t> data)
@@ -85,11 +140,14 @@ Status M02Pro::SendCmd(std::span<const uint8_t> data)
             kMaxBufferSize ? kMaxBufferSize :
             (data.size() - total_written);
 
+        std::chrono::steady_clock::time_point start =
+            std::chrono::steady_clock::now();
         ssize_t bytes_written = write(fd_, &data[total_written],
                 num_to_write);
         if (bytes_written < 0) {
             return Status(StatusCode::kInternalError, "Failed to send data");
         }
+        jitter_.Wrote(start, bytes_written);
 
         DB_PRINT("%s: wrote %zd bytes\n", __func__, bytes_written);
         DB_PRINT_ARRAY(&data[total_written], bytes_written);
@@ -107,6 +165,11 @@ std::expected<ssize_t, Status> M02Pro::DoRead(std::span<uint8_t> data)
         return std::unexpected(Status(StatusCode::kInternalError,
                       "Failed to read data from printer"));
     }
+    /* select() said there was something, so this is a hang up. */
+    if (bytes_read == 0) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                      "Printer disconnected"));
+    }
 
     DB_PRINT("%s: read %zd bytes\n", __func__, bytes_read);
     DB_PRINT_ARRAY(data, bytes_read);
@@ -156,9 +219,7 @@ Status M02Pro::ReadData(std::span<uint8_t> data, size_t min_to_read)
 
 Status M02Pro::SendLineFeed(uint8_t rows)
 {
-    std::vector<uint8_t> cmd {0x1b, 0x64, rows};
-
-    Status status = SendCmd(cmd);
+    Status status = SendCmd(LineFeedCmd(rows));
     if (!status.Ok()) {
         status.prepend_message("Failed to send line feed");
     }
@@ -167,9 +228,7 @@ Status M02Pro::SendLineFeed(uint8_t rows)
 
 Status M02Pro::InitPrinter()
 {
-    const std::vector<uint8_t> kCmd = {0x1b, 0x40};
-
-    Status status = SendCmd(kCmd);
+    Status status = SendCmd(InitCmd());
     if (!status.Ok()) {
         status.prepend_message("Failed to initialize printer: ");
     }
@@ -180,17 +239,18 @@ Status M02Pro::InitPrinter()
 Status M02Pro::PrintRasterImage(std::span<const uint8_t> data,
                                   uint16_t bytes_x, uint16_t bytes_y)
 {
-    /* For simplicity, just always do normal mode. */
-    std::vector<uint8_t> cmd = {0x1d, 0x76, 0x30,
-                      static_cast<uint8_t>(M02ProPrintRasterImageMode::kNormal),
-                      static_cast<uint8_t>(htole16(bytes_x) & 0xff),
-                      static_cast<uint8_t>(htole16(bytes_x) >> 8),
-                      static_cast<uint8_t>(htole16(bytes_y) & 0xff),
-                      static_cast<uint8_t>(htole16(bytes_y) >> 8)};
-
     RETURN_IF_ERROR(InitPrinter());
 
-    Status status = SendCmd(cmd);
+    std::vector<uint8_t> settings_cmd = SettingsCmd(options_);
+    if (!settings_cmd.empty()) {
+        Status status = SendCmd(settings_cmd);
+        if (!status.Ok()) {
+            status.prepend_message("Failed to set speed and density: ");
+            return status;
+        }
+    }
+
+    Status status = SendCmd(RasterImageCmd(bytes_x, bytes_y));
     if (!status.Ok()) {
         status.prepend_message("Failed to send raster image header");
         return status;
@@ -0,0 +1,98 @@
+#include "png_encoder.h"
+
+#include <cstdint>
+#include <expected>
+#include <span>
+#include <vector>
+#include <zlib.h>
+
+#include "status.h"
+
+namespace sticker_bot {
+
+static constexpr uint8_t kPngSignature[] = {
+    0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n',
+};
+static constexpr uint8_t kBitDepth = 1;
+static constexpr uint8_t kColorTypeGray = 0;
+static constexpr uint8_t kFilterNone = 0;
+
+static void PutBe32(std::vector<uint8_t> &out, uint32_t value)
+{
+    out.push_back(value >> 24);
+    out.push_back(value >> 16);
+    out.push_back(value >> 8);
+    out.push_back(value);
+}
+
+/* Length, type, data and a CRC over the type and data. */
+static void PutChunk(std::vector<uint8_t> &out, const char type[4],
+                     std::span<const uint8_t> data)
+{
+    PutBe32(out, data.size());
+    size_t type_at = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data.begin(), data.end());
+    uLong crc = crc32(0, &out[type_at], 4 + data.size());
+    PutBe32(out, crc);
+}
+
+std::expected<std::vector<uint8_t>, Status>
+    EncodeRasterPng(std::span<const uint8_t> raster, uint32_t width_bytes)
+{
+    if (width_bytes == 0 || raster.empty() ||
+            raster.size() % width_bytes != 0) {
+        return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                      "Raster isn't whole rows"));
+    }
+    uint32_t rows = raster.size() / width_bytes;
+
+    std::vector<uint8_t> scanlines(static_cast<size_t>(rows) *
+                                   (width_bytes + 1));
+    uint8_t *line = scanlines.data();
+    const uint8_t *row = raster.data();
+    for (uint32_t y = 0; y < rows; y++) {
+        line[0] = kFilterNone;
+        for (uint32_t x = 0; x < width_bytes; x++) {
+            line[x + 1] = ~row[x];
+        }
+        line += width_bytes + 1;
+        row += width_bytes;
+    }
+
+    uLongf compressed_size = compressBound(scanlines.size());
+    std::vector<uint8_t> compressed(compressed_size);
+    if (compress2(compressed.data(), &compressed_size, scanlines.data(),
+                  scanlines.size(), Z_BEST_SPEED) != Z_OK) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to compress the preview"));
+    }
+
+    uint8_t header[13];
+    uint32_t width = width_bytes * 8;
+    header[0] = width >> 24;
+    header[1] = width >> 16;
+    header[2] = width >> 8;
+    header[3] = width;
+    header[4] = rows >> 24;
+    header[5] = rows >> 16;
+    header[6] = rows >> 8;
+    header[7] = rows;
+    header[8] = kBitDepth;
+    header[9] = kColorTypeGray;
+    /* Deflate, adaptive filtering, no interlace, the only ones there are. */
+    header[10] = 0;
+    header[11] = 0;
+    header[12] = 0;
+
+    std::vector<uint8_t> png(std::begin(kPngSignature),
+                             std::end(kPngSignature));
+    /* The chunks' lengths, types and CRCs, 12 bytes each. */
+    png.reserve(png.size() + 3 * 12 + sizeof(header) + compressed_size);
+    PutChunk(png, "IHDR", header);
+    PutChunk(png, "IDAT", std::span(compressed.data(), compressed_size));
+    PutChunk(png, "IEND", {});
+    return png;
+}
+
+};
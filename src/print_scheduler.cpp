@@ -0,0 +1,250 @@
+#include "print_scheduler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+PrintScheduler::PrintScheduler(SchedulerOptions options) :
+        options_(options),
+        stop_(false),
+        jobs_queued_(0),
+        jobs_run_(0),
+        jobs_rejected_(0),
+        queue_depth_(0),
+        wait_total_ms_(0),
+        next_wait_sample_(0),
+        run_mean_ms_(0)
+{
+    recent_waits_ms_.reserve(kWaitSamples);
+    worker_ = std::thread(&PrintScheduler::WorkLoop, this);
+}
+
+/* Anything still queued is dropped. The journal has it for the next run. */
+PrintScheduler::~PrintScheduler()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    worker_.join();
+}
+
+void PrintScheduler::RefillTokens(ChatQueue &chat, Clock::time_point now)
+{
+    if (options_.rate <= 0) {
+        chat.tokens = options_.burst;
+        return;
+    }
+
+    double elapsed = std::chrono::duration<double>(now - chat.last_refill)
+        .count();
+    chat.tokens = std::min(options_.burst,
+                           chat.tokens + elapsed * options_.rate);
+    chat.last_refill = now;
+}
+
+Status PrintScheduler::Enqueue(int64_t chat_id, Task task, bool ignore_cap)
+{
+    Clock::time_point now = Clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto [it, inserted] = chats_.try_emplace(chat_id);
+        ChatQueue &chat = it->second;
+        if (inserted) {
+            chat.tokens = options_.burst;
+            chat.last_refill = now;
+        }
+
+        if (!ignore_cap && options_.max_queued_per_chat &&
+                chat.tasks.size() >= options_.max_queued_per_chat) {
+            jobs_rejected_++;
+            return Status(StatusCode::kResourceExhausted,
+                          "Too many jobs queued for chat");
+        }
+
+        if (chat.tasks.empty()) {
+            round_robin_.push_back(chat_id);
+        }
+        chat.tasks.push_back(QueuedTask{std::move(task), now});
+        queue_depth_++;
+        jobs_queued_++;
+    }
+
+    cv_.notify_one();
+    return Status(StatusCode::kStatusOk);
+}
+
+bool PrintScheduler::PickTask(Clock::time_point now, QueuedTask &task,
+                              Clock::time_point &wake_at)
+{
+    wake_at = Clock::time_point::max();
+
+    for (size_t i = 0; i < round_robin_.size(); i++) {
+        int64_t chat_id = round_robin_.front();
+        round_robin_.pop_front();
+        ChatQueue &chat = chats_[chat_id];
+
+        RefillTokens(chat, now);
+        if (chat.tokens < 1) {
+            /* Rate limited, check again when it has a whole token. */
+            auto wait = std::chrono::duration<double>(
+                    (1 - chat.tokens) / options_.rate);
+            wake_at = std::min(wake_at, now +
+                    std::chrono::duration_cast<Clock::duration>(wait));
+            round_robin_.push_back(chat_id);
+            continue;
+        }
+
+        chat.tokens -= 1;
+        task = std::move(chat.tasks.front());
+        chat.tasks.pop_front();
+        /* The chat goes to the back of the line for its next job. */
+        if (!chat.tasks.empty()) {
+            round_robin_.push_back(chat_id);
+        }
+        return true;
+    }
+
+    return false;
+}
+
+void PrintScheduler::PruneChats(Clock::time_point now)
+{
+    for (auto it = chats_.begin(); it != chats_.end();) {
+        ChatQueue &chat = it->second;
+        if (chat.tasks.empty()) {
+            RefillTokens(chat, now);
+            if (chat.tokens >= options_.burst) {
+                it = chats_.erase(it);
+                continue;
+            }
+        }
+        it++;
+    }
+}
+
+void PrintScheduler::RecordWait(Clock::duration wait)
+{
+    double wait_ms = std::chrono::duration<double, std::milli>(wait).count();
+
+    wait_total_ms_ += wait_ms;
+    if (recent_waits_ms_.size() < kWaitSamples) {
+        recent_waits_ms_.push_back(wait_ms);
+    } else {
+        recent_waits_ms_[next_wait_sample_] = wait_ms;
+    }
+    next_wait_sample_ = (next_wait_sample_ + 1) % kWaitSamples;
+}
+
+void PrintScheduler::RecordRunTime(Clock::duration run_time)
+{
+    double run_ms = std::chrono::duration<double, std::milli>(run_time)
+        .count();
+
+    if (jobs_run_ == 0) {
+        run_mean_ms_ = run_ms;
+    } else {
+        run_mean_ms_ += kRunTimeWeight * (run_ms - run_mean_ms_);
+    }
+}
+
+void PrintScheduler::WorkLoop()
+{
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!stop_) {
+        if (queue_depth_ == 0) {
+            cv_.wait(lock, [&]() { return stop_ || queue_depth_ > 0; });
+            continue;
+        }
+
+        Clock::time_point now = Clock::now();
+        QueuedTask task;
+        Clock::time_point wake_at;
+        if (!PickTask(now, task, wake_at)) {
+            /* Woken early if a chat with tokens queues something. */
+            cv_.wait_until(lock, wake_at);
+            continue;
+        }
+        queue_depth_--;
+        RecordWait(now - task.queued_at);
+
+        lock.unlock();
+        try {
+            task.task();
+        } catch (std::exception &e) {
+            /* One bad job shouldn't take the whole queue down. */
+            printf("Print job threw: %s\n", e.what());
+        }
+        lock.lock();
+
+        Clock::time_point done = Clock::now();
+        RecordRunTime(done - now);
+        jobs_run_++;
+        PruneChats(done);
+    }
+}
+
+SchedulerStats PrintScheduler::Stats()
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    SchedulerStats stats = {
+        .jobs_queued = jobs_queued_,
+        .jobs_run = jobs_run_,
+        .jobs_rejected = jobs_rejected_,
+        .queue_depth = queue_depth_,
+        .waiting_chats = round_robin_.size(),
+        .wait_mean_ms = 0,
+        .wait_p50_ms = 0,
+        .wait_p95_ms = 0,
+        .wait_max_ms = 0,
+        .run_mean_ms = run_mean_ms_,
+        .projected_wait_ms = queue_depth_ * run_mean_ms_,
+    };
+
+    uint64_t jobs_started = jobs_queued_ - queue_depth_;
+    if (jobs_started == 0 || recent_waits_ms_.empty()) {
+        return stats;
+    }
+    stats.wait_mean_ms = wait_total_ms_ / jobs_started;
+
+    std::vector<double> waits = recent_waits_ms_;
+    std::sort(waits.begin(), waits.end());
+    stats.wait_p50_ms = waits[waits.size() / 2];
+    stats.wait_p95_ms = waits[waits.size() * 95 / 100];
+    stats.wait_max_ms = waits.back();
+    return stats;
+}
+
+std::string PrintScheduler::StatsString()
+{
+    SchedulerStats stats = Stats();
+
+    char buf[320];
+    snprintf(buf, sizeof(buf),
+             "Queue: %zu jobs from %zu chats\n"
+             "Jobs: %" PRIu64 " queued, %" PRIu64 " run, %" PRIu64
+             " rejected\n"
+             "Wait: mean %.0f ms, p50 %.0f ms, p95 %.0f ms, max %.0f ms\n"
+             "Run: mean %.0f ms, projected wait %.0f ms",
+             stats.queue_depth, stats.waiting_chats, stats.jobs_queued,
+             stats.jobs_run, stats.jobs_rejected, stats.wait_mean_ms,
+             stats.wait_p50_ms, stats.wait_p95_ms, stats.wait_max_ms,
+             stats.run_mean_ms, stats.projected_wait_ms);
+    return buf;
+}
+
+};
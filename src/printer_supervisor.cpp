@@ -0,0 +1,229 @@
+#include "printer_supervisor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+PrinterSupervisor::PrinterSupervisor(Connect connect,
+                                     SupervisorOptions options) :
+        connect_(std::move(connect)),
+        options_(options),
+        stop_(false),
+        down_since_(Clock::now()),
+        stats_({})
+{
+    supervisor_ = std::thread(&PrinterSupervisor::SuperviseLoop, this);
+}
+
+PrinterSupervisor::~PrinterSupervisor()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    supervisor_.join();
+}
+
+Status PrinterSupervisor::PrintImage(std::span<const uint8_t> data,
+                                     uint16_t width)
+{
+    Status status(StatusCode::kStatusOk);
+    bool held = false;
+
+    for (uint32_t attempt = 0; attempt < options_.max_print_attempts;
+            attempt++) {
+        std::shared_ptr<PrinterInterface> printer;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            if (!printer_ && !held) {
+                held = true;
+                stats_.prints_held++;
+                printf("Printer not connected, holding the print until it "
+                       "is\n");
+            }
+            cv_.wait(lock, [this] { return stop_ || printer_; });
+            if (stop_) {
+                return Status(StatusCode::kInternalError,
+                              "Printer supervisor stopped");
+            }
+            printer = printer_;
+        }
+
+        status = printer->PrintImage(data, width);
+        /* The printer didn't say it finished, but the image got there. */
+        if (status.Ok() || status.status() == StatusCode::kTimeout) {
+            return status;
+        }
+        LinkFailed(printer, status);
+    }
+
+    status.prepend_message("Failed on every reconnect: ");
+    return status;
+}
+
+Status PrinterSupervisor::PrinterStatus()
+{
+    std::shared_ptr<PrinterInterface> printer;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        printer = printer_;
+    }
+    if (!printer) {
+        return Status(StatusCode::kInternalError, "Printer not connected");
+    }
+
+    /* It answers this straight away, so even a timeout means it's gone. */
+    Status status = printer->PrinterStatus();
+    if (!status.Ok()) {
+        LinkFailed(printer, status);
+    }
+    return status;
+}
+
+void PrinterSupervisor::LinkFailed(
+        const std::shared_ptr<PrinterInterface> &printer, const Status &status)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    /* Already replaced, by whoever noticed first. */
+    if (printer_ != printer) {
+        return;
+    }
+
+    printf("Printer link lost, reconnecting: %s\n", status.message().c_str());
+    /* The printer is closed once nothing is still using it. */
+    printer_.reset();
+    down_since_ = Clock::now();
+    stats_.connected = false;
+    stats_.disconnects++;
+    cv_.notify_all();
+}
+
+bool PrinterSupervisor::TryConnect()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stats_.connect_attempts++;
+    }
+
+    auto connected = connect_();
+    if (!connected.has_value()) {
+        DB_PRINT("Printer connect failed: %s\n",
+                 connected.error().message().c_str());
+        return false;
+    }
+    std::shared_ptr<PrinterInterface> printer = std::move(*connected);
+
+    /* Opening can succeed with nothing on the other end, so ask it. */
+    Status status = printer->PrinterStatus();
+    if (!status.Ok()) {
+        DB_PRINT("Printer health check failed: %s\n",
+                 status.message().c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    double down_ms = std::chrono::duration<double, std::milli>(
+            Clock::now() - down_since_).count();
+    if (stats_.disconnects) {
+        stats_.last_recovery_ms = down_ms;
+        stats_.max_recovery_ms = std::max(stats_.max_recovery_ms, down_ms);
+        printf("Printer reconnected after %.1f s\n", down_ms / 1000);
+    } else {
+        printf("Printer connected\n");
+    }
+    printer_ = std::move(printer);
+    stats_.connected = true;
+    cv_.notify_all();
+    return true;
+}
+
+void PrinterSupervisor::SuperviseLoop()
+{
+    std::chrono::milliseconds backoff = options_.min_backoff;
+    bool connect_failed = false;
+
+    std::unique_lock<std::mutex> lock(mu_);
+    while (!stop_) {
+        if (printer_) {
+            /* Woken early if a print finds the link down. */
+            std::shared_ptr<PrinterInterface> printer = printer_;
+            if (cv_.wait_for(lock, options_.health_check_interval,
+                             [this, &printer] {
+                                 return stop_ || printer_ != printer;
+                             })) {
+                continue;
+            }
+            printer.reset();
+            lock.unlock();
+            PrinterStatus();
+            lock.lock();
+            continue;
+        }
+
+        lock.unlock();
+        if (connect_failed && !options_.rebind_command.empty()) {
+            int ret = system(options_.rebind_command.c_str());
+            DB_PRINT("%s returned %d\n", options_.rebind_command.c_str(), ret);
+            (void)ret;
+        }
+        /* The first try is straight away, most drops are brief. */
+        bool connected = TryConnect();
+        lock.lock();
+
+        if (connected) {
+            backoff = options_.min_backoff;
+            connect_failed = false;
+            continue;
+        }
+        connect_failed = true;
+        cv_.wait_for(lock, backoff, [this] { return stop_; });
+        backoff = std::min(backoff * 2, options_.max_backoff);
+    }
+}
+
+SupervisorStats PrinterSupervisor::Stats()
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return stats_;
+}
+
+std::string PrinterSupervisor::StatsString()
+{
+    SupervisorStats stats = Stats();
+
+    char buf[192];
+    snprintf(buf, sizeof(buf),
+             "Printer: %s, %" PRIu64 " drops, %" PRIu64 " connects tried, "
+             "last recovery %.1f s, max %.1f s, %" PRIu64 " prints held",
+             stats.connected ? "connected" : "disconnected", stats.disconnects,
+             stats.connect_attempts, stats.last_recovery_ms / 1000,
+             stats.max_recovery_ms / 1000, stats.prints_held);
+
+    /* The current link's, they start over when it's replaced. */
+    std::shared_ptr<PrinterInterface> printer;
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        printer = printer_;
+    }
+    std::string printer_stats = printer ? printer->StatsString() : "";
+    if (printer_stats.empty()) {
+        return buf;
+    }
+    return std::string(buf) + "\n" + printer_stats;
+}
+
+};
@@ -0,0 +1,81 @@
+#include "raster_cache.h"
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <utility>
+
+namespace sticker_bot {
+
+RasterCache::RasterCache(size_t capacity_bytes) :
+        capacity_bytes_(capacity_bytes),
+        bytes_(0),
+        hits_(0),
+        misses_(0),
+        evictions_(0) {}
+
+Raster RasterCache::Get(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+        misses_++;
+        return nullptr;
+    }
+
+    hits_++;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+}
+
+bool RasterCache::Contains(const std::string &key)
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return entries_.contains(key);
+}
+
+void RasterCache::Evict(size_t needed_bytes)
+{
+    while (!lru_.empty() && bytes_ + needed_bytes > capacity_bytes_) {
+        auto &[key, raster] = lru_.back();
+        bytes_ -= raster->size();
+        entries_.erase(key);
+        lru_.pop_back();
+        evictions_++;
+    }
+}
+
+void RasterCache::Put(const std::string &key, Raster raster)
+{
+    if (raster == nullptr || raster->size() > capacity_bytes_) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(mu_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+        bytes_ -= it->second->second->size();
+        lru_.erase(it->second);
+        entries_.erase(it);
+    }
+
+    Evict(raster->size());
+    bytes_ += raster->size();
+    lru_.emplace_front(key, std::move(raster));
+    entries_[key] = lru_.begin();
+}
+
+RasterCacheStats RasterCache::Stats()
+{
+    std::lock_guard<std::mutex> lock(mu_);
+    return RasterCacheStats{
+        .entries = entries_.size(),
+        .bytes = bytes_,
+        .capacity_bytes = capacity_bytes_,
+        .hits = hits_,
+        .misses = misses_,
+        .evictions = evictions_,
+    };
+}
+
+};
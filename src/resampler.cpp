@@ -0,0 +1,398 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace sticker_bot {
+
+static double Sinc(double x)
+{
+    if (x == 0.0) {
+        return 1.0;
+    }
+    x *= M_PI;
+    return sin(x) / x;
+}
+
+static double Lanczos3(double x)
+{
+    x = fabs(x);
+    return x < 3.0 ? Sinc(x) * Sinc(x / 3.0) : 0.0;
+}
+
+/* Mitchell-Netravali with B = C = 1/3. */
+static double Mitchell(double x)
+{
+    constexpr double kB = 1.0 / 3.0;
+    constexpr double kC = 1.0 / 3.0;
+
+    x = fabs(x);
+    if (x < 1.0) {
+        return ((12 - 9 * kB - 6 * kC) * x * x * x +
+                (-18 + 12 * kB + 6 * kC) * x * x +
+                (6 - 2 * kB)) / 6.0;
+    } else if (x < 2.0) {
+        return ((-kB - 6 * kC) * x * x * x +
+                (6 * kB + 30 * kC) * x * x +
+                (-12 * kB - 48 * kC) * x +
+                (8 * kB + 24 * kC)) / 6.0;
+    }
+    return 0.0;
+}
+
+static double Triangle(double x)
+{
+    x = fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+}
+
+static double FilterSupport(ResampleFilter filter)
+{
+    switch (filter) {
+    case ResampleFilter::kLanczos3:
+        return 3.0;
+    case ResampleFilter::kTriangle:
+        return 1.0;
+    case ResampleFilter::kMitchell:
+    default:
+        return 2.0;
+    }
+}
+
+static double FilterValue(ResampleFilter filter, double x)
+{
+    switch (filter) {
+    case ResampleFilter::kLanczos3:
+        return Lanczos3(x);
+    case ResampleFilter::kTriangle:
+        return Triangle(x);
+    case ResampleFilter::kMitchell:
+    default:
+        return Mitchell(x);
+    }
+}
+
+/* Divides by 255 with rounding, exact for v <= 255 * 255. */
+static inline uint32_t Div255(uint32_t v)
+{
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
+
+/* Rec. 601 luma in 8-bit fixed point. */
+static inline uint32_t Luma(const uint8_t *p)
+{
+    return (77 * p[0] + 150 * p[1] + 29 * p[2] + 128) >> 8;
+}
+
+/* Same as `-background white -flatten`. */
+static inline uint8_t FlattenOnWhite(uint32_t gray, uint32_t alpha)
+{
+    return Div255(gray * alpha + 0xff * (0xff - alpha));
+}
+
+template <uint8_t kChannels>
+static inline uint8_t GrayPixel(const uint8_t *p)
+{
+    if constexpr (kChannels == 1) {
+        return p[0];
+    } else if constexpr (kChannels == 2) {
+        return FlattenOnWhite(p[0], p[1]);
+    } else if constexpr (kChannels == 3) {
+        return Luma(p);
+    } else {
+        return FlattenOnWhite(Luma(p), p[3]);
+    }
+}
+
+template <uint8_t kChannels>
+static inline void GrayRowImpl(const uint8_t *p, ptrdiff_t x_step,
+                               uint32_t width, uint8_t *gray)
+{
+    for (uint32_t x = 0; x < width; x++, p += x_step) {
+        gray[x] = GrayPixel<kChannels>(p);
+    }
+}
+
+void Resampler::GrayRow(const ImageView &src, uint32_t y, uint8_t *gray)
+{
+    const uint8_t *p = src.pixel(0, y);
+
+    switch (src.channels) {
+    case 1:
+        GrayRowImpl<1>(p, src.x_step, src.width, gray);
+        break;
+    case 2:
+        GrayRowImpl<2>(p, src.x_step, src.width, gray);
+        break;
+    case 3:
+        GrayRowImpl<3>(p, src.x_step, src.width, gray);
+        break;
+    default:
+        GrayRowImpl<4>(p, src.x_step, src.width, gray);
+        break;
+    }
+}
+
+/*
+ * In a rotated view, walking along a row jumps a whole source row each step,
+ * but the same pixel of the next view row is right next to it. So go down a
+ * column of the tile instead, and scatter into the (small) gray tile.
+ */
+template <uint8_t kChannels>
+static inline void GrayTileImpl(const ImageView &src, uint32_t y,
+                                uint32_t rows, uint8_t *gray)
+{
+    for (uint32_t x = 0; x < src.width; x++) {
+        const uint8_t *p = src.pixel(x, y);
+        for (uint32_t r = 0; r < rows; r++, p += src.y_step) {
+            gray[static_cast<size_t>(r) * src.width + x] =
+                GrayPixel<kChannels>(p);
+        }
+    }
+}
+
+void Resampler::GrayTile(const ImageView &src, uint32_t y, uint32_t rows,
+                         uint8_t *gray)
+{
+    switch (src.channels) {
+    case 1:
+        GrayTileImpl<1>(src, y, rows, gray);
+        break;
+    case 2:
+        GrayTileImpl<2>(src, y, rows, gray);
+        break;
+    case 3:
+        GrayTileImpl<3>(src, y, rows, gray);
+        break;
+    default:
+        GrayTileImpl<4>(src, y, rows, gray);
+        break;
+    }
+}
+
+Resampler::FilterWeights Resampler::ComputeWeights(uint32_t src_size,
+                                                   uint32_t dst_size,
+                                                   ResampleFilter filter)
+{
+    FilterWeights fw;
+    fw.contributions.resize(dst_size);
+    fw.max_count = 0;
+
+    const double ratio = static_cast<double>(src_size) / dst_size;
+    /* When shrinking, stretch the filter so it covers every source pixel. */
+    const double scale = std::max(ratio, 1.0);
+    const double support = FilterSupport(filter) * scale;
+
+    std::vector<double> taps;
+    for (uint32_t i = 0; i < dst_size; i++) {
+        const double center = (i + 0.5) * ratio;
+        int64_t start = static_cast<int64_t>(floor(center - support));
+        int64_t end = static_cast<int64_t>(ceil(center + support));
+        start = std::max<int64_t>(start, 0);
+        end = std::min<int64_t>(end, src_size);
+
+        taps.clear();
+        double total = 0.0;
+        for (int64_t j = start; j < end; j++) {
+            double w = FilterValue(filter, (j + 0.5 - center) / scale);
+            taps.push_back(w);
+            total += w;
+        }
+
+        /* Drop zero taps at the edges so the inner loops stay short. */
+        size_t first = 0;
+        size_t last = taps.size();
+        while (first < last && taps[first] == 0.0) {
+            first++;
+        }
+        while (last > first && taps[last - 1] == 0.0) {
+            last--;
+        }
+        if (first == last || total == 0.0) {
+            /* Degenerate, just take the nearest pixel. */
+            int64_t nearest = std::min<int64_t>(
+                    static_cast<int64_t>(center), src_size - 1);
+            fw.contributions[i] = {static_cast<uint32_t>(nearest), 1,
+                    static_cast<uint32_t>(fw.weights.size())};
+            fw.weights.push_back(1 << kWeightBits);
+            fw.max_count = std::max<uint32_t>(fw.max_count, 1);
+            continue;
+        }
+
+        Contribution &c = fw.contributions[i];
+        c.start = start + first;
+        c.count = last - first;
+        c.weights = fw.weights.size();
+
+        /*
+         * Normalize to fixed point, then push the rounding error onto the
+         * largest tap so the weights sum to exactly 1.0.
+         */
+        int32_t sum = 0;
+        int16_t largest_weight = INT16_MIN;
+        size_t largest = c.weights;
+        for (size_t j = first; j < last; j++) {
+            int16_t w = static_cast<int16_t>(
+                    lround(taps[j] / total * (1 << kWeightBits)));
+            if (w > largest_weight) {
+                largest_weight = w;
+                largest = fw.weights.size();
+            }
+            fw.weights.push_back(w);
+            sum += w;
+        }
+        fw.weights[largest] += (1 << kWeightBits) - sum;
+        fw.max_count = std::max(fw.max_count, c.count);
+    }
+
+    return fw;
+}
+
+Resampler::Resampler(uint32_t src_width, uint32_t src_height,
+                     uint32_t dst_width, ResampleFilter filter) :
+        src_width_(src_width),
+        src_height_(src_height),
+        dst_width_(dst_width),
+        rows_pushed_(0),
+        next_dst_row_(0)
+{
+    /* Same rounding as `-resize 576x`. */
+    dst_height_ = std::max<uint32_t>(1, lround(static_cast<double>(src_height) *
+                                               dst_width / src_width));
+
+    horizontal_ = ComputeWeights(src_width_, dst_width_, filter);
+    vertical_ = ComputeWeights(src_height_, dst_height_, filter);
+
+    ring_rows_ = vertical_.max_count;
+    ring_.resize(static_cast<size_t>(ring_rows_) * dst_width_);
+    gray_row_.resize(src_width_);
+    accumulator_.resize(dst_width_);
+    out_.resize(static_cast<size_t>(dst_width_) * dst_height_);
+}
+
+void Resampler::HorizontalPass(const uint8_t *gray, int16_t *row) const
+{
+    constexpr uint32_t kShift = kWeightBits - kIntermediateBits;
+    constexpr int32_t kRound = 1 << (kShift - 1);
+
+    const Contribution *c = horizontal_.contributions.data();
+    const int16_t *weights = horizontal_.weights.data();
+    for (uint32_t x = 0; x < dst_width_; x++) {
+        const uint8_t *src = &gray[c[x].start];
+        const int16_t *w = &weights[c[x].weights];
+        int32_t sum = 0;
+        for (uint32_t k = 0; k < c[x].count; k++) {
+            sum += w[k] * src[k];
+        }
+        /* 8.14 down to 8.6. Lanczos can overshoot a bit, int16 has room. */
+        row[x] = (sum + kRound) >> kShift;
+    }
+}
+
+/*
+ * Every output pixel in a row uses the same source rows and weights, so this
+ * runs straight across the 576 dots. The loops work in fixed blocks of
+ * kLanes so the compiler turns them into SIMD even at -O2.
+ */
+void Resampler::VerticalPass(uint32_t dst_y)
+{
+    constexpr uint32_t kLanes = 16;
+    constexpr uint32_t kShift = kWeightBits + kIntermediateBits;
+    constexpr int32_t kRound = 1 << (kShift - 1);
+    constexpr int32_t kMax = 0xff;
+
+    const Contribution &c = vertical_.contributions[dst_y];
+    const int16_t *weights = &vertical_.weights[c.weights];
+    int32_t *__restrict acc = accumulator_.data();
+    const uint32_t width = dst_width_;
+    const uint32_t vector_width = width - width % kLanes;
+
+    std::fill(accumulator_.begin(), accumulator_.end(), kRound);
+    for (uint32_t k = 0; k < c.count; k++) {
+        const int32_t w = weights[k];
+        const int16_t *__restrict row =
+            &ring_[static_cast<size_t>((c.start + k) % ring_rows_) * width];
+        uint32_t x = 0;
+        for (; x < vector_width; x += kLanes) {
+            for (uint32_t j = 0; j < kLanes; j++) {
+                acc[x + j] += w * row[x + j];
+            }
+        }
+        for (; x < width; x++) {
+            acc[x] += w * row[x];
+        }
+    }
+
+    /* Clamp and negate in the same pass. */
+    uint8_t *__restrict out = &out_[static_cast<size_t>(dst_y) * width];
+    uint32_t x = 0;
+    for (; x < vector_width; x += kLanes) {
+        for (uint32_t j = 0; j < kLanes; j++) {
+            out[x + j] = kMax - std::clamp(acc[x + j] >> kShift, 0, kMax);
+        }
+    }
+    for (; x < width; x++) {
+        out[x] = kMax - std::clamp(acc[x] >> kShift, 0, kMax);
+    }
+}
+
+void Resampler::PushRow(const ImageView &src, uint32_t y)
+{
+    GrayRow(src, y, gray_row_.data());
+    PushGrayRow(gray_row_.data(), y);
+}
+
+void Resampler::PushScanline(const uint8_t *pixels, uint8_t channels)
+{
+    ImageView row = ImageView::FromBuffer(pixels, src_width_, 1, channels);
+    GrayRow(row, 0, gray_row_.data());
+    PushGrayRow(gray_row_.data(), rows_pushed_);
+}
+
+void Resampler::PushGrayRow(const uint8_t *gray, uint32_t y)
+{
+    HorizontalPass(gray,
+                   &ring_[static_cast<size_t>(y % ring_rows_) * dst_width_]);
+    rows_pushed_ = y + 1;
+
+    while (next_dst_row_ < dst_height_) {
+        const Contribution &c = vertical_.contributions[next_dst_row_];
+        if (c.start + c.count > rows_pushed_) {
+            break;
+        }
+        VerticalPass(next_dst_row_);
+        next_dst_row_++;
+    }
+}
+
+std::vector<uint8_t> Resampler::Resample(const ImageView &src,
+                                         uint32_t dst_width,
+                                         ResampleFilter filter)
+{
+    Resampler resampler(src.width, src.height, dst_width, filter);
+
+    /* Upright views are read along their rows already. */
+    if (std::abs(src.x_step) <= std::abs(src.y_step)) {
+        for (uint32_t y = 0; y < src.height; y++) {
+            resampler.PushRow(src, y);
+        }
+        return resampler.TakeOutput();
+    }
+
+    std::vector<uint8_t> tile(static_cast<size_t>(kTileRows) * src.width);
+    for (uint32_t y = 0; y < src.height; y += kTileRows) {
+        uint32_t rows = std::min(kTileRows, src.height - y);
+        GrayTile(src, y, rows, tile.data());
+        for (uint32_t r = 0; r < rows; r++) {
+            resampler.PushGrayRow(&tile[static_cast<size_t>(r) * src.width],
+                                  y + r);
+        }
+    }
+    return resampler.TakeOutput();
+}
+
+};
@@ -1,22 +1,38 @@
 #include "status.h"
 
 #include <iostream>
+#include <memory>
 #include <string>
 #include <string_view>
 
 namespace sticker_bot {
 
-void Status::prepend_message(std::string_view str)
+void Status::prepend_message(StaticMessage str)
 {
-    msg_.insert(0, str);
+    auto context = std::make_shared<Context>();
+    context->next = std::move(context_);
+    context->text = str.view();
+    context_ = std::move(context);
 }
 
-void Status::print_status()
+std::string Status::message() const
 {
-    std::cout << status_code_stringify(status_) << " " << msg_ << std::endl;
+    std::string msg;
+    for (const Context *context = context_.get(); context != nullptr;
+            context = context->next.get()) {
+        msg += context->text;
+    }
+    msg += msg_;
+    return msg;
+}
+
+void Status::print_status() const
+{
+    std::cout << status_code_stringify(status_) << " " << message()
+              << std::endl;
 }
 
-std::string Status::status_code_stringify(StatusCode status) {
+std::string_view Status::status_code_stringify(StatusCode status) {
     switch (status) {
     case StatusCode::kStatusOk:
         return "OK";
@@ -24,6 +40,12 @@ std::string Status::status_code_stringify(StatusCode status) {
         return "Internal error";
     case StatusCode::kInvalidArgument:
         return "Invalid argument";
+    case StatusCode::kTimeout:
+        return "Timeout";
+    case StatusCode::kNotFoundError:
+        return "Not found";
+    case StatusCode::kResourceExhausted:
+        return "Resource exhausted";
     default:
         return "Unknown";
     }
@@ -0,0 +1,432 @@
+#include "text_renderer.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <expected>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <stdio.h>
+
+#if defined(HAVE_FREETYPE)
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#endif
+
+#include "status.h"
+#include "utils.h"
+
+namespace sticker_bot {
+
+#if defined(HAVE_FREETYPE)
+
+/*
+ * Thresholds for coverage, so hinted glyphs, which are all 0 or 255, print as
+ * they are and scaled down color emoji are shaded instead of losing anything
+ * lighter than mid gray.
+ */
+static constexpr uint8_t kBayer4x4[4][4] = {
+    {8, 136, 40, 168},
+    {200, 72, 232, 104},
+    {56, 184, 24, 152},
+    {248, 120, 216, 88},
+};
+
+/* Invalid sequences come out as U+FFFD. */
+static std::u32string DecodeUtf8(std::string_view text)
+{
+    constexpr char32_t kReplacement = 0xfffd;
+    std::u32string codepoints;
+    codepoints.reserve(text.size());
+
+    for (size_t i = 0; i < text.size();) {
+        uint8_t lead = text[i];
+        size_t length;
+        char32_t c;
+        if (lead < 0x80) {
+            length = 1;
+            c = lead;
+        } else if ((lead & 0xe0) == 0xc0) {
+            length = 2;
+            c = lead & 0x1f;
+        } else if ((lead & 0xf0) == 0xe0) {
+            length = 3;
+            c = lead & 0x0f;
+        } else if ((lead & 0xf8) == 0xf0) {
+            length = 4;
+            c = lead & 0x07;
+        } else {
+            codepoints.push_back(kReplacement);
+            i++;
+            continue;
+        }
+
+        size_t j = 1;
+        for (; j < length && i + j < text.size() &&
+                (static_cast<uint8_t>(text[i + j]) & 0xc0) == 0x80; j++) {
+            c = (c << 6) | (text[i + j] & 0x3f);
+        }
+        codepoints.push_back(j == length ? c : kReplacement);
+        i += j;
+    }
+    return codepoints;
+}
+
+/* Characters that don't print, mostly ones that only matter when shaping. */
+static bool IsInvisible(char32_t c)
+{
+    return c == '\r' || c == 0x200b || c == 0x200c || c == 0x200d ||
+        c == 0xfe0e || c == 0xfe0f;
+}
+
+std::expected<std::unique_ptr<TextRenderer>, Status>
+    TextRenderer::Create(const TextOptions &options)
+{
+    FT_Library library;
+    if (FT_Init_FreeType(&library)) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to start FreeType"));
+    }
+
+    std::vector<FT_Face> faces;
+    FT_Face face;
+    if (FT_New_Face(library, options.font_path.c_str(), 0, &face)) {
+        FT_Done_FreeType(library);
+        return std::unexpected(Status(StatusCode::kNotFoundError,
+                                      "Failed to load the text font"));
+    }
+    faces.push_back(face);
+
+    for (const std::string &path : options.fallback_font_paths) {
+        if (FT_New_Face(library, path.c_str(), 0, &face)) {
+            DB_PRINT("No fallback font %s\n", path.c_str());
+            continue;
+        }
+        /* Color emoji fonts only come in a few sizes, use the biggest. */
+        if (!FT_IS_SCALABLE(face) && face->num_fixed_sizes > 0) {
+            int biggest = 0;
+            for (int i = 1; i < face->num_fixed_sizes; i++) {
+                if (face->available_sizes[i].height >
+                        face->available_sizes[biggest].height) {
+                    biggest = i;
+                }
+            }
+            FT_Select_Size(face, biggest);
+        }
+        faces.push_back(face);
+    }
+
+    return std::make_unique<TextRenderer>(library, std::move(faces), options);
+}
+
+TextRenderer::~TextRenderer()
+{
+    for (FT_Face face : faces_) {
+        FT_Done_Face(face);
+    }
+    FT_Done_FreeType(library_);
+}
+
+void TextRenderer::SetPixelSize(FT_Face face, uint32_t pixel_size)
+{
+    if (FT_IS_SCALABLE(face)) {
+        FT_Set_Pixel_Sizes(face, 0, pixel_size);
+    }
+}
+
+TextRenderer::Glyph TextRenderer::AddToAtlas(GlyphAtlas &atlas,
+                                             const std::vector<uint8_t> &bitmap,
+                                             uint32_t width, uint32_t rows)
+{
+    /* Only a huge glyph at kMaxPixelSize could be wider, it's cut off. */
+    uint32_t stride = width;
+    width = std::min(width, kAtlasWidth);
+    if (atlas.next_x + width > kAtlasWidth) {
+        atlas.next_y += atlas.row_height;
+        atlas.next_x = 0;
+        atlas.row_height = 0;
+    }
+
+    Glyph glyph = {
+        .x = atlas.next_x,
+        .y = atlas.next_y,
+        .width = width,
+        .rows = rows,
+        .left = 0,
+        .top = 0,
+        .advance = 0,
+    };
+    if (atlas.next_y + rows > atlas.rows) {
+        atlas.rows = atlas.next_y + rows;
+        atlas.coverage.resize(static_cast<size_t>(atlas.rows) * kAtlasWidth);
+    }
+    for (uint32_t y = 0; y < rows; y++) {
+        std::copy_n(&bitmap[static_cast<size_t>(y) * stride], width,
+                    &atlas.coverage[static_cast<size_t>(glyph.y + y) *
+                                    kAtlasWidth + glyph.x]);
+    }
+
+    atlas.next_x += width;
+    atlas.row_height = std::max(atlas.row_height, rows);
+    return glyph;
+}
+
+std::expected<const TextRenderer::Glyph *, Status>
+    TextRenderer::GetGlyph(GlyphAtlas &atlas, FT_Face face,
+                           uint32_t glyph_index, uint32_t pixel_size)
+{
+    auto it = atlas.glyphs.find(glyph_index);
+    if (it != atlas.glyphs.end()) {
+        return &it->second;
+    }
+
+    /*
+     * Outlines are hinted for 1 bit output, which keeps small text crisp.
+     * Bitmap fonts are scaled from their size to this one.
+     */
+    bool scalable = FT_IS_SCALABLE(face);
+    FT_Int32 flags = scalable ? FT_LOAD_RENDER | FT_LOAD_TARGET_MONO :
+        FT_LOAD_RENDER | FT_LOAD_COLOR;
+    if (FT_Load_Glyph(face, glyph_index, flags)) {
+        return std::unexpected(Status(StatusCode::kInternalError,
+                                      "Failed to render glyph"));
+    }
+    const FT_GlyphSlot slot = face->glyph;
+    const FT_Bitmap &source = slot->bitmap;
+    double scale = scalable || face->size->metrics.y_ppem == 0 ? 1.0 :
+        static_cast<double>(pixel_size) / face->size->metrics.y_ppem;
+
+    uint32_t width = std::lround(source.width * scale);
+    uint32_t rows = std::lround(source.rows * scale);
+    std::vector<uint8_t> bitmap(static_cast<size_t>(width) * rows);
+    for (uint32_t y = 0; y < rows; y++) {
+        const uint8_t *row = source.buffer +
+            std::min<uint32_t>(y / scale, source.rows - 1) * source.pitch;
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t sx = std::min<uint32_t>(x / scale, source.width - 1);
+            uint8_t value = 0;
+            if (source.pixel_mode == FT_PIXEL_MODE_MONO) {
+                value = (row[sx / 8] & (0x80 >> (sx & 7))) ? 255 : 0;
+            } else if (source.pixel_mode == FT_PIXEL_MODE_GRAY) {
+                value = row[sx];
+            } else if (source.pixel_mode == FT_PIXEL_MODE_BGRA) {
+                /* Premultiplied, so on white paper this is how dark it is. */
+                const uint8_t *bgra = &row[sx * 4];
+                uint32_t luma = (bgra[2] * 77 + bgra[1] * 150 +
+                                 bgra[0] * 29) >> 8;
+                value = bgra[3] > luma ? bgra[3] - luma : 0;
+            }
+            bitmap[static_cast<size_t>(y) * width + x] = value;
+        }
+    }
+
+    Glyph glyph = AddToAtlas(atlas, bitmap, width, rows);
+    glyph.left = std::lround(slot->bitmap_left * scale);
+    glyph.top = std::lround(slot->bitmap_top * scale);
+    glyph.advance = std::lround(slot->advance.x / 64.0 * scale);
+    return &(atlas.glyphs[glyph_index] = glyph);
+}
+
+std::expected<std::vector<uint8_t>, Status>
+    TextRenderer::Render(std::string_view text, uint32_t width,
+                         uint32_t pixel_size)
+{
+    typedef struct Placed {
+        const GlyphAtlas *atlas;
+        const Glyph *glyph;
+        /* Pen position from the start of the line. */
+        int32_t x;
+    } Placed;
+
+    if (width % 8 || width <= 2 * options_.margin) {
+        return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                      "Bad text width"));
+    }
+    if (pixel_size == 0) {
+        pixel_size = options_.pixel_size;
+    }
+    pixel_size = std::min(pixel_size, kMaxPixelSize);
+    const int32_t line_width = width - 2 * options_.margin;
+
+    std::lock_guard<std::mutex> lock(mu_);
+    for (FT_Face face : faces_) {
+        SetPixelSize(face, pixel_size);
+    }
+    const FT_Size_Metrics &metrics = faces_[0]->size->metrics;
+    const int32_t ascender = (metrics.ascender + 63) >> 6;
+    const int32_t line_height = (metrics.height + 63) >> 6;
+
+    /* Word wrapped, a word only being split if it's longer than a line. */
+    std::vector<std::vector<Placed>> lines(1);
+    int32_t pen = 0;
+    /* Where in the line the word being placed starts. */
+    size_t word_start = 0;
+    size_t prev_face = SIZE_MAX;
+    uint32_t prev_glyph = 0;
+    for (char32_t c : DecodeUtf8(text)) {
+        if (c == '\n') {
+            if (lines.size() >= options_.max_lines) {
+                break;
+            }
+            lines.emplace_back();
+            pen = 0;
+            word_start = 0;
+            prev_face = SIZE_MAX;
+            continue;
+        }
+        if (IsInvisible(c)) {
+            continue;
+        }
+        if (c == '\t') {
+            c = ' ';
+        }
+
+        /* Not in any of the fonts prints the main font's missing glyph box. */
+        size_t face_index = 0;
+        uint32_t glyph_index = 0;
+        for (size_t i = 0; i < faces_.size(); i++) {
+            glyph_index = FT_Get_Char_Index(faces_[i], c);
+            if (glyph_index != 0) {
+                face_index = i;
+                break;
+            }
+        }
+        FT_Face face = faces_[face_index];
+        GlyphAtlas &atlas = atlases_[{face_index, pixel_size}];
+        auto glyph = GetGlyph(atlas, face, glyph_index, pixel_size);
+        if (!glyph.has_value()) {
+            return std::unexpected(glyph.error());
+        }
+
+        int32_t kerning = 0;
+        if (face_index == prev_face && FT_HAS_KERNING(face)) {
+            FT_Vector delta;
+            if (!FT_Get_Kerning(face, prev_glyph, glyph_index,
+                                FT_KERNING_DEFAULT, &delta)) {
+                kerning = delta.x >> 6;
+            }
+        }
+        prev_face = face_index;
+        prev_glyph = glyph_index;
+
+        std::vector<Placed> *line = &lines.back();
+        if (c == ' ') {
+            /* Spaces where a line wrapped would only push it off center. */
+            if (!line->empty()) {
+                pen += kerning + (*glyph)->advance;
+                word_start = line->size();
+            }
+            continue;
+        }
+
+        int32_t x = pen + kerning;
+        if (x + (*glyph)->advance > line_width && !line->empty()) {
+            if (lines.size() >= options_.max_lines) {
+                break;
+            }
+            std::vector<Placed> next;
+            int32_t shift = x;
+            if (word_start > 0) {
+                /* Take the word so far onto the next line with this. */
+                if (word_start < line->size()) {
+                    shift = (*line)[word_start].x;
+                }
+                next.assign(line->begin() + word_start, line->end());
+                line->resize(word_start);
+                for (Placed &placed : next) {
+                    placed.x -= shift;
+                }
+            }
+            x -= shift;
+            lines.push_back(std::move(next));
+            line = &lines.back();
+            word_start = 0;
+        }
+        line->push_back({.atlas = &atlas, .glyph = *glyph, .x = x});
+        pen = x + (*glyph)->advance;
+    }
+
+    const uint32_t width_bytes = width / 8;
+    const int32_t rows = lines.size() * line_height;
+    std::vector<uint8_t> raster(static_cast<size_t>(rows) * width_bytes);
+    bool inked = false;
+    for (size_t l = 0; l < lines.size(); l++) {
+        if (lines[l].empty()) {
+            continue;
+        }
+
+        int32_t ink_left = INT32_MAX;
+        int32_t ink_right = INT32_MIN;
+        for (const Placed &placed : lines[l]) {
+            ink_left = std::min(ink_left, placed.x + placed.glyph->left);
+            ink_right = std::max(ink_right, placed.x + placed.glyph->left +
+                                 static_cast<int32_t>(placed.glyph->width));
+        }
+        int32_t offset = options_.margin +
+            (line_width - (ink_right - ink_left)) / 2 - ink_left;
+        int32_t baseline = l * line_height + ascender;
+
+        for (const Placed &placed : lines[l]) {
+            const Glyph &glyph = *placed.glyph;
+            const uint8_t *coverage = &placed.atlas->coverage[
+                static_cast<size_t>(glyph.y) * kAtlasWidth + glyph.x];
+            int32_t x0 = offset + placed.x + glyph.left;
+            int32_t y0 = baseline - glyph.top;
+            for (uint32_t r = 0; r < glyph.rows; r++) {
+                int32_t y = y0 + r;
+                if (y < 0 || y >= rows) {
+                    continue;
+                }
+                uint8_t *row = &raster[static_cast<size_t>(y) * width_bytes];
+                for (uint32_t c = 0; c < glyph.width; c++) {
+                    int32_t x = x0 + c;
+                    if (x < 0 || x >= static_cast<int32_t>(width)) {
+                        continue;
+                    }
+                    if (coverage[r * kAtlasWidth + c] >
+                            kBayer4x4[y & 3][x & 3]) {
+                        row[x / 8] |= 0x80 >> (x & 7);
+                        inked = true;
+                    }
+                }
+            }
+        }
+    }
+
+    if (!inked) {
+        return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                      "Nothing to print"));
+    }
+    return raster;
+}
+
+#else
+
+std::expected<std::unique_ptr<TextRenderer>, Status>
+    TextRenderer::Create(const TextOptions &options)
+{
+    (void)options;
+    return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                  "Built without FreeType"));
+}
+
+TextRenderer::~TextRenderer() {}
+
+std::expected<std::vector<uint8_t>, Status>
+    TextRenderer::Render(std::string_view text, uint32_t width,
+                         uint32_t pixel_size)
+{
+    (void)text;
+    (void)width;
+    (void)pixel_size;
+    return std::unexpected(Status(StatusCode::kInvalidArgument,
+                                  "Built without FreeType"));
+}
+
+#endif
+
+};
@@ -0,0 +1,141 @@
+#include "trim.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <vector>
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "resampler.h"
+
+namespace sticker_bot {
+
+/*
+ * Raises column_max to the row wherever the row is darker, and returns the
+ * row's maximum.
+ */
+static uint8_t ScanRow(const uint8_t *row, uint8_t *column_max, uint32_t width)
+{
+    uint32_t x = 0;
+    uint8_t row_max = 0;
+
+#if defined(__ARM_NEON)
+    uint8x16_t acc = vdupq_n_u8(0);
+    for (; x + 16 <= width; x += 16) {
+        uint8x16_t v = vld1q_u8(row + x);
+        vst1q_u8(column_max + x, vmaxq_u8(vld1q_u8(column_max + x), v));
+        acc = vmaxq_u8(acc, v);
+    }
+#if defined(__aarch64__)
+    row_max = vmaxvq_u8(acc);
+#else
+    uint8x8_t half = vpmax_u8(vget_low_u8(acc), vget_high_u8(acc));
+    half = vpmax_u8(half, half);
+    half = vpmax_u8(half, half);
+    half = vpmax_u8(half, half);
+    row_max = vget_lane_u8(half, 0);
+#endif
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row +
+                                                                      x));
+        __m128i *column = reinterpret_cast<__m128i *>(column_max + x);
+        _mm_storeu_si128(column, _mm_max_epu8(_mm_loadu_si128(column), v));
+        acc = _mm_max_epu8(acc, v);
+    }
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 4));
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 2));
+    acc = _mm_max_epu8(acc, _mm_srli_si128(acc, 1));
+    row_max = _mm_cvtsi128_si32(acc) & 0xff;
+#endif
+
+    /* What's left over, or everything without SIMD. */
+    for (; x < width; x++) {
+        column_max[x] = std::max(column_max[x], row[x]);
+        row_max = std::max(row_max, row[x]);
+    }
+    return row_max;
+}
+
+std::optional<ContentBox> FindContent(std::span<const uint8_t> gray,
+                                      uint32_t width, uint8_t tolerance)
+{
+    if (width == 0) {
+        return std::nullopt;
+    }
+    uint32_t height = gray.size() / width;
+
+    std::vector<uint8_t> column_max(width, 0);
+    ContentBox box = {.left = width, .top = height, .right = 0, .bottom = 0};
+    for (uint32_t y = 0; y < height; y++) {
+        if (ScanRow(&gray[static_cast<size_t>(y) * width], column_max.data(),
+                    width) > tolerance) {
+            box.top = std::min(box.top, y);
+            box.bottom = y + 1;
+        }
+    }
+    if (box.top >= box.bottom) {
+        return std::nullopt;
+    }
+
+    for (uint32_t x = 0; x < width; x++) {
+        if (column_max[x] > tolerance) {
+            box.left = std::min(box.left, x);
+            box.right = x + 1;
+        }
+    }
+    return box;
+}
+
+std::optional<ImageRegion> TrimRegion(const ContentBox &box, uint32_t width,
+                                      uint32_t height,
+                                      const TrimOptions &options)
+{
+    if (width == 0 || height == 0 || options.padding * 2 >= width) {
+        return std::nullopt;
+    }
+
+    /* Wide enough that the content fills all but the padding once scaled. */
+    double region_width = static_cast<double>(box.right - box.left) * width /
+        (width - options.padding * 2);
+    if (region_width >= width * options.redecode_below) {
+        return std::nullopt;
+    }
+    double left = std::clamp((box.left + box.right) / 2.0 - region_width / 2,
+                             0.0, width - region_width);
+
+    /* The padding, in dots of this image rather than the final one. */
+    double padding = options.padding * region_width / width;
+    double top = std::max(box.top - padding, 0.0);
+    double bottom = std::min(box.bottom + padding,
+                             static_cast<double>(height));
+    return ImageRegion{
+        .left = left / width,
+        .top = top / height,
+        .right = (left + region_width) / width,
+        .bottom = bottom / height,
+    };
+}
+
+void TrimRows(std::vector<uint8_t> &gray, uint32_t width,
+              const ContentBox &box, uint32_t padding)
+{
+    uint32_t height = gray.size() / width;
+    uint32_t top = box.top > padding ? box.top - padding : 0;
+    uint32_t bottom = std::min(box.bottom + padding, height);
+    if (top == 0 && bottom == height) {
+        return;
+    }
+
+    gray.resize(static_cast<size_t>(bottom) * width);
+    gray.erase(gray.begin(), gray.begin() + static_cast<size_t>(top) * width);
+}
+
+};
@@ -0,0 +1,145 @@
+/*
+ * A converter worker, started by ConverterPool. It is its own small program
+ * so that starting ImageMagick from here is cheap, where forking the bot
+ * would copy the page tables of everything it has mapped.
+ *
+ * Build with `make convert_worker`.
+ */
+
+#include <cstdint>
+#include <string>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "convert_worker.h"
+#include "status.h"
+
+extern char **environ;
+
+namespace sticker_bot {
+
+/* Runs convert with its stdout going straight into out. */
+static ConvertReply RunConvert(const std::string &path, int out)
+{
+    ConvertReply reply = {
+        .status = static_cast<int32_t>(StatusCode::kInternalError),
+        .exit_code = 0,
+        .size = 0,
+    };
+
+    /* Only convert the first frame of the image. */
+    std::string first_frame = path + "[0]";
+    /* Only decode, the bot's resampler does everything else. */
+    const char *argv[] = {
+        "convert", first_frame.c_str(), "-background", "white", "-flatten",
+        "-depth", "8", "ppm:-", NULL,
+    };
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, out, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, kConvertWorkerFd);
+
+    /*
+     * It stays in our process group, which the pool kills if it hangs, so it
+     * can't outlive us.
+     */
+    pid_t pid;
+    int ret = posix_spawnp(&pid, "convert", &actions, NULL,
+                           const_cast<char **>(argv), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (ret) {
+        fprintf(stderr, "convert_worker: failed to start convert: %s\n",
+                strerror(ret));
+        return reply;
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0) {}
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+        reply.exit_code = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : -1;
+        return reply;
+    }
+
+    struct stat st;
+    if (fstat(out, &st) || st.st_size == 0) {
+        return reply;
+    }
+    reply.status = static_cast<int32_t>(StatusCode::kStatusOk);
+    reply.size = st.st_size;
+    return reply;
+}
+
+static bool SendReply(const ConvertReply &reply, int fd)
+{
+    struct iovec iov = {
+        .iov_base = const_cast<ConvertReply *>(&reply),
+        .iov_len = sizeof(reply),
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+    }
+    return sendmsg(kConvertWorkerFd, &msg, MSG_NOSIGNAL) ==
+        static_cast<ssize_t>(sizeof(reply));
+}
+
+int real_main()
+{
+    char path[kMaxConvertPathLen];
+
+    while (true) {
+        ssize_t len = recv(kConvertWorkerFd, path, sizeof(path), 0);
+        if (len <= 0) {
+            /* The pool closed its end, so the bot is done with us. */
+            return 0;
+        }
+
+        int out = memfd_create("converted", MFD_CLOEXEC);
+        ConvertReply reply;
+        if (out < 0) {
+            reply = {
+                .status = static_cast<int32_t>(StatusCode::kInternalError),
+                .exit_code = 0,
+                .size = 0,
+            };
+        } else {
+            reply = RunConvert(std::string(path, len), out);
+        }
+
+        bool ok = reply.status == static_cast<int32_t>(StatusCode::kStatusOk);
+        bool sent = SendReply(reply, ok ? out : -1);
+        if (out >= 0) {
+            close(out);
+        }
+        if (!sent) {
+            return -1;
+        }
+    }
+}
+
+};
+
+int main()
+{
+    return sticker_bot::real_main();
+}
@@ -0,0 +1,63 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <stdio.h>
+
+namespace sticker_bot {
+
+WorkerPool::WorkerPool(uint32_t num_threads) :
+        stop_(false)
+{
+    num_threads = std::max<uint32_t>(num_threads, 1);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        workers_.emplace_back(&WorkerPool::WorkLoop, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto &worker : workers_) {
+        worker.join();
+    }
+}
+
+void WorkerPool::Submit(Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+void WorkerPool::WorkLoop()
+{
+    std::unique_lock<std::mutex> lock(mu_);
+    while (true) {
+        cv_.wait(lock, [&]() { return stop_ || !tasks_.empty(); });
+        if (stop_) {
+            return;
+        }
+
+        Task task = std::move(tasks_.front());
+        tasks_.pop_front();
+        lock.unlock();
+        try {
+            task();
+        } catch (std::exception &e) {
+            printf("Worker task threw: %s\n", e.what());
+        }
+        lock.lock();
+    }
+}
+
+};
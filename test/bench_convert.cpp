@@ -0,0 +1,132 @@
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "status.h"
+#include "converter_pool.h"
+
+#define DEFAULT_TEST_IMG "test.gif"
+#define DEFAULT_ITERATIONS 50
+/* About what the bot has mapped, with tgbot, Boost and OpenSSL loaded. */
+#define DEFAULT_BALLAST_MIB 64
+#define CONVERT_WORKER_PATH "./convert_worker.elf"
+
+namespace sticker_bot {
+
+/* What the bot did before the pool: popen() a shell, then read the file. */
+static bool ConvertWithPopen(const std::string &path)
+{
+    std::string out = path + ".ppm";
+    std::string cmd = "convert " + path + "[0] -background white -flatten "
+        "-depth 8 ppm:" + out;
+
+    FILE *f = popen(cmd.c_str(), "r");
+    if (f == NULL) {
+        return false;
+    }
+    char buf[256];
+    while (fgets(buf, sizeof(buf), f) != NULL) {}
+    if (pclose(f)) {
+        return false;
+    }
+
+    f = fopen(out.c_str(), "rb");
+    if (f == NULL) {
+        return false;
+    }
+    std::vector<uint8_t> data;
+    size_t num_read;
+    while ((num_read = fread(buf, 1, sizeof(buf), f)) > 0) {
+        data.insert(data.end(), buf, buf + num_read);
+    }
+    fclose(f);
+    remove(out.c_str());
+    return !data.empty();
+}
+
+int real_main(int argc, char *argv[])
+{
+    std::string img_path = DEFAULT_TEST_IMG;
+    uint32_t iterations = DEFAULT_ITERATIONS;
+    size_t ballast_mib = DEFAULT_BALLAST_MIB;
+    if (argc >= 2) {
+        img_path = argv[1];
+    }
+    if (argc >= 3) {
+        iterations = strtoul(argv[2], NULL, 10);
+    }
+    if (argc >= 4) {
+        ballast_mib = strtoul(argv[3], NULL, 10);
+    }
+
+    /* fork() cost grows with what's mapped, so map as much as the bot. */
+    std::vector<uint8_t> ballast(ballast_mib << 20);
+    memset(ballast.data(), 1, ballast.size());
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++) {
+        if (!ConvertWithPopen(img_path)) {
+            printf("popen convert failed\n");
+            return -1;
+        }
+    }
+    double popen_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count() / iterations;
+    printf("popen:         %.2f ms per image (%zu MiB mapped)\n", popen_ms,
+           ballast_mib);
+
+    auto pool_or = ConverterPool::Create(CONVERT_WORKER_PATH, 0);
+    if (!pool_or.has_value()) {
+        pool_or.error().print_status();
+        return -1;
+    }
+    std::unique_ptr<ConverterPool> pool = std::move(*pool_or);
+
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++) {
+        auto image = pool->Convert(img_path);
+        if (!image.has_value()) {
+            image.error().print_status();
+            return -1;
+        }
+    }
+    double pool_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count() / iterations;
+    printf("pool:          %.2f ms per image (%.1fx)\n", pool_ms,
+           popen_ms / pool_ms);
+
+    /* Every worker busy at once, like a burst of stickers. */
+    start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < pool->num_workers(); t++) {
+        threads.emplace_back([&, t]() {
+            for (uint32_t i = t; i < iterations; i += pool->num_workers()) {
+                pool->Convert(img_path);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    double parallel_ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count() / iterations;
+    printf("pool, %zu busy: %.2f ms per image (%.1fx)\n", pool->num_workers(),
+           parallel_ms, popen_ms / parallel_ms);
+    printf("%lu worker restarts\n",
+           static_cast<unsigned long>(pool->restarts()));
+
+    return 0;
+}
+
+};
+
+int main(int argc, char *argv[])
+{
+    return sticker_bot::real_main(argc, argv);
+}
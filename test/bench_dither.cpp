@@ -0,0 +1,142 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "dither.h"
+#include "image_decoder.h"
+#include "levels.h"
+#include "png_encoder.h"
+#include "status.h"
+#include "trim.h"
+#include "utils.h"
+
+#define IMAGE_WIDTH 576
+#define DEFAULT_ITERATIONS 10
+
+namespace sticker_bot {
+
+static const DitherAlgorithm kAlgorithms[] = {
+    DitherAlgorithm::kAtkinson, DitherAlgorithm::kFloydSteinberg,
+    DitherAlgorithm::kJarvisJudiceNinke, DitherAlgorithm::kStucki,
+    DitherAlgorithm::kBurkes, DitherAlgorithm::kSierra,
+    DitherAlgorithm::kSierraTwoRow, DitherAlgorithm::kSierraLite,
+    DitherAlgorithm::kOrdered, DitherAlgorithm::kThreshold,
+};
+
+static double MsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * The CPU heavy part of printing a sticker: decode and resample, levels, then
+ * each dither. It's also what make release-pgo trains on.
+ */
+int real_main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        printf("Usage: %s <Iterations> <JPEG/PNG/WebP image>...\n", argv[0]);
+        return -1;
+    }
+    uint32_t iterations = strtoul(argv[1], NULL, 10);
+    if (iterations == 0) {
+        iterations = DEFAULT_ITERATIONS;
+    }
+
+    double decode_ms = 0;
+    double dither_ms[ARRAY_SIZE(kAlgorithms)] = {};
+    double preview_ms = 0;
+    double trim_ms = 0;
+    uint32_t num_images = 0;
+
+    for (int i = 2; i < argc; i++) {
+        std::vector<uint8_t> gray;
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t n = 0; n < iterations; n++) {
+            auto decoded = DecodeImage(argv[i], IMAGE_WIDTH);
+            if (!decoded.has_value()) {
+                printf("Skipping %s: ", argv[i]);
+                decoded.error().print_status();
+                break;
+            }
+            gray = std::move(*decoded);
+            AutoLevels(gray);
+        }
+        if (gray.empty()) {
+            continue;
+        }
+        decode_ms += MsSince(start);
+        num_images++;
+
+        /* The scan for blank borders, without the decode it might redo. */
+        start = std::chrono::steady_clock::now();
+        for (uint32_t n = 0; n < iterations; n++) {
+            auto box = FindContent(gray, IMAGE_WIDTH,
+                                   kDefaultTrimOptions.tolerance);
+            if (!box.has_value()) {
+                printf("%s is blank\n", argv[i]);
+                break;
+            }
+        }
+        trim_ms += MsSince(start);
+
+        /* Dithering works in place, so each run gets a fresh copy. */
+        std::vector<uint8_t> raster;
+        for (size_t a = 0; a < ARRAY_SIZE(kAlgorithms); a++) {
+            start = std::chrono::steady_clock::now();
+            for (uint32_t n = 0; n < iterations; n++) {
+                std::vector<uint8_t> copy = gray;
+                std::vector<uint8_t> dithered = RasterDither(
+                        copy, IMAGE_WIDTH, kAlgorithms[a],
+                        (n & 1) ? ScanOrder::kSerpentine : ScanOrder::kRaster);
+                if (a == 0) {
+                    raster = std::move(dithered);
+                }
+            }
+            dither_ms[a] += MsSince(start);
+        }
+
+        /* Atkinson's, the default, as /preview sends it back. */
+        start = std::chrono::steady_clock::now();
+        for (uint32_t n = 0; n < iterations; n++) {
+            auto png = EncodeRasterPng(raster, IMAGE_WIDTH / 8);
+            if (!png.has_value()) {
+                png.error().print_status();
+                break;
+            }
+        }
+        preview_ms += MsSince(start);
+    }
+
+    if (num_images == 0) {
+        printf("No images could be decoded\n");
+        return -1;
+    }
+
+    uint32_t runs = num_images * iterations;
+    double total_ms = decode_ms + trim_ms;
+    printf("%u images, %u iterations each\n", num_images, iterations);
+    printf("  %-16s %7.2f ms/image\n", "decode+levels", decode_ms / runs);
+    printf("  %-16s %7.2f ms/image\n", "find content", trim_ms / runs);
+    for (size_t a = 0; a < ARRAY_SIZE(kAlgorithms); a++) {
+        printf("  %-16s %7.2f ms/image\n",
+               std::string(DitherAlgorithmName(kAlgorithms[a])).c_str(),
+               dither_ms[a] / runs);
+        total_ms += dither_ms[a];
+    }
+    printf("  %-16s %7.2f ms/image\n", "preview png", preview_ms / runs);
+    total_ms += preview_ms;
+    printf("  %-16s %7.1f ms\n", "total", total_ms);
+    return 0;
+}
+
+};
+
+int main(int argc, char *argv[])
+{
+    return sticker_bot::real_main(argc, argv);
+}
@@ -0,0 +1,105 @@
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "status.h"
+#include "job_journal.h"
+#include "print_job.h"
+
+#define DEFAULT_JOURNAL_PATH "bench.journal"
+#define DEFAULT_NUM_JOBS 100000
+#define DEFAULT_NUM_THREADS 4
+
+namespace sticker_bot {
+
+/* A real Telegram file ID is about this long. */
+static const std::string kFileId =
+    "CAACAgIAAxkBAAIBZ2V4c3RpY2tlcl9maWxlX2lkX2Zvcl9iZW5jaG1hcmsAAg";
+
+int real_main(int argc, char *argv[])
+{
+    std::string journal_path = DEFAULT_JOURNAL_PATH;
+    uint32_t num_jobs = DEFAULT_NUM_JOBS;
+    uint32_t num_threads = DEFAULT_NUM_THREADS;
+    if (argc >= 2) {
+        num_jobs = strtoul(argv[1], NULL, 10);
+    }
+    if (argc >= 3) {
+        num_threads = strtoul(argv[2], NULL, 10);
+    }
+    remove(journal_path.c_str());
+
+    auto journal_or = JobJournal::Open(journal_path);
+    if (!journal_or.has_value()) {
+        journal_or.error().print_status();
+        return -1;
+    }
+    std::unique_ptr<JobJournal> journal = std::move(*journal_or);
+
+    /* Queue every job, and finish every other one. */
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&, t]() {
+            for (uint32_t i = t; i < num_jobs; i += num_threads) {
+                PrintJob job = {
+                    .id = 0,
+                    .chat_id = -1001234567890 - t,
+                    .file_id = kFileId,
+                    .options = kDefaultPrintOptions,
+                };
+                journal->Append(job);
+                if (i % 2) {
+                    journal->MarkDone(job.id);
+                }
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    Status status = journal->Sync();
+    auto end = std::chrono::steady_clock::now();
+    if (!status.Ok()) {
+        status.print_status();
+        return -1;
+    }
+
+    double secs = std::chrono::duration<double>(end - start).count();
+    uint64_t records = journal->records_written();
+    printf("Appended %u jobs from %u threads in %.3f s\n", num_jobs,
+           num_threads, secs);
+    printf("  %.0f jobs/s, %.0f records/s, %.2f us/record\n", num_jobs / secs,
+           records / secs, secs * 1e6 / records);
+    printf("  %lu syncs, %.1f records per sync\n",
+           static_cast<unsigned long>(journal->syncs()),
+           static_cast<double>(records) / journal->syncs());
+    journal.reset();
+
+    /* Replay, which also compacts. */
+    start = std::chrono::steady_clock::now();
+    journal_or = JobJournal::Open(journal_path);
+    end = std::chrono::steady_clock::now();
+    if (!journal_or.has_value()) {
+        journal_or.error().print_status();
+        return -1;
+    }
+    size_t unfinished = (*journal_or)->TakeUnfinished().size();
+    printf("Replayed %zu unfinished jobs in %.3f s\n", unfinished,
+           std::chrono::duration<double>(end - start).count());
+
+    journal_or->reset();
+    remove(journal_path.c_str());
+    return 0;
+}
+
+};
+
+int main(int argc, char *argv[])
+{
+    return sticker_bot::real_main(argc, argv);
+}
@@ -0,0 +1,157 @@
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <string>
+#include <string_view>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "status.h"
+
+#define DEFAULT_ITERATIONS 10000000
+
+/* Every heap allocation in the process, to see which paths make any. */
+static std::atomic<uint64_t> num_allocations = 0;
+
+void *operator new(size_t size)
+{
+    num_allocations.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size ? size : 1);
+    if (p == NULL) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+namespace sticker_bot {
+
+/* Status as it was, two std::strings and prepending with insert(). */
+class LegacyStatus {
+  public:
+    LegacyStatus(StatusCode status, std::string_view msg) :
+        status_(status),
+        msg_(msg),
+        user_friendly_msg_("") {}
+    LegacyStatus(StatusCode status) : LegacyStatus(status, "") {}
+
+    void prepend_message(std::string_view str) { msg_.insert(0, str); }
+    bool Ok() { return status_ == StatusCode::kStatusOk; }
+
+  private:
+    StatusCode status_;
+    std::string msg_;
+    std::string user_friendly_msg_;
+};
+
+/*
+ * The shape of M02Pro::PrintImage(): a command that can fail, checked with
+ * RETURN_IF_ERROR a couple of levels up, with context added on the way.
+ */
+template <typename S>
+[[gnu::noinline]] static S SendCmd(bool fail)
+{
+    if (fail) {
+        return S(StatusCode::kInternalError, "Failed to send data");
+    }
+    return S(StatusCode::kStatusOk);
+}
+
+template <typename S>
+[[gnu::noinline]] static S PrintRasterImage(bool fail)
+{
+    RETURN_IF_ERROR(SendCmd<S>(false));
+    S status = SendCmd<S>(fail);
+    if (!status.Ok()) {
+        status.prepend_message("Failed to send raster image");
+        return status;
+    }
+    return S(StatusCode::kStatusOk);
+}
+
+template <typename S>
+[[gnu::noinline]] static S PrintImage(bool fail)
+{
+    RETURN_IF_ERROR(PrintRasterImage<S>(fail));
+    RETURN_IF_ERROR(SendCmd<S>(false));
+    return S(StatusCode::kStatusOk);
+}
+
+/* Like wrapping an exception, the message isn't known until runtime. */
+template <typename S>
+[[gnu::noinline]] static S FromException(const char *what)
+{
+    return S(StatusCode::kNotFoundError, std::string_view(what));
+}
+
+template <typename Fn>
+static void Bench(const char *name, uint32_t iterations, Fn fn)
+{
+    uint64_t allocations = num_allocations;
+    uint64_t failures = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++) {
+        failures += !fn();
+    }
+    double ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+    allocations = num_allocations - allocations;
+
+    printf("  %-32s %6.1f ns/call, %4.2f allocations/call (%lu failed)\n",
+           name, ns / iterations,
+           static_cast<double>(allocations) / iterations,
+           static_cast<unsigned long>(failures));
+}
+
+int real_main(int argc, char *argv[])
+{
+    uint32_t iterations = DEFAULT_ITERATIONS;
+    if (argc >= 2) {
+        iterations = strtoul(argv[1], NULL, 10);
+    }
+    /* A real what() is usually longer than std::string's inline buffer. */
+    const char *what = "HTTP 404 from api.telegram.org: file not found";
+
+    printf("%u calls each\n", iterations);
+    printf("Status:\n");
+    Bench("print, succeeds", iterations, [] {
+        return PrintImage<Status>(false).Ok();
+    });
+    Bench("print, fails", iterations, [] {
+        return PrintImage<Status>(true).Ok();
+    });
+    Bench("error from runtime message", iterations, [what] {
+        return FromException<Status>(what).Ok();
+    });
+
+    printf("Legacy two-string status:\n");
+    Bench("print, succeeds", iterations, [] {
+        return PrintImage<LegacyStatus>(false).Ok();
+    });
+    Bench("print, fails", iterations, [] {
+        return PrintImage<LegacyStatus>(true).Ok();
+    });
+    Bench("error from runtime message", iterations, [what] {
+        return FromException<LegacyStatus>(what).Ok();
+    });
+
+    return 0;
+}
+
+};
+
+int main(int argc, char *argv[])
+{
+    return sticker_bot::real_main(argc, argv);
+}
@@ -0,0 +1,317 @@
+#!/usr/bin/env python3
+"""
+A stand-in for api.telegram.org, for load testing the whole bot.
+
+Serves getUpdates, getFile and file downloads from a directory of fixture
+stickers, photos and webms. Updates arrive at a configurable rate, with an
+optional burst up front. When it's done (or on Ctrl-C), it prints how long
+each step on Telegram's side of the job took. See README.md for how to use it
+with test/load_bot.cpp.
+"""
+
+import argparse
+import json
+import os
+import random
+import ssl
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+STICKER_EXTENSIONS = (".webp", ".webm", ".tgs")
+PHOTO_EXTENSIONS = (".jpg", ".jpeg", ".png")
+
+
+class UpdateLog:
+    """Everything sent to the bot, and when it asked for each part."""
+
+    def __init__(self):
+        self.cv = threading.Condition()
+        self.updates = []
+        # file_id -> [update_id, fixture path, created, delivered, getFile,
+        #             downloaded]
+        self.files = {}
+        self.messages_sent = 0
+        self.bytes_served = 0
+
+    def add(self, update, file_id, path):
+        with self.cv:
+            self.updates.append(update)
+            self.files[file_id] = [update["update_id"], path, time.monotonic(),
+                                   None, None, None]
+            self.cv.notify_all()
+
+    def take(self, offset, limit, timeout):
+        deadline = time.monotonic() + timeout
+        with self.cv:
+            while True:
+                pending = [u for u in self.updates if u["update_id"] >= offset]
+                if pending or time.monotonic() >= deadline:
+                    break
+                self.cv.wait(deadline - time.monotonic())
+
+            pending = pending[:limit]
+            now = time.monotonic()
+            for update in pending:
+                file_id = update["file_id"]
+                if self.files[file_id][3] is None:
+                    self.files[file_id][3] = now
+            return [u["update"] for u in pending]
+
+    def mark(self, file_id, stage):
+        with self.cv:
+            if file_id in self.files and self.files[file_id][stage] is None:
+                self.files[file_id][stage] = time.monotonic()
+
+
+def make_update(update_id, chat_id, path, unique_id=None):
+    file_id = "load-%d" % update_id
+    # Telegram gives every copy of a file its own file_id, but the same
+    # file_unique_id.
+    unique_id = unique_id or file_id
+    name = os.path.basename(path)
+    size = os.path.getsize(path)
+    message = {
+        "message_id": update_id,
+        "date": int(time.time()),
+        "chat": {"id": chat_id, "type": "private"},
+        "from": {"id": chat_id, "is_bot": False, "first_name": "Load"},
+    }
+
+    ext = os.path.splitext(name)[1].lower()
+    if ext in STICKER_EXTENSIONS:
+        message["sticker"] = {
+            "file_id": file_id, "file_unique_id": unique_id, "type": "regular",
+            "width": 512, "height": 512, "is_animated": ext == ".tgs",
+            "is_video": ext == ".webm", "file_size": size,
+        }
+    elif ext in PHOTO_EXTENSIONS:
+        # The real sizes aren't known, so make every size the fixture itself.
+        message["photo"] = [{
+            "file_id": file_id, "file_unique_id": unique_id, "width": w,
+            "height": h, "file_size": size * w // 1280,
+        } for w, h in ((90, 68), (320, 240), (800, 600), (1280, 960))]
+    else:
+        message["document"] = {
+            "file_id": file_id, "file_unique_id": unique_id, "file_name": name,
+            "file_size": size,
+        }
+
+    return {
+        "update_id": update_id,
+        "file_id": file_id,
+        "update": {"update_id": update_id, "message": message},
+    }
+
+
+def generate_updates(log, args, fixtures, done):
+    rng = random.Random(args.seed)
+    update_id = 1
+    last = None
+
+    def send():
+        nonlocal update_id, last
+        chat_id = rng.randrange(args.chats) + 1
+        if last and rng.random() < args.duplicates:
+            # Someone else sending the sticker that was just sent.
+            path, unique_id = last
+        else:
+            path, unique_id = rng.choice(fixtures), None
+        update = make_update(update_id, chat_id, path, unique_id)
+        log.add(update, update["file_id"], path)
+        last = (path, unique_id or update["file_id"])
+        update_id += 1
+
+    for _ in range(args.burst):
+        send()
+
+    start = time.monotonic()
+    while time.monotonic() - start < args.duration:
+        # Poisson arrivals, like real people rather than a metronome.
+        if args.rate > 0:
+            time.sleep(rng.expovariate(args.rate))
+            send()
+        else:
+            time.sleep(0.1)
+    done.set()
+
+
+def make_handler(log, args):
+    class Handler(BaseHTTPRequestHandler):
+        protocol_version = "HTTP/1.1"
+
+        def log_message(self, format, *log_args):
+            if args.verbose:
+                super().log_message(format, *log_args)
+
+        def reply(self, body, content_type="application/json"):
+            if isinstance(body, str):
+                body = body.encode()
+            self.send_response(200)
+            self.send_header("Content-Type", content_type)
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def ok(self, result):
+            self.reply(json.dumps({"ok": True, "result": result}))
+
+        def params(self):
+            url = urllib.parse.urlparse(self.path)
+            params = dict(urllib.parse.parse_qsl(url.query))
+            length = int(self.headers.get("Content-Length", 0))
+            body = self.rfile.read(length) if length else b""
+            content_type = self.headers.get("Content-Type", "")
+            if content_type.startswith("application/json"):
+                params.update(json.loads(body or b"{}"))
+            elif body:
+                params.update(urllib.parse.parse_qsl(body.decode()))
+            return url.path, params
+
+        def do_GET(self):
+            self.handle_request()
+
+        def do_POST(self):
+            self.handle_request()
+
+        def handle_request(self):
+            path, params = self.params()
+            parts = path.strip("/").split("/")
+
+            # /file/bot<token>/<file_path>
+            if len(parts) >= 3 and parts[0] == "file":
+                file_id = parts[-1]
+                with log.cv:
+                    entry = log.files.get(file_id)
+                if entry is None:
+                    self.send_error(404)
+                    return
+                with open(entry[1], "rb") as f:
+                    data = f.read()
+                self.reply(data, "application/octet-stream")
+                log.mark(file_id, 5)
+                with log.cv:
+                    log.bytes_served += len(data)
+                return
+
+            # /bot<token>/<method>
+            method = parts[-1] if parts else ""
+            if method == "getMe":
+                self.ok({"id": 1, "is_bot": True, "first_name": "Load Test",
+                         "username": "load_test_bot"})
+            elif method == "getUpdates":
+                updates = log.take(int(params.get("offset", 0)),
+                                   int(params.get("limit", 100)),
+                                   float(params.get("timeout", 0)))
+                self.ok(updates)
+            elif method == "getFile":
+                file_id = params.get("file_id", "")
+                log.mark(file_id, 4)
+                self.ok({"file_id": file_id, "file_unique_id": file_id,
+                         "file_path": "files/" + file_id})
+            elif method == "sendMessage":
+                with log.cv:
+                    log.messages_sent += 1
+                self.ok({"message_id": 1, "date": int(time.time()),
+                         "chat": {"id": int(params.get("chat_id", 0)),
+                                  "type": "private"},
+                         "text": params.get("text", "")})
+            else:
+                # setWebhook, deleteWebhook and anything else.
+                self.ok(True)
+
+    return Handler
+
+
+def percentiles(values):
+    if not values:
+        return "n/a"
+    values = sorted(values)
+    return "p50 %.0f ms, p95 %.0f ms, max %.0f ms" % (
+        values[len(values) // 2] * 1000,
+        values[len(values) * 95 // 100] * 1000, values[-1] * 1000)
+
+
+def report(log, elapsed):
+    with log.cv:
+        entries = list(log.files.values())
+        messages_sent = log.messages_sent
+        bytes_served = log.bytes_served
+
+    delivered = [e for e in entries if e[3] is not None]
+    fetched = [e for e in entries if e[4] is not None]
+    downloaded = [e for e in entries if e[5] is not None]
+
+    print("\nSent %d updates in %.1f s" % (len(entries), elapsed))
+    print("  %d delivered, %d getFile, %d downloaded (%.2f/s, %d KiB)" % (
+        len(delivered), len(fetched), len(downloaded),
+        len(downloaded) / elapsed, bytes_served // 1024))
+    print("  %d messages sent back by the bot" % messages_sent)
+    print("Created -> delivered: " +
+          percentiles([e[3] - e[2] for e in delivered]))
+    print("Delivered -> getFile: " +
+          percentiles([e[4] - e[3] for e in fetched if e[3] is not None]))
+    print("getFile -> downloaded: " +
+          percentiles([e[5] - e[4] for e in downloaded if e[4] is not None]))
+    print("Created -> downloaded: " +
+          percentiles([e[5] - e[2] for e in downloaded]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("fixtures",
+                        help="directory of stickers, photos and webms to send")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=8081)
+    parser.add_argument("--tls-cert", help="serve HTTPS with this cert")
+    parser.add_argument("--tls-key", help="and this key")
+    parser.add_argument("--rate", type=float, default=1.0,
+                        help="updates per second after the burst")
+    parser.add_argument("--burst", type=int, default=0,
+                        help="updates to send all at once at the start")
+    parser.add_argument("--duration", type=float, default=60,
+                        help="seconds to keep sending updates for")
+    parser.add_argument("--chats", type=int, default=5,
+                        help="how many chats the updates come from")
+    parser.add_argument("--duplicates", type=float, default=0,
+                        help="chance an update repeats the last file sent")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--verbose", action="store_true")
+    args = parser.parse_args()
+
+    fixtures = sorted(os.path.join(args.fixtures, f)
+                      for f in os.listdir(args.fixtures)
+                      if os.path.isfile(os.path.join(args.fixtures, f)))
+    if not fixtures:
+        parser.error("no fixtures in " + args.fixtures)
+
+    log = UpdateLog()
+    server = ThreadingHTTPServer((args.host, args.port),
+                                 make_handler(log, args))
+    server.daemon_threads = True
+    scheme = "http"
+    if args.tls_cert:
+        context = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        context.load_cert_chain(args.tls_cert, args.tls_key)
+        server.socket = context.wrap_socket(server.socket, server_side=True)
+        scheme = "https"
+    threading.Thread(target=server.serve_forever, daemon=True).start()
+    print("Serving %d fixtures at %s://%s:%d" % (len(fixtures), scheme,
+                                                  args.host, args.port))
+
+    done = threading.Event()
+    start = time.monotonic()
+    threading.Thread(target=generate_updates,
+                     args=(log, args, fixtures, done), daemon=True).start()
+    try:
+        done.wait()
+        # Give the bot a moment to fetch what was sent last.
+        time.sleep(5)
+    except KeyboardInterrupt:
+        pass
+    report(log, time.monotonic() - start)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,143 @@
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <thread>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "status.h"
+#include "printer_interface.h"
+#include "bot.h"
+
+/* The fake API server doesn't check it. */
+#define LOAD_TEST_TOKEN "123456:load-test"
+#define DEFAULT_DURATION_SECS 60
+/* Roughly what an M02 Pro feeds at. */
+#define DEFAULT_ROWS_PER_SEC 300
+
+namespace sticker_bot {
+
+/* Takes as long as the real printer would, but prints nothing. */
+class FakePrinter : public PrinterInterface {
+  public:
+    explicit FakePrinter(uint32_t rows_per_sec) :
+        rows_per_sec_(rows_per_sec) {}
+
+    Status PrintImage(std::span<const uint8_t> data, uint16_t width) override
+    {
+        uint64_t rows = data.size() / (width / 8);
+        std::this_thread::sleep_for(std::chrono::microseconds(
+                rows * 1000000 / rows_per_sec_));
+        prints_++;
+        rows_printed_ += rows;
+        return Status(StatusCode::kStatusOk);
+    }
+
+    Status PrinterStatus() override
+    {
+        return Status(StatusCode::kStatusOk);
+    }
+
+    uint64_t prints() { return prints_; }
+    uint64_t rows_printed() { return rows_printed_; }
+
+  private:
+    const uint32_t rows_per_sec_;
+    std::atomic<uint64_t> prints_ = 0;
+    std::atomic<uint64_t> rows_printed_ = 0;
+};
+
+/* Reads a "Name:   value kB" line from /proc/self/status. */
+static uint64_t ProcStatusValue(const char *name)
+{
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return 0;
+    }
+
+    char line[256];
+    uint64_t value = 0;
+    size_t name_len = strlen(name);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (!strncmp(line, name, name_len) && line[name_len] == ':') {
+            value = strtoull(&line[name_len + 1], NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+int real_main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf("Usage: %s <API URL> [Duration (s)] [Printer rows/s]\n",
+               argv[0]);
+        printf("Run test/fake_telegram.py first, see README.md\n");
+        return -1;
+    }
+    uint32_t duration_secs = DEFAULT_DURATION_SECS;
+    uint32_t rows_per_sec = DEFAULT_ROWS_PER_SEC;
+    if (argc >= 3) {
+        duration_secs = strtoul(argv[2], NULL, 10);
+    }
+    if (argc >= 4) {
+        rows_per_sec = strtoul(argv[3], NULL, 10);
+    }
+
+    BotOptions options = kDefaultBotOptions;
+    options.api_url = argv[1];
+
+    auto fake_printer = std::make_unique<FakePrinter>(rows_per_sec);
+    FakePrinter *printer = fake_printer.get();
+    /* No journal, a load test shouldn't leave jobs behind. */
+    Bot bot(LOAD_TEST_TOKEN, std::move(fake_printer), nullptr, options);
+    bot.InitBot();
+
+    /* RunBot() never returns unless it fails. */
+    std::thread bot_thread([&bot]() {
+        Status status = bot.RunBot();
+        status.print_status();
+        exit(-1);
+    });
+    bot_thread.detach();
+
+    auto start = std::chrono::steady_clock::now();
+    uint64_t last_prints = 0;
+    for (uint32_t sec = 1; sec <= duration_secs; sec++) {
+        std::this_thread::sleep_until(start + std::chrono::seconds(sec));
+        uint64_t prints = printer->prints();
+        printf("[%4us] %" PRIu64 " printed (%" PRIu64 "/s), RSS %" PRIu64
+               " KiB, %" PRIu64 " threads\n", sec, prints,
+               prints - last_prints, ProcStatusValue("VmRSS"),
+               ProcStatusValue("Threads"));
+        last_prints = prints;
+    }
+
+    double secs = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    printf("\nPrinted %" PRIu64 " images, %" PRIu64 " rows in %.1f s\n",
+           printer->prints(), printer->rows_printed(), secs);
+    printf("  %.2f prints/s, printer busy %.0f%% of the time\n",
+           printer->prints() / secs,
+           100.0 * printer->rows_printed() / rows_per_sec / secs);
+    printf("  Peak RSS %" PRIu64 " KiB\n", ProcStatusValue("VmHWM"));
+    printf("%s\n", bot.StatsString().c_str());
+    fflush(stdout);
+
+    /* The long poll can't be stopped, so don't wait for it. */
+    _exit(0);
+}
+
+};
+
+int main(int argc, char *argv[])
+{
+    return sticker_bot::real_main(argc, argv);
+}
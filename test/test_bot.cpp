@@ -1,20 +1,45 @@
 #include <string>
 #include <memory>
+#include <stdlib.h>
 
 #include "status.h"
+#include "async_m02_pro.h"
+#include "event_loop.h"
+#include "feed_thread.h"
 #include "m02_pro.h"
+#include "printer_supervisor.h"
 #include "image_transform.h"
+#include "job_journal.h"
 #include "bot.h"
 
 #define DEFAULT_PRINTER_PATH "/dev/rfcomm0"
+#define DEFAULT_JOURNAL_PATH "print_jobs.journal"
 #define BYTES_X 0x48
 
 namespace sticker_bot {
 
+/* An environment variable from 1 to max, or 0 if it's unset or isn't one. */
+static uint8_t SettingFromEnv(const char *name, uint8_t max)
+{
+    const char *value = getenv(name);
+    if (value == NULL) {
+        return 0;
+    }
+
+    char *end;
+    unsigned long setting = strtoul(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || setting < 1 || setting > max) {
+        printf("Ignoring %s=%s, it's from 1 to %u\n", name, value, max);
+        return 0;
+    }
+    return setting;
+}
+
 int real_main(int argc, char *argv[])
 {
     if (argc < 2) {
-        printf("Usage: %s <Telegram API key> [Printer Path]\n", argv[0]);
+        printf("Usage: %s <Telegram API key> [Printer Path] [Journal Path]\n",
+               argv[0]);
         return -1;
     }
     std::string token = argv[1];
@@ -23,18 +48,131 @@ int real_main(int argc, char *argv[])
     if (argc >= 3) {
         printer_path = argv[2];
     }
+    std::string journal_path = DEFAULT_JOURNAL_PATH;
+    if (argc >= 4) {
+        journal_path = argv[3];
+    }
 
-    auto m02_pro = M02Pro::Create(printer_path);
-    if (!m02_pro.has_value()) {
-        m02_pro.error().print_status();
+    /*
+     * PRINTER_IO=async drives the printer from an event loop thread instead
+     * of blocking the print thread. The loop has to outlive the bot.
+     */
+    std::unique_ptr<EventLoop> loop;
+    const char *printer_io = getenv("PRINTER_IO");
+    if (printer_io != NULL && std::string(printer_io) == "async") {
+        auto event_loop = EventLoop::Create();
+        if (!event_loop.has_value()) {
+            event_loop.error().print_status();
+            return -1;
+        }
+        loop = std::move(event_loop.value());
+    }
+
+    /*
+     * The printer is opened in the background and reopened whenever the link
+     * drops, so the bot runs without it. PRINTER_REBIND is run before
+     * retrying a failed open, e.g. "rfcomm bind 0 <MAC>".
+     */
+    SupervisorOptions supervisor_options = kDefaultSupervisorOptions;
+    const char *printer_rebind = getenv("PRINTER_REBIND");
+    if (printer_rebind != NULL) {
+        supervisor_options.rebind_command = printer_rebind;
+    }
+
+    /*
+     * PRINTER_SPEED (1-5) and PRINTER_DENSITY (1-15) trade darkness for
+     * speed. FEED_PRIORITY (SCHED_FIFO, 1-99), FEED_CPU and FEED_MLOCK=1 keep
+     * the thread sending images from being held up, see README.md.
+     */
+    M02ProOptions printer_options = kDefaultM02ProOptions;
+    printer_options.speed = SettingFromEnv("PRINTER_SPEED", kMaxPrinterSpeed);
+    printer_options.density = SettingFromEnv("PRINTER_DENSITY",
+                                             kMaxPrinterDensity);
+    const char *feed_priority = getenv("FEED_PRIORITY");
+    if (feed_priority != NULL) {
+        printer_options.feed.realtime_priority = strtol(feed_priority, NULL,
+                                                        10);
+    }
+    const char *feed_cpu = getenv("FEED_CPU");
+    if (feed_cpu != NULL) {
+        printer_options.feed.cpu = strtol(feed_cpu, NULL, 10);
+    }
+    const char *feed_mlock = getenv("FEED_MLOCK");
+    if (feed_mlock != NULL && std::string(feed_mlock) == "1") {
+        printer_options.feed.lock_memory = true;
+    }
+    /* With async IO, the loop's thread is the one that feeds. */
+    if (loop) {
+        FeedOptions feed = printer_options.feed;
+        loop->Post([feed]() {
+            Status status = SetFeedThread(feed);
+            if (!status.Ok()) {
+                status.print_status();
+            }
+        });
+    }
+
+    EventLoop *event_loop = loop.get();
+    auto printer = std::make_unique<PrinterSupervisor>(
+            [printer_path, event_loop, printer_options]()
+                -> std::expected<std::unique_ptr<PrinterInterface>, Status> {
+                if (event_loop != nullptr) {
+                    return AsyncM02Pro::Create(printer_path, event_loop,
+                                               printer_options);
+                }
+                return M02Pro::Create(printer_path, printer_options);
+            }, supervisor_options);
+
+    auto journal = JobJournal::Open(journal_path);
+    if (!journal.has_value()) {
+        journal.error().print_status();
         return -1;
     }
-    std::unique_ptr<PrinterInterface> printer = std::move(m02_pro.value());
 
-    Bot bot(token, std::move(printer));
+    /* PHOTO_SIZE=largest goes back to downloading the original photos. */
+    BotOptions options = kDefaultBotOptions;
+    const char *photo_size = getenv("PHOTO_SIZE");
+    if (photo_size != NULL && std::string(photo_size) == "largest") {
+        options.photo_size_policy = PhotoSizePolicy::kLargest;
+    }
+    /* WEBHOOK_URL turns on webhook mode, see README.md. */
+    const char *webhook_url = getenv("WEBHOOK_URL");
+    if (webhook_url != NULL) {
+        options.webhook_url = webhook_url;
+    }
+    const char *webhook_port = getenv("WEBHOOK_PORT");
+    if (webhook_port != NULL) {
+        options.webhook_port = strtoul(webhook_port, NULL, 10);
+    }
+    const char *webhook_secret = getenv("WEBHOOK_SECRET");
+    if (webhook_secret != NULL) {
+        options.webhook_secret = webhook_secret;
+    }
+    const char *download_concurrency = getenv("DOWNLOAD_CONCURRENCY");
+    if (download_concurrency != NULL) {
+        options.download_concurrency = strtoul(download_concurrency, NULL, 10);
+    }
+    /* ADMIN_CHATS=123,456 lets those chats use /prefetch. */
+    const char *admin_chats = getenv("ADMIN_CHATS");
+    if (admin_chats != NULL) {
+        for (const auto &chat : StringTools::split(admin_chats, ',')) {
+            options.admin_chat_ids.push_back(strtoll(chat.c_str(), NULL, 10));
+        }
+    }
+    const char *raster_cache_mb = getenv("RASTER_CACHE_MB");
+    if (raster_cache_mb != NULL) {
+        options.raster_cache_bytes =
+            static_cast<size_t>(strtoul(raster_cache_mb, NULL, 10)) << 20;
+    }
+
+    Bot bot(token, std::move(printer), std::move(journal.value()), options);
 
     bot.InitBot();
-    bot.RunBot();
+    Status status = bot.RunBot();
+    if (!status.Ok()) {
+        status.print_status();
+        return -1;
+    }
 
     return 0;
 }